@@ -0,0 +1,425 @@
+/* batchstat.h: Retrieves the attributes of many files in a directory at once.
+	Uses io_uring to submit statx() calls in batches and falls back to a set of worker threads if io_uring is unavailable. */
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#pragma region Types
+
+typedef struct
+{
+	/* The name of the file, relative to the directory */
+	const char *name;
+	/* The retrieved attributes. Only valid if err is 0. */
+	struct statx stx;
+	/* 0 on success, the errno of statx() on failure */
+	int err;
+} bstat_t;
+
+/* Called once for every finished request, in order of completion.
+	Returning nonzero cancels all remaining requests. */
+typedef int (*bstat_cb_t)(void *arg, bstat_t *req);
+
+enum bstat_flags
+{
+	// Never use io_uring
+	BSTAT_NOURING = 1,
+	// Never use worker threads
+	BSTAT_NOTHREADS = 2,
+};
+
+#pragma endregion
+
+#pragma region Interface Declaration
+/* Runs statx() on every request, relative to dirfd and without following symlinks.
+	Calls cb for every finished request as soon as possible.
+	Returns 0 if every request finished, or the nonzero value returned by cb. */
+int bstat_run(int dirfd, bstat_t *reqs, size_t n, bstat_cb_t cb, void *arg, enum bstat_flags flags);
+#pragma endregion
+
+#pragma region Internal Functions
+#define _BSTAT_MASK STATX_BASIC_STATS
+// Submission queue depth of the io_uring backend
+#define _BSTAT_DEPTH 256
+// Minimum amount of requests per worker thread
+#define _BSTAT_PER_THREAD 32
+#define _BSTAT_MAX_THREADS 16
+
+static inline void _bstat_one(int dirfd, bstat_t *req)
+{
+	req->err = statx(dirfd, req->name, AT_SYMLINK_NOFOLLOW, _BSTAT_MASK, &req->stx) ? errno : 0;
+}
+
+/* Runs every request on the calling thread. */
+static int _bstat_sync(int dirfd, bstat_t *reqs, size_t n, bstat_cb_t cb, void *arg)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		_bstat_one(dirfd, reqs + i);
+		int r = cb(arg, reqs + i);
+
+		if(r)
+			return r;
+	}
+
+	return 0;
+}
+
+struct _bstat_ring
+{
+	int fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqmap, *cqmap;
+	size_t sqlen, cqlen, sqeslen;
+	unsigned entries;
+};
+
+static void _bstat_ring_close(struct _bstat_ring *r)
+{
+	if(r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqeslen);
+	if(r->cqmap && r->cqmap != MAP_FAILED && r->cqmap != r->sqmap)
+		munmap(r->cqmap, r->cqlen);
+	if(r->sqmap && r->sqmap != MAP_FAILED)
+		munmap(r->sqmap, r->sqlen);
+
+	close(r->fd);
+}
+
+/* Sets up an io_uring instance. Returns false and sets errno on failure. */
+static bool _bstat_ring_open(struct _bstat_ring *r)
+{
+	struct io_uring_params p = {};
+	*r = (struct _bstat_ring){};
+	r->fd = syscall(__NR_io_uring_setup, _BSTAT_DEPTH, &p);
+
+	if(r->fd < 0)
+		return false;
+
+	r->entries = p.sq_entries;
+	r->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if((p.features & IORING_FEAT_SINGLE_MMAP) && r->cqlen > r->sqlen)
+		r->sqlen = r->cqlen;
+
+	r->sqmap = mmap(NULL, r->sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+
+	if(r->sqmap == MAP_FAILED)
+		goto fail;
+
+	r->cqmap = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sqmap
+		: mmap(NULL, r->cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+
+	if(r->cqmap == MAP_FAILED)
+		goto fail;
+
+	r->sqes = mmap(NULL, r->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+	if(r->sqes == MAP_FAILED)
+		goto fail;
+
+	#define _SQ(f) (unsigned*)((char*)r->sqmap + p.sq_off.f)
+	#define _CQ(f) (unsigned*)((char*)r->cqmap + p.cq_off.f)
+	r->sqhead = _SQ(head);
+	r->sqtail = _SQ(tail);
+	r->sqmask = _SQ(ring_mask);
+	r->sqarray = _SQ(array);
+	r->cqhead = _CQ(head);
+	r->cqtail = _CQ(tail);
+	r->cqmask = _CQ(ring_mask);
+	r->cqes = (struct io_uring_cqe*)((char*)r->cqmap + p.cq_off.cqes);
+	#undef _SQ
+	#undef _CQ
+
+	return true;
+
+	fail:;
+	int eno = errno;
+	_bstat_ring_close(r);
+	errno = eno;
+
+	return false;
+}
+
+/* Handles the completions in the ring, marking their requests as reaped and calling cb for them unless *ret is set already.
+	Returns the number of completions. */
+static size_t _bstat_reap(struct _bstat_ring *r, int dirfd, bstat_t *reqs, bool *reaped, bstat_cb_t cb, void *arg, int *ret)
+{
+	unsigned chead = *r->cqhead;
+	unsigned ctail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+	size_t count = 0;
+
+	for (; chead != ctail; chead++, count++)
+	{
+		struct io_uring_cqe *cqe = &r->cqes[chead & *r->cqmask];
+		bstat_t *req = reqs + cqe->user_data;
+
+		if(cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+			// the kernel doesn't know IORING_OP_STATX
+			_bstat_one(dirfd, req);
+		else
+			req->err = (cqe->res < 0) ? -cqe->res : 0;
+
+		reaped[cqe->user_data] = true;
+
+		if(!*ret)
+			*ret = cb(arg, req);
+	}
+
+	__atomic_store_n(r->cqhead, chead, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+/* Runs the requests using io_uring and stores the result for bstat_run() in _ret.
+	Returns false and sets errno if io_uring can't be used, in which case no request was started. */
+static bool _bstat_uring(int dirfd, bstat_t *reqs, size_t n, bstat_cb_t cb, void *arg, int *_ret)
+{
+	struct _bstat_ring r;
+	// which requests completed, so those left over if the ring fails can be run again
+	bool *reaped = calloc(n, sizeof(bool));
+
+	if(!reaped)
+		return false;
+
+	if(!_bstat_ring_open(&r))
+	{
+		int eno = errno;
+		free(reaped);
+		errno = eno;
+
+		return false;
+	}
+
+	size_t next = 0, inflight = 0;
+	int ret = 0;
+
+	for(;;)
+	{
+		// fill the submission queue
+		unsigned tail = *r.sqtail;
+		unsigned head = __atomic_load_n(r.sqhead, __ATOMIC_ACQUIRE);
+		unsigned submit = 0;
+
+		while(!ret && next < n && inflight + submit < r.entries && tail - head < r.entries)
+		{
+			unsigned i = tail & *r.sqmask;
+			struct io_uring_sqe *sqe = &r.sqes[i];
+
+			*sqe = (struct io_uring_sqe){
+				.opcode = IORING_OP_STATX,
+				.fd = dirfd,
+				.addr = (uintptr_t)reqs[next].name,
+				.len = _BSTAT_MASK,
+				.off = (uintptr_t)&reqs[next].stx,
+				.statx_flags = AT_SYMLINK_NOFOLLOW,
+				.user_data = next,
+			};
+
+			r.sqarray[i] = i;
+			tail++;
+			next++;
+			submit++;
+		}
+
+		__atomic_store_n(r.sqtail, tail, __ATOMIC_RELEASE);
+		inflight += submit;
+
+		if(!inflight)
+			break;
+
+		while(syscall(__NR_io_uring_enter, r.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		{
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			{ // the submissions the kernel didn't take are still queued in the ring
+				submit = tail - __atomic_load_n(r.sqhead, __ATOMIC_ACQUIRE);
+				continue;
+			}
+
+			int eno = errno;
+			// the kernel writes the results of the requests it took from the submission queue until they complete
+			size_t queued = tail - __atomic_load_n(r.sqhead, __ATOMIC_ACQUIRE), owned = inflight - queued;
+
+			if(next == queued && !ret)
+			{ // nothing started yet, let the caller fall back
+				_bstat_ring_close(&r);
+				free(reaped);
+				errno = eno;
+
+				return false;
+			}
+
+			while(owned)
+			{
+				size_t count = _bstat_reap(&r, dirfd, reqs, reaped, cb, arg, &ret);
+
+				owned -= count;
+
+				if(owned && !count && syscall(__NR_io_uring_enter, r.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+					// the completions are still posted without waiting in the kernel
+					usleep(1000);
+			}
+
+			_bstat_ring_close(&r);
+
+			// finish whatever was submitted but never completed, and whatever wasn't submitted, synchronously
+			for (size_t i = 0; !ret && i < next; i++)
+			{
+				if(reaped[i])
+					continue;
+
+				_bstat_one(dirfd, reqs + i);
+				ret = cb(arg, reqs + i);
+			}
+
+			*_ret = ret ? ret : _bstat_sync(dirfd, reqs + next, n - next, cb, arg);
+			free(reaped);
+
+			return true;
+		}
+
+		inflight -= _bstat_reap(&r, dirfd, reqs, reaped, cb, arg, &ret);
+	}
+
+	_bstat_ring_close(&r);
+	free(reaped);
+	*_ret = ret;
+
+	return true;
+}
+
+struct _bstat_pool
+{
+	int dirfd;
+	bstat_t *reqs;
+	size_t n;
+	// The next request to start
+	size_t next;
+	// Set if the remaining requests shouldn't be started
+	bool stop;
+	// Indices of finished requests, in order of completion
+	size_t *done;
+	size_t ndone;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *_bstat_worker(void *_pool)
+{
+	struct _bstat_pool *p = _pool;
+	size_t i;
+
+	while(!__atomic_load_n(&p->stop, __ATOMIC_RELAXED) && (i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->n)
+	{
+		_bstat_one(p->dirfd, p->reqs + i);
+
+		pthread_mutex_lock(&p->lock);
+		p->done[p->ndone++] = i;
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	return NULL;
+}
+
+/* Runs the requests on worker threads and stores the result for bstat_run() in _ret.
+	Returns false and sets errno if no thread could be started, in which case no request was started. */
+static bool _bstat_threads(int dirfd, bstat_t *reqs, size_t n, bstat_cb_t cb, void *arg, int *_ret)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t count = n / _BSTAT_PER_THREAD + 1;
+
+	if(cpus > 0 && count > (size_t)cpus * 2)
+		count = cpus * 2;
+	if(count > _BSTAT_MAX_THREADS)
+		count = _BSTAT_MAX_THREADS;
+
+	struct _bstat_pool p = { .dirfd = dirfd, .reqs = reqs, .n = n, .done = malloc(n * sizeof(size_t)) };
+	pthread_t threads[_BSTAT_MAX_THREADS];
+	size_t started = 0;
+
+	if(!p.done)
+		return false;
+
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+
+	for (; started < count; started++)
+	{
+		if((errno = pthread_create(&threads[started], NULL, _bstat_worker, &p)))
+			break;
+	}
+
+	int ret = 0;
+
+	if(started)
+	{
+		for (size_t seen = 0; !ret && seen < n;)
+		{
+			pthread_mutex_lock(&p.lock);
+
+			while(p.ndone == seen)
+				pthread_cond_wait(&p.cond, &p.lock);
+
+			size_t upto = p.ndone;
+			pthread_mutex_unlock(&p.lock);
+
+			// done[] below upto isn't written anymore
+			for (; !ret && seen < upto; seen++)
+				ret = cb(arg, reqs + p.done[seen]);
+		}
+
+		__atomic_store_n(&p.stop, true, __ATOMIC_RELAXED);
+
+		for (size_t i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+	}
+
+	int eno = errno;
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+	free(p.done);
+	errno = eno;
+	*_ret = ret;
+
+	return started;
+}
+
+#pragma endregion
+
+#pragma region Implementation
+
+int bstat_run(int dirfd, bstat_t *reqs, size_t n, bstat_cb_t cb, void *arg, enum bstat_flags flags)
+{
+	int r = 0;
+
+	if(!n)
+		return 0;
+	if(!(flags & BSTAT_NOURING) && _bstat_uring(dirfd, reqs, n, cb, arg, &r))
+		return r;
+	if(!(flags & BSTAT_NOTHREADS) && n > 1 && _bstat_threads(dirfd, reqs, n, cb, arg, &r))
+		return r;
+
+	return _bstat_sync(dirfd, reqs, n, cb, arg);
+}
+
+#pragma endregion
@@ -0,0 +1,118 @@
+// unit testing, in C
+#include "batchstat.h"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define FILES 300
+
+static char dirpath[32];
+static char names[FILES + 1][16];
+static bstat_t reqs[FILES + 1];
+static bool seen[FILES + 1];
+
+/* Creates a directory with files of different sizes and a request for each of them plus a missing file */
+static int setup()
+{
+	strcpy(dirpath, "/tmp/batchstat_testXXXXXX");
+
+	if(!mkdtemp(dirpath))
+		faile();
+
+	int dirfd = open(dirpath, O_RDONLY | O_DIRECTORY);
+
+	if(dirfd < 0)
+		faile();
+
+	for (int i = 0; i < FILES; i++)
+	{
+		snprintf(names[i], sizeof(names[i]), "file%d", i);
+		int fd = openat(dirfd, names[i], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+		if(fd < 0 || ftruncate(fd, i))
+			faile();
+
+		close(fd);
+	}
+
+	strcpy(names[FILES], "missing");
+	return dirfd;
+}
+
+static void cleanup(int dirfd)
+{
+	for (int i = 0; i < FILES; i++)
+		unlinkat(dirfd, names[i], 0);
+
+	close(dirfd);
+	rmdir(dirpath);
+}
+
+static int check(__attribute__ ((unused)) void *arg, bstat_t *req)
+{
+	size_t i = req - reqs;
+
+	assertMsg(i <= FILES, "callback got a foreign request\n")
+	assertMsg(!seen[i], "request %zu finished twice\n", i)
+	seen[i] = true;
+
+	if(i == FILES)
+	{
+		assertMsg(req->err == ENOENT, "Expected ENOENT for missing file, got %s\n", strerror(req->err))
+	}
+	else
+	{
+		assertMsg(!req->err, "statx failed for %s: %s\n", req->name, strerror(req->err))
+		assertMsg(req->stx.stx_size == i, "%s has size %llu, expected %zu\n", req->name, (unsigned long long)req->stx.stx_size, i)
+	}
+
+	return 0;
+}
+
+static int stopAt10(void *arg, bstat_t *req)
+{
+	check(arg, req);
+	return ++*(int*)arg == 10 ? 42 : 0;
+}
+
+static void runWith(enum bstat_flags flags)
+{
+	int dirfd = setup();
+
+	for (int i = 0; i <= FILES; i++)
+		reqs[i] = (bstat_t){ .name = names[i] };
+
+	memset(seen, 0, sizeof(seen));
+	int r = bstat_run(dirfd, reqs, FILES + 1, check, NULL, flags);
+	assertMsg(r == 0, "bstat_run returned %d\n", r)
+
+	for (int i = 0; i <= FILES; i++)
+		assertMsg(seen[i], "No callback for request %d\n", i)
+
+	// cancelling
+	int count = 0;
+	memset(seen, 0, sizeof(seen));
+	r = bstat_run(dirfd, reqs, FILES + 1, stopAt10, &count, flags);
+	assertMsg(r == 42, "bstat_run didn't pass on the callback's return value, got %d\n", r)
+	assertMsg(count == 10, "Callback called %d times after cancelling at 10\n", count)
+
+	cleanup(dirfd);
+}
+
+void testUring()
+{
+	runWith(BSTAT_NOTHREADS);
+}
+
+void testThreads()
+{
+	runWith(BSTAT_NOURING);
+}
+
+void testSync()
+{
+	runWith(BSTAT_NOURING | BSTAT_NOTHREADS);
+}
+
+const test_t tests[] = { testUring, testThreads, testSync };
@@ -0,0 +1,104 @@
+/* bench.c: measures the throughput of sequential reads and writes in a directory, e.g. a tagfs mount */
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#define BENCH_BLOCK (1 << 20)
+#define BENCH_NAME "tagfs-bench.tmp"
+
+static const char usage[] =
+	"Usage:\n"
+	"	tagfs-bench <directory> [label] [MiB]\n"
+	"Writes a file of the given size (default 256MiB) to the directory in 1MiB blocks, reads it back and removes it.\n";
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+
+	const char *label = (argc > 2) ? argv[2] : argv[1];
+	long mib = (argc > 3) ? atol(argv[3]) : 256;
+	char *path = malloc(strlen(argv[1]) + sizeof(BENCH_NAME) + 1);
+	char *buf = malloc(BENCH_BLOCK);
+
+	if(mib <= 0 || !path || !buf)
+	{
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+
+	sprintf(path, "%s/%s", argv[1], BENCH_NAME);
+	memset(buf, 't', BENCH_BLOCK);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if(fd < 0)
+		goto err;
+
+	double t = now();
+
+	for (long i = 0; i < mib; i++)
+		if(write(fd, buf, BENCH_BLOCK) != BENCH_BLOCK)
+			goto err;
+
+	if(fsync(fd))
+		goto err;
+
+	double wt = now() - t;
+
+	// reads should come from the disk rather than the page cache
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		goto err;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	t = now();
+
+	ssize_t r;
+	long long total = 0;
+
+	while((r = read(fd, buf, BENCH_BLOCK)) > 0)
+		total += r;
+
+	if(r < 0)
+		goto err;
+
+	double rt = now() - t;
+
+	close(fd);
+	unlink(path);
+
+	if(total != (long long)mib * BENCH_BLOCK)
+	{
+		fprintf(stderr, "%s: read %lld bytes, wrote %lld\n", path, total, (long long)mib * BENCH_BLOCK);
+		return 1;
+	}
+
+	printf("%s: write %.1f MB/s, read %.1f MB/s (%ld MiB)\n", label, total / wt / 1e6, total / rt / 1e6, mib);
+	free(path);
+	free(buf);
+	return 0;
+
+	err:
+	perror(path);
+	unlink(path);
+	return 1;
+}
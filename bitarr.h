@@ -91,15 +91,15 @@ bitarr_t bitarr_new(size_t len)
 
 bool bitarr_get(bitarr_t arr, size_t index)
 {
-	return (bool)(arr[index / WORD] & (1 << (index % WORD)));
+	return (bool)(arr[index / WORD] & ((word)1 << (index % WORD)));
 }
 
 void bitarr_set(bitarr_t arr, size_t index, bool value)
 {
 	if(value)
-		arr[index / WORD] |= (1 << (index % WORD));
+		arr[index / WORD] |= ((word)1 << (index % WORD));
 	else
-		arr[index / WORD] &= ~(1 << (index % WORD));
+		arr[index / WORD] &= ~((word)1 << (index % WORD));
 }
 
 void bitarr_destroy(bitarr_t arr)
@@ -144,27 +144,20 @@ size_t bitarr_count(bitarr_t arr, size_t len, bool val)
 size_t bitarr_next(const bitarr_t arr, size_t start, size_t len, bool val)
 {
 	size_t z = _bitarr_size(len);
-	word skip = val ? 0 : WORD_MAX;
-	size_t p = start;
 
 	for (size_t w = start / WORD; w < z; w++)
 	{
-		if(arr[w] == skip)
-			continue;
+		word cur = val ? arr[w] : ~arr[w];
 
-		word cur = arr[w];
+		// Skips the bits before start
+		if(w == start / WORD)
+			cur &= WORD_MAX << (start % WORD);
+		if(!cur)
+			continue;
 
-		if(start % WORD)
-		{
-			cur >>= start % WORD;
-			start = 0;
-		}
+		size_t p = w * WORD + __builtin_ctzll(cur);
 
-		for (; p < len; cur >>= 1, p++)
-		{
-			if((cur & 1) == val)
-				return p;
-		}
+		return (p < len) ? p : (size_t)-1;
 	}
 
 	return -1;
@@ -265,19 +258,24 @@ void bitarr_merge(bitarr_t arr, size_t len, const bitarr_t pos, const bitarr_t n
 
 void bitarr_fill(bitarr_t arr, size_t startIndex, size_t length, bool value)
 {
-	// first partial word
-	if(startIndex % WORD)
+	size_t end = startIndex + length;
+
+	// Bits past the end keep their value, even in whole words
+	for (size_t i = startIndex; i < end; )
 	{
+		size_t bits = WORD - (i % WORD);
+
+		if(bits > end - i)
+			bits = end - i;
+
+		word mask = ((bits == WORD) ? WORD_MAX : (((word)1 << bits) - 1)) << (i % WORD);
+
 		if(value)
-			arr[startIndex / WORD] |= WORD_MAX << (startIndex % WORD);
+			arr[i / WORD] |= mask;
 		else
-			arr[startIndex / WORD] &= WORD_MAX >> (WORD - (startIndex % WORD));
-	}
-
-	word fill = value ? WORD_MAX : 0;
-	size_t l = _bitarr_size(startIndex + length);
+			arr[i / WORD] &= ~mask;
 
-	for (size_t i = _bitarr_size(startIndex); i < l; i++)
-		arr[i] = fill;
+		i += bits;
+	}
 }
 #pragma endregion
\ No newline at end of file
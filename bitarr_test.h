@@ -52,6 +52,28 @@ void testnext3()
 	#undef next
 }
 
+void testWords()
+{
+	bitarr_t arr = bitarr_new(BASE_LEN * 3);
+	int v;
+
+	// bits in higher words and past bit 31
+	bitarr_set(arr, 40, true);
+	bitarr_set(arr, BASE_LEN * 2 + 5, true);
+	assertMsg(bitarr_get(arr, 40) && !bitarr_get(arr, 8) && bitarr_count(arr, BASE_LEN * 3, true) == 2, "set failure above bit 31\n")
+	assertMsg((v = bitarr_next(arr, 41, BASE_LEN * 3, true)) == BASE_LEN * 2 + 5, "next across words: Got %d\n", v)
+	assertMsg((v = bitarr_next(arr, BASE_LEN * 2 + 6, BASE_LEN * 3, true)) == -1, "next past the last 1: Got %d\n", v)
+
+	// fills stop at their end, even within a word
+	bitarr_fill(arr, 3, 20, true);
+	assertMsg(bitarr_count(arr, BASE_LEN * 3, true) == 22 && !bitarr_get(arr, 23) && bitarr_get(arr, 40), "fill failure within a word\n")
+	assertMsg((v = bitarr_next(arr, 3, BASE_LEN * 3, false)) == 23, "next false: Got %d\n", v)
+	bitarr_fill(arr, 10, BASE_LEN * 2, false);
+	assertMsg(bitarr_count(arr, BASE_LEN * 3, true) == 7 && !bitarr_get(arr, BASE_LEN * 2 + 5), "fill failure across words\n")
+
+	bitarr_destroy(arr);
+}
+
 void testResize()
 {
 	bitarr_t arr = bitarr_new(BASE_LEN);
@@ -89,6 +111,6 @@ bitarr_t newBitarr()
 	return bitarr_new(BASE_LEN);
 }
 
-const test_t tests[] = { testnext1, testnext2, testnext3, testResize };
+const test_t tests[] = { testnext1, testnext2, testnext3, testWords, testResize };
 const ptest_t ptests[] = { testSimple };
 const factory_t factories[] = { (factory_t){ bitarr_destroy, newBitarr } };
\ No newline at end of file
@@ -0,0 +1,196 @@
+/* bulk.c: builds the tagdb of an unmounted tagfs directory from a manifest of its files and their tags */
+#define _GNU_SOURCE 1
+#include "tagdb.h"
+#include "layout.h"
+#include "realdir.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char usage[] =
+	"Usage:\n"
+	"	tagfs-bulk [-j threads] <manifest> <real directory>\n"
+	"Adds the files and tags listed in the manifest to the tagdb of the real directory, or to a new one.\n"
+	"Every line of the manifest names a file followed by its tags, separated by tabs if the first line has one, by commas otherwise.\n"
+	"Fields separated by commas may be quoted with '\"'. The manifest is parsed on the given number of threads, or on as many as fit its size.\n"
+	"The tagdb is checked against the real directory like on mounting, and written with its journals applied.\n"
+	"The directory must not be mounted meanwhile.\n";
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Opens the tagdb of the real directory and applies its journals, or creates an empty tagdb if there is none.
+	Returns NULL on failure. */
+static tagdb_t *openTdb(int dirfd)
+{
+	int fd = openat(dirfd, ".tagdb", O_RDONLY | O_CLOEXEC);
+	FILE *f = (fd >= 0) ? fdopen(fd, "r") : (errno == ENOENT) ? tmpfile() : NULL;
+	tagdb_t *tdb = f ? tdb_open(f, stderr) : NULL;
+
+	if(!tdb)
+	{
+		if(!f)
+			perror(".tagdb");
+		else if(fd >= 0)
+			fprintf(stderr, "Cannot read the tagdb\n");
+
+		return NULL;
+	}
+
+	// the journals hold every change made since the tagdb was written
+	if(!tdb_replayJournals(tdb, dirfd, ".tagdb"))
+	{
+		perror("Cannot replay the journals of the tagdb");
+		tdb_destroy(tdb);
+		return NULL;
+	}
+
+	return tdb;
+}
+
+/* Writes the tagdb to a new tagdb file with a new ID, which makes every journal stale, then removes the journals.
+	Returns false on failure. */
+static bool writeTdb(tagdb_t *tdb, int dirfd)
+{
+	int fd = openat(dirfd, ".tagdb.tmp", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	FILE *f = (fd < 0) ? NULL : fdopen(fd, "w+");
+
+	if(!f)
+	{
+		perror(".tagdb.tmp");
+
+		if(fd >= 0)
+			close(fd);
+
+		return false;
+	}
+
+	tdb->id++;
+
+	// the new file has to be complete before it replaces the old one
+	if(!tdb_write(tdb, f) || fflush(f) || fsync(fd) || renameat(dirfd, ".tagdb.tmp", dirfd, ".tagdb") || fsync(dirfd))
+	{
+		perror("Cannot write the tagdb");
+		fclose(f);
+		unlinkat(dirfd, ".tagdb.tmp", 0);
+		return false;
+	}
+
+	fclose(f);
+
+	if((unlinkat(dirfd, ".tagdb.journal.old", 0) && errno != ENOENT) || (unlinkat(dirfd, ".tagdb.journal", 0) && errno != ENOENT))
+	{
+		perror("Cannot remove the journals of the tagdb");
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	size_t threads = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "j:")) != -1)
+	{
+		if(opt != 'j')
+		{
+			fprintf(stderr, "%s", usage);
+			return 1;
+		}
+
+		threads = strtoul(optarg, NULL, 10);
+	}
+
+	if(argc - optind != 2)
+	{
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+
+	const char *manifest = argv[optind], *real = argv[optind + 1];
+	FILE *in = fopen(manifest, "r");
+	int dirfd = open(real, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int levels;
+
+	if(!in || dirfd < 0)
+	{
+		perror(in ? real : manifest);
+		return 1;
+	}
+
+	if((levels = layout_read(dirfd)) < 0)
+	{
+		fprintf(stderr, "Cannot read '%s' in '%s': %s\n", LAYOUT_FILE, real, strerror(errno));
+		return 1;
+	}
+
+	// the first line tells the separator
+	char *line = NULL;
+	size_t cap = 0;
+	char sep = (getline(&line, &cap, in) > 0 && strchr(line, '\t')) ? '\t' : ',';
+
+	free(line);
+
+	tagdb_t *tdb = openTdb(dirfd);
+
+	if(!tdb)
+		return 1;
+
+	double start = now();
+	ssize_t lines = tdb_import(tdb, in, sep, threads);
+	double parsed = now();
+
+	fclose(in);
+
+	if(lines < 0)
+	{
+		if(errno != EINVAL)
+			perror(manifest);
+
+		tdb_destroy(tdb);
+		return 1;
+	}
+
+	printf("Imported %zd lines in %.3fs (%.0f files/s)\n", lines, parsed - start, lines / (parsed - start));
+
+	realdir_fix_t fix;
+
+	if(realdir_chk(tdb, dirfd, levels, stderr, false, &fix) < 0)
+	{
+		fprintf(stderr, "The tagdb in '%s' is unchanged\n", real);
+		tdb_destroy(tdb);
+		return 1;
+	}
+
+	// no entries are added, so none can fail
+	ssize_t removed = realdir_fix(tdb, &fix, stderr);
+
+	if(!writeTdb(tdb, dirfd))
+	{
+		fprintf(stderr, "The tagdb in '%s' is unchanged\n", real);
+		tdb_destroy(tdb);
+		return 1;
+	}
+
+	double done = now();
+
+	printf("Checked and wrote the tagdb, removing %zd entries of missing files, in %.3fs overall (%.0f files/s)\n",
+		removed, done - start, lines / (done - start));
+
+	tdb_destroy(tdb);
+	close(dirfd);
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+/* export.c: converts a tagdb between the binary format tagfs writes and the text format */
+#define _GNU_SOURCE 1
+#include "tagdb.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+static const char usage[] =
+	"Usage:\n"
+	"	tagfs-export [-b] <tagdb> [output]\n"
+	"Writes the tagdb, in either format, as text to the output file or stdout.\n"
+	"Changes in the journals next to the tagdb, <tagdb>.journal and <tagdb>.journal.old, are included.\n"
+	"With -b, writes the binary format instead.\n";
+
+int main(int argc, char **argv)
+{
+	bool binary = argc > 1 && !strcmp(argv[1], "-b");
+
+	argc -= binary;
+	argv += binary;
+
+	if(argc < 2 || argc > 3)
+	{
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+
+	FILE *in = fopen(argv[1], "r");
+	tagdb_t *tdb = in ? tdb_open(in, stderr) : NULL;
+
+	if(!tdb)
+	{
+		if(!in)
+			perror(argv[1]);
+
+		return 1;
+	}
+
+	// the journals hold every change made since the tagdb was written
+	if(!tdb_replayJournals(tdb, AT_FDCWD, argv[1]))
+	{
+		fprintf(stderr, "Cannot replay the journals of '%s': %s\n", argv[1], strerror(errno));
+		tdb_destroy(tdb);
+		return 1;
+	}
+
+	FILE *out = (argc > 2) ? fopen(argv[2], "w") : stdout;
+
+	if(!out || !(binary ? tdb_write(tdb, out) : tdb_writeText(tdb, out)) || fclose(out))
+	{
+		perror((argc > 2) ? argv[2] : "stdout");
+		tdb_destroy(tdb);
+		return 1;
+	}
+
+	tdb_destroy(tdb);
+	return 0;
+}
@@ -30,6 +30,9 @@ struct hmap
 {
 	size_t len;
 	struct hmap_entry *entries;
+	/* Keys inside these lentLen bytes are used in place rather than copied, see hmap_lend */
+	const char *lent;
+	size_t lentLen;
 };
 
 typedef struct hmap *hmap_t;
@@ -59,6 +62,10 @@ HVAL_T *hmap_put(hmap_t map, const char *key, HVAL_T value);
 	The value must have been returned by a hmap function. */
 const char *hmap_key(HVAL_T *value);
 
+/* Retrieves the digest of the key for the given hmap value.
+	The value must have been returned by a hmap function. */
+struct hmap_digest hmap_digest(HVAL_T *value);
+
 /* Tries to insert an item into the hmap.
 	Does not override already existant entries.
 	If p isn't NULL, stores a pointer to the value in it.
@@ -67,6 +74,10 @@ const char *hmap_key(HVAL_T *value);
 	Returns -1 and sets errno on failure. */
 int hmap_tryIns(hmap_t map, const char *key, HVAL_T val, HVAL_T **p);
 
+/* Like hmap_tryIns(), with the digest of key known beforehand, e.g. from hmap_digest().
+	Skips hashing the key, so the digest has to be correct. */
+int hmap_tryInsDigest(hmap_t map, const char *key, struct hmap_digest hash, HVAL_T val, HVAL_T **p);
+
 /* Insert an item into the hmap.
 	Overrides already existant entries.
 	Returns 1 if the entry didn't exist.
@@ -82,11 +93,23 @@ bool hmap_del(hmap_t map, const char *key);
 
 /* Deletes the entry with the given value from the hmap.
 	The pointer must have been returned by a hmap function. */
-void hmap_delVal(HVAL_T *val);
+void hmap_delVal(hmap_t map, HVAL_T *val);
 
 /* Deallocates all resources used by the hmap. */
 void hmap_destroy(hmap_t hmap);
 
+/* Grows the hmap so that it holds at least count entries without resizing on insertion.
+	Returns false on malloc failure. */
+bool hmap_reserve(hmap_t map, size_t count);
+
+/* Makes the hmap use keys inside the len bytes at start in place when they're inserted, rather than copying them.
+	The memory has to stay unchanged until hmap_own or hmap_destroy are called. */
+void hmap_lend(hmap_t map, const char *start, size_t len);
+
+/* Copies every key used in place, so the memory given to hmap_lend may be released.
+	Returns false on malloc failure, in which case some keys may still be used in place. */
+bool hmap_own(hmap_t map);
+
 /* Allocates a new hmap. */
 hmap_t hmap_new();
 
@@ -134,6 +157,12 @@ static bool _hmap_matches(struct hmap_entry e, struct hmap_digest h, const char
 		&& (memcmp(e.key, key, h.keyLen) == 0);
 }
 
+/* Determines if the key is used in place, see hmap_lend */
+static inline bool _hmap_lent(hmap_t map, const char *key)
+{
+	return key >= map->lent && key < map->lent + map->lentLen;
+}
+
 /* Finds the matching entry for the given digest and key. */
 static struct hmap_entry *_hmap_get(hmap_t map, struct hmap_digest hash, const char *key)
 {
@@ -146,13 +175,16 @@ static struct hmap_entry *_hmap_get(hmap_t map, struct hmap_digest hash, const c
 	return NULL;
 }
 
+// Longest chain of entries moved to make room for a new one
+#define _HMAP_MAX_MOVES 256
+
 /* Attempts to relocate the entry at position cur.
 	Returns true and updates map on success.
 	Returns false on failure. */
 static bool _hmap_move(hmap_t map, size_t cur, size_t tries)
 {
-	// Detect loops/full maps
-	if(tries >= map->len)
+	// Detect loops/full maps. Long chains mean the map is too full anyway, and would overflow the stack.
+	if(tries >= map->len || tries >= _HMAP_MAX_MOVES)
 		return false;
 
 	// Determine the new position for the relocated entry
@@ -196,21 +228,27 @@ static struct hmap_entry *_hmap_put(hmap_t map, struct hmap_entry e)
 	#undef try
 }
 
-/* Attempts to resize the hashmap and reinsert the old entries and the new entry e.
+/* Attempts to resize the hashmap and reinsert the old entries and the new entry e, unless e has no key.
 	Returns 0 on success, 1 on benign error (the size doesn't yield a valid hashmap) and -1 on malloc failure.
 	If p isn't NULL and the operation succeeds, stores a pointer to the new entry for e in *p. */
 static int _hmap_resize(hmap_t map, size_t newsize, struct hmap_entry e, struct hmap_entry **p)
 {
 	//printf("Resizing from %zu to %zu\n", map->len, newsize);
-	struct hmap newmap = (struct hmap){ .len = newsize, .entries = calloc(newsize, sizeof(struct hmap_entry)) };
+	struct hmap newmap = *map;
+
+	newmap.len = newsize;
+	newmap.entries = calloc(newsize, sizeof(struct hmap_entry));
 
 	if(!newmap.entries)
 		return -1;
 
-	struct hmap_entry *cur;
+	struct hmap_entry *cur = NULL;
 
-	for (size_t i = 0; i <= map->len; i++)
+	for (size_t i = 0; i < map->len + (e.key ? 1 : 0); i++)
 	{
+		if(i < map->len && !map->entries[i].key)
+			continue;
+
 		cur = _hmap_put(&newmap, (i == map->len) ? e : map->entries[i]);
 
 		if(!cur)
@@ -232,17 +270,19 @@ static int _hmap_resize(hmap_t map, size_t newsize, struct hmap_entry e, struct
 
 
 /* Attempts to insert a new entry into the map, possibly changing its size.
-	Copies the key to construct a hmap_entry object.
+	Copies the key to construct a hmap_entry object, unless it's lent.
 	Returns the new entry on success.
 	Returns NULL on malloc failure. */
 static struct hmap_entry *_hmap_ins(hmap_t map, HVAL_T data, struct hmap_digest hash, const char *_key)
 {
-	char *key = malloc(hash.keyLen + 1);
+	bool lent = _hmap_lent(map, _key);
+	char *key = lent ? (char*)_key : malloc(hash.keyLen + 1);
 
 	if(!key)
 		return NULL;
+	if(!lent)
+		memcpy(key, _key, hash.keyLen + 1);
 
-	memcpy(key, _key, hash.keyLen + 1);
 	struct hmap_entry e = (struct hmap_entry){ .data = data, .key = key, .digest = hash };
 	struct hmap_entry *p = _hmap_put(map, e);
 
@@ -258,7 +298,9 @@ static struct hmap_entry *_hmap_ins(hmap_t map, HVAL_T data, struct hmap_digest
 				return p;
 
 			case -1:
-				free(key);
+				if(!lent)
+					free(key);
+
 				return NULL;
 		}
 	}
@@ -270,11 +312,13 @@ inline static struct hmap_entry *_hmap_entry(HVAL_T *val)
 	return (struct hmap_entry *)val;
 }
 
-static void _hmap_del(struct hmap_entry *e)
+static void _hmap_del(hmap_t map, struct hmap_entry *e)
 {
 	if(e)
 	{
-		free(e->key);
+		if(!_hmap_lent(map, e->key))
+			free(e->key);
+
 		e->key = NULL;
 	}
 }
@@ -322,7 +366,11 @@ HVAL_T *hmap_put(hmap_t map, const char *_key, HVAL_T data)
 
 int hmap_tryIns(hmap_t map, const char *key, HVAL_T value, HVAL_T **p)
 {
-	struct hmap_digest hash = _hmap_hash(key);
+	return hmap_tryInsDigest(map, key, _hmap_hash(key), value, p);
+}
+
+int hmap_tryInsDigest(hmap_t map, const char *key, struct hmap_digest hash, HVAL_T value, HVAL_T **p)
+{
 	struct hmap_entry *e = _hmap_get(map, hash, key);
 
 	if(e)
@@ -369,25 +417,30 @@ const char *hmap_key(HVAL_T *value)
 	return _hmap_entry(value)->key;
 }
 
+struct hmap_digest hmap_digest(HVAL_T *value)
+{
+	return _hmap_entry(value)->digest;
+}
+
 bool hmap_del(hmap_t map, const char *key)
 {
 	struct hmap_entry *e = _hmap_get(map, _hmap_hash(key), key);
 
-	_hmap_del(e);
+	_hmap_del(map, e);
 
 	return (bool)e;
 }
 
-void hmap_delVal(HVAL_T *val)
+void hmap_delVal(hmap_t map, HVAL_T *val)
 {
-	_hmap_del(_hmap_entry(val));
+	_hmap_del(map, _hmap_entry(val));
 }
 
 void hmap_destroy(hmap_t map)
 {
 	for (size_t i = 0; i < map->len; i++)
 	{
-		if(map->entries[i].key)
+		if(map->entries[i].key && !_hmap_lent(map, map->entries[i].key))
 			free(map->entries[i].key);
 	}
 
@@ -395,12 +448,65 @@ void hmap_destroy(hmap_t map)
 	free(map);
 }
 
+bool hmap_reserve(hmap_t map, size_t count)
+{
+	// cuckoo hashing with two positions per key fails often above half load
+	size_t newsize = count * 2 + 1;
+
+	if(newsize <= map->len)
+		return true;
+
+	for (;; newsize++)
+	{
+		switch(_hmap_resize(map, newsize, (struct hmap_entry){}, NULL))
+		{
+			case 0:
+				return true;
+
+			case -1:
+				return false;
+		}
+	}
+}
+
+void hmap_lend(hmap_t map, const char *start, size_t len)
+{
+	map->lent = start;
+	map->lentLen = len;
+}
+
+bool hmap_own(hmap_t map)
+{
+	for (size_t i = 0; i < map->len; i++)
+	{
+		struct hmap_entry *e = map->entries + i;
+
+		if(!e->key || !_hmap_lent(map, e->key))
+			continue;
+
+		char *key = malloc(e->digest.keyLen + 1);
+
+		if(!key)
+			return false;
+
+		memcpy(key, e->key, e->digest.keyLen + 1);
+		e->key = key;
+	}
+
+	map->lent = NULL;
+	map->lentLen = 0;
+
+	return true;
+}
+
 hmap_t hmap_new()
 {
 	hmap_t map = malloc(sizeof(struct hmap));
 
 	if(map)
 	{
+		map->lent = NULL;
+		map->lentLen = 0;
 		map->len = 10;
 		map->entries = calloc(10, sizeof(struct hmap_entry));
 
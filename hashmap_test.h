@@ -205,6 +205,49 @@ void testRand(hmap_t map)
 	})
 }
 
+void testLend(hmap_t map)
+{
+	if(!map)
+		failc(ENOMEM);
+
+	char keys[] = "key0\0key1\0key2\0key3";
+	char copy[] = "key4";
+
+	hmap_lend(map, keys, sizeof(keys));
+
+	for (int i = 0; i < 4; i++)
+		if(!hmap_ins(map, keys + i * 5, i))
+			faile();
+	if(!hmap_ins(map, copy, 4))
+		faile();
+
+	// lent keys are used in place, others are copied
+	int *v = hmap_get(map, "key2");
+
+	if(!v || *v != 2 || hmap_key(v) != keys + 10)
+		fail("Lent key isn't used in place\n");
+	if(hmap_key(hmap_get(map, "key4")) == copy)
+		fail("Key outside the lent memory isn't copied\n");
+
+	hmap_del(map, "key1");
+
+	if(!hmap_own(map))
+		faile();
+
+	memset(keys, 'x', sizeof(keys));
+
+	for (int i = 0; i < 5; i++)
+	{
+		char key[] = "key_";
+
+		key[3] = '0' + i;
+		v = hmap_get(map, key);
+
+		if((bool)v != (i != 1) || (v && *v != i))
+			fail("Wrong value for key '%s' after hmap_own\n", key);
+	}
+}
+
 const test_t tests[] = {  };
-const ptest_t ptests[] = { testSimple, testRand };
+const ptest_t ptests[] = { testSimple, testRand, testLend };
 const factory_t factories[] = { (factory_t){ hmap_destroy, hmap_new } };
\ No newline at end of file
@@ -0,0 +1,382 @@
+/* journal.h: An append-only log of records, made durable in groups.
+	Every record is written with its length and CRC-32 in a single write, so a record torn by a crash is detected
+	and cut off when the journal is replayed. Threads waiting for their records to be durable share one fdatasync. */
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Identifies a journal. Written once at its start, followed by the ID of the journal. */
+#define JOURNAL_MAGIC "tagjrnl1"
+#define JOURNAL_HDR_SIZE 16
+
+#pragma region Types
+
+/* Precedes the payload of every record */
+typedef struct
+{
+	/* Length of the payload. Never 0, so zeroed space after a crash isn't taken for records. */
+	uint32_t len;
+	/* CRC-32 of the payload */
+	uint32_t crc;
+} journal_rec_t;
+
+typedef struct
+{
+	int fd;
+	/* Set by the user of the journal when creating it, e.g. to tell which file it belongs to */
+	uint64_t id;
+	/* Length of the journal, including its header */
+	uint64_t size;
+	/* Number of records appended and number of records known to be durable */
+	uint64_t appended, synced;
+	/* Set while a thread syncs on behalf of all others */
+	bool syncing;
+	/* The first error of an append or sync, reported by every following journal_sync, or 0 */
+	int err;
+	/* Guards everything but fd */
+	pthread_mutex_t lock;
+	/* Signalled whenever a sync finishes */
+	pthread_cond_t cond;
+} journal_t;
+
+/* Called for every intact record on replay. Returns false and sets errno to stop the replay. */
+typedef bool (*journal_cb_t)(void *arg, const void *rec, size_t len);
+
+#pragma endregion
+
+#pragma region Interface Declaration
+/* Uses the file, which has to be opened for reading and appending, as journal.
+	Writes the header with the given ID to an empty file, otherwise the ID is read from the file.
+	A non-empty journal may be opened read-only for replaying it.
+	The journal owns fd afterwards, even on failure.
+	Returns NULL and sets errno on failure; EINVAL if the file isn't a journal. */
+journal_t *journal_open(int fd, uint64_t id);
+/* Calls cb for every record, in the order they were appended, until the first incomplete or damaged one.
+	Truncates the journal before that record, so new records follow the intact ones, unless fd is read-only.
+	Returns false and sets errno if cb or reading the journal fails. */
+bool journal_replay(journal_t *j, journal_cb_t cb, void *arg);
+/* Appends a record of len bytes, which isn't durable until journal_sync returns. len may not be 0.
+	Safe to call from any thread. Returns false and sets errno on failure. */
+bool journal_append(journal_t *j, const void *rec, size_t len);
+/* Waits until every record appended so far is durable.
+	Returns false and sets errno if any append or sync of the journal failed. */
+bool journal_sync(journal_t *j);
+/* Makes every following journal_sync fail with the error, e.g. if a record couldn't be built */
+void journal_fail(journal_t *j, int err);
+/* Removes every record, e.g. once they were applied to the file the journal belongs to, and changes the ID.
+	Returns false and sets errno on failure. */
+bool journal_reset(journal_t *j, uint64_t id);
+/* Makes every record appended so far durable, then continues the journal in the given empty file, with the given ID.
+	Returns the old file, which the journal doesn't use anymore, or -1 and sets errno on failure. */
+int journal_switch(journal_t *j, int fd, uint64_t id);
+/* Returns the length of the journal, in bytes */
+uint64_t journal_size(journal_t *j);
+/* Closes the journal without syncing it */
+void journal_close(journal_t *j);
+#pragma endregion
+
+#pragma region Internal Functions
+
+/* Continues the CRC-32 (as used by zlib) c over len bytes at p */
+static uint32_t _journal_crc(uint32_t c, const void *p, size_t len)
+{
+	const unsigned char *b = p;
+
+	c = ~c;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		c ^= b[i];
+
+		for (int k = 0; k < 8; k++)
+			c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+	}
+
+	return ~c;
+}
+
+/* Writes the header with the given ID to the empty file and makes it durable */
+static bool _journal_init(int fd, uint64_t id)
+{
+	char hdr[JOURNAL_HDR_SIZE];
+
+	memcpy(hdr, JOURNAL_MAGIC, 8);
+	memcpy(hdr + 8, &id, sizeof(id));
+
+	return write(fd, hdr, sizeof(hdr)) == sizeof(hdr) && !fdatasync(fd);
+}
+
+/* Waits until no thread syncs, so the file can be changed. Requires the lock of the journal. */
+static void _journal_idle(journal_t *j)
+{
+	while(j->syncing)
+		pthread_cond_wait(&j->cond, &j->lock);
+}
+
+#pragma endregion
+
+#pragma region Implementation
+
+journal_t *journal_open(int fd, uint64_t id)
+{
+	journal_t *j = calloc(1, sizeof(journal_t));
+	char hdr[JOURNAL_HDR_SIZE];
+	struct stat st;
+
+	if(!j || fstat(fd, &st))
+		goto err;
+
+	if(!st.st_size)
+	{
+		if(!_journal_init(fd, id))
+			goto err;
+
+		st.st_size = JOURNAL_HDR_SIZE;
+	}
+	else if(pread(fd, hdr, JOURNAL_HDR_SIZE, 0) != JOURNAL_HDR_SIZE || memcmp(hdr, JOURNAL_MAGIC, 8))
+	{
+		errno = EINVAL;
+		goto err;
+	}
+	else
+		memcpy(&id, hdr + 8, sizeof(id));
+
+	j->fd = fd;
+	j->id = id;
+	j->size = st.st_size;
+
+	if((errno = pthread_mutex_init(&j->lock, NULL)))
+		goto err;
+	if((errno = pthread_cond_init(&j->cond, NULL)))
+	{
+		pthread_mutex_destroy(&j->lock);
+		goto err;
+	}
+
+	return j;
+
+	err:;
+	int eno = errno;
+	close(fd);
+	free(j);
+	errno = eno;
+
+	return NULL;
+}
+
+bool journal_replay(journal_t *j, journal_cb_t cb, void *arg)
+{
+	size_t size = j->size, off = JOURNAL_HDR_SIZE;
+	const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, j->fd, 0);
+	bool ok = true;
+
+	if(map == MAP_FAILED)
+		return false;
+
+	madvise((void*)map, size, MADV_SEQUENTIAL);
+
+	while(size - off >= sizeof(journal_rec_t))
+	{
+		journal_rec_t r;
+
+		memcpy(&r, map + off, sizeof(r));
+
+		// the record was torn by a crash
+		if(!r.len || r.len > size - off - sizeof(r) || _journal_crc(0, map + off + sizeof(r), r.len) != r.crc)
+			break;
+		if(!(ok = cb(arg, map + off + sizeof(r), r.len)))
+			break;
+
+		off += sizeof(r) + r.len;
+	}
+
+	int eno = errno;
+	munmap((void*)map, size);
+	errno = eno;
+
+	if(!ok)
+		return false;
+	// a journal opened read-only is only read
+	if(off < size && ftruncate(j->fd, off) && errno != EBADF && errno != EINVAL)
+		return false;
+
+	j->size = off;
+	return true;
+}
+
+bool journal_append(journal_t *j, const void *rec, size_t len)
+{
+	if(!len || len > UINT32_MAX)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	journal_rec_t r = { .len = len, .crc = _journal_crc(0, rec, len) };
+	char *buf = malloc(sizeof(r) + len);
+	bool ok = false;
+
+	if(!buf)
+		return false;
+
+	// a single write, so records of different threads don't interleave
+	memcpy(buf, &r, sizeof(r));
+	memcpy(buf + sizeof(r), rec, len);
+	pthread_mutex_lock(&j->lock);
+
+	ssize_t c = write(j->fd, buf, sizeof(r) + len);
+
+	if(c == (ssize_t)(sizeof(r) + len))
+	{
+		j->size += c;
+		j->appended++;
+		ok = true;
+	}
+	else
+	{
+		int eno = (c < 0) ? errno : ENOSPC;
+
+		// a partial record would hide every later one from replay
+		if(c > 0 && ftruncate(j->fd, j->size))
+			eno = errno;
+		if(!j->err)
+			j->err = eno;
+
+		errno = eno;
+	}
+
+	pthread_mutex_unlock(&j->lock);
+	free(buf);
+
+	return ok;
+}
+
+bool journal_sync(journal_t *j)
+{
+	pthread_mutex_lock(&j->lock);
+
+	uint64_t target = j->appended;
+
+	while(j->synced < target && !j->err)
+	{
+		if(j->syncing)
+		{
+			pthread_cond_wait(&j->cond, &j->lock);
+			continue;
+		}
+
+		// this thread syncs every record appended so far, including those of the threads waiting meanwhile
+		uint64_t upto = j->appended;
+		int fd = j->fd;
+
+		j->syncing = true;
+		pthread_mutex_unlock(&j->lock);
+
+		int r = fdatasync(fd);
+		int eno = errno;
+
+		pthread_mutex_lock(&j->lock);
+		j->syncing = false;
+
+		if(r)
+			j->err = eno;
+		else if(upto > j->synced)
+			j->synced = upto;
+
+		pthread_cond_broadcast(&j->cond);
+	}
+
+	int err = j->err;
+	pthread_mutex_unlock(&j->lock);
+
+	if(err)
+		errno = err;
+
+	return !err;
+}
+
+void journal_fail(journal_t *j, int err)
+{
+	pthread_mutex_lock(&j->lock);
+
+	if(!j->err)
+		j->err = err;
+
+	pthread_mutex_unlock(&j->lock);
+}
+
+bool journal_reset(journal_t *j, uint64_t id)
+{
+	pthread_mutex_lock(&j->lock);
+	_journal_idle(j);
+
+	bool ok = !ftruncate(j->fd, 0) && _journal_init(j->fd, id);
+
+	if(ok)
+	{
+		j->id = id;
+		j->size = JOURNAL_HDR_SIZE;
+		j->synced = j->appended;
+	}
+
+	pthread_mutex_unlock(&j->lock);
+
+	return ok;
+}
+
+int journal_switch(journal_t *j, int fd, uint64_t id)
+{
+	int old = -1;
+
+	pthread_mutex_lock(&j->lock);
+	_journal_idle(j);
+
+	// nothing in the old file may be lost once it's replaced
+	if(j->err)
+		errno = j->err;
+	else if(!fdatasync(j->fd) && _journal_init(fd, id))
+	{
+		old = j->fd;
+		j->fd = fd;
+		j->id = id;
+		j->size = JOURNAL_HDR_SIZE;
+		j->synced = j->appended;
+	}
+
+	pthread_mutex_unlock(&j->lock);
+
+	return old;
+}
+
+uint64_t journal_size(journal_t *j)
+{
+	pthread_mutex_lock(&j->lock);
+	uint64_t size = j->size;
+	pthread_mutex_unlock(&j->lock);
+
+	return size;
+}
+
+void journal_close(journal_t *j)
+{
+	if(!j)
+		return;
+
+	close(j->fd);
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->cond);
+	free(j);
+}
+
+#pragma endregion
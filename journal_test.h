@@ -0,0 +1,207 @@
+// unit testing, in C
+#include "journal.h"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+#define RECORDS 1000
+#define THREADS 8
+
+static char path[32];
+
+/* Creates an empty file at a new path and opens it for appending */
+static int create()
+{
+	strcpy(path, "/tmp/journal_testXXXXXX");
+
+	int fd = mkstemp(path);
+
+	if(fd < 0)
+		faile();
+
+	close(fd);
+
+	if((fd = open(path, O_RDWR | O_APPEND)) < 0)
+		faile();
+
+	return fd;
+}
+
+static journal_t *openJournal(bool fresh)
+{
+	journal_t *j = journal_open(fresh ? create() : open(path, O_RDWR | O_APPEND), 1);
+
+	assertMsg(j, "journal_open failed: %s\n", strerror(errno))
+	return j;
+}
+
+static size_t replayed;
+
+/* Expects the records written by fill(), in order */
+static bool checkRecord(void *arg, const void *rec, size_t len)
+{
+	(void)arg;
+	char expected[32];
+
+	snprintf(expected, sizeof(expected), "record %zu", replayed++);
+	assertMsg(len == strlen(expected) + 1 && !memcmp(rec, expected, len), "Record %zu is '%.*s'\n", replayed - 1, (int)len, (const char*)rec)
+
+	return true;
+}
+
+static void fill(journal_t *j, size_t count)
+{
+	char rec[32];
+
+	for (size_t i = 0; i < count; i++)
+	{
+		snprintf(rec, sizeof(rec), "record %zu", i);
+		assertMsg(journal_append(j, rec, strlen(rec) + 1), "journal_append failed: %s\n", strerror(errno))
+	}
+
+	assertMsg(journal_sync(j), "journal_sync failed: %s\n", strerror(errno))
+}
+
+static size_t replay(journal_t *j)
+{
+	replayed = 0;
+	assertMsg(journal_replay(j, checkRecord, NULL), "journal_replay failed: %s\n", strerror(errno))
+
+	return replayed;
+}
+
+void testReplay()
+{
+	journal_t *j = openJournal(true);
+
+	fill(j, RECORDS);
+	journal_close(j);
+
+	j = openJournal(false);
+	assertMsg(replay(j) == RECORDS, "Replayed %zu of %d records\n", replayed, RECORDS)
+
+	// records appended after replaying follow the old ones
+	journal_reset(j, 2);
+	fill(j, 10);
+	journal_close(j);
+
+	j = openJournal(false);
+	assertMsg(replay(j) == 10, "Replayed %zu of 10 records after reset\n", replayed)
+	journal_close(j);
+	unlink(path);
+}
+
+void testTorn()
+{
+	journal_t *j = openJournal(true);
+
+	fill(j, RECORDS);
+
+	// a crash in the middle of the last record
+	uint64_t size = journal_size(j);
+
+	if(ftruncate(j->fd, size - 3))
+		faile();
+
+	journal_close(j);
+	j = openJournal(false);
+	assertMsg(replay(j) == RECORDS - 1, "Replayed %zu of %d records\n", replayed, RECORDS - 1)
+
+	// the torn record is cut off, so new records can be replayed
+	char rec[32];
+	snprintf(rec, sizeof(rec), "record %d", RECORDS - 1);
+	journal_append(j, rec, strlen(rec) + 1);
+	journal_close(j);
+
+	j = openJournal(false);
+	assertMsg(replay(j) == RECORDS, "Replayed %zu of %d records after appending\n", replayed, RECORDS)
+	journal_close(j);
+
+	// a damaged record ends the journal
+	int fd = open(path, O_RDWR);
+
+	if(fd < 0 || pwrite(fd, "X", 1, size / 2) != 1)
+		faile();
+
+	close(fd);
+	j = openJournal(false);
+	assertMsg(replay(j) < RECORDS, "Replayed %zu records past a damaged one\n", replayed)
+	journal_close(j);
+	unlink(path);
+}
+
+void testSwitch()
+{
+	journal_t *j = openJournal(true);
+	char first[sizeof(path)];
+
+	fill(j, 10);
+	strcpy(first, path);
+
+	// records appended after switching go to the new file only
+	int old = journal_switch(j, create(), 7);
+
+	assertMsg(old >= 0, "journal_switch failed: %s\n", strerror(errno))
+	assertMsg(j->id == 7 && journal_size(j) == JOURNAL_HDR_SIZE, "Switched journal has ID %ju and size %ju\n", (uintmax_t)j->id, (uintmax_t)journal_size(j))
+	close(old);
+	fill(j, 5);
+	journal_close(j);
+
+	j = openJournal(false);
+	assertMsg(j->id == 7 && replay(j) == 5, "New file has ID %ju and %zu records\n", (uintmax_t)j->id, replayed)
+	journal_close(j);
+	unlink(path);
+
+	strcpy(path, first);
+	j = openJournal(false);
+	assertMsg(replay(j) == 10, "Old file has %zu records\n", replayed)
+	journal_close(j);
+	unlink(path);
+}
+
+static void *appender(void *j)
+{
+	for (int i = 0; i < RECORDS / THREADS; i++)
+		if(!journal_append(j, "x", 1) || !journal_sync(j))
+			return (void*)1;
+
+	return NULL;
+}
+
+static bool countRecord(void *count, const void *rec, size_t len)
+{
+	(void)rec;
+	(void)len;
+	++*(size_t*)count;
+	return true;
+}
+
+void testGroupCommit()
+{
+	journal_t *j = openJournal(true);
+	pthread_t threads[THREADS];
+	size_t count = 0;
+
+	for (int i = 0; i < THREADS; i++)
+		if((errno = pthread_create(threads + i, NULL, appender, j)))
+			faile();
+
+	for (int i = 0; i < THREADS; i++)
+	{
+		void *r;
+		pthread_join(threads[i], &r);
+		assertMsg(!r, "Appending failed: %s\n", strerror(j->err))
+	}
+
+	assertMsg(j->synced == j->appended, "%ju of %ju records synced\n", (uintmax_t)j->synced, (uintmax_t)j->appended)
+	journal_close(j);
+
+	j = openJournal(false);
+	journal_replay(j, countRecord, &count);
+	assertMsg(count == RECORDS / THREADS * THREADS, "Replayed %zu records\n", count)
+	journal_close(j);
+	unlink(path);
+}
+
+const test_t tests[] = { testReplay, testTorn, testSwitch, testGroupCommit };
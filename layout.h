@@ -0,0 +1,291 @@
+/* layout.h: Where real files are stored in the real directory.
+	Files are either stored in the real directory itself, or spread over levels of 256 subdirectories each,
+	picked by a hash of the filename, so no directory grows too large. The subdirectory of a file only depends on its name.
+	The number of levels is recorded in the LAYOUT_FILE of the real directory; without one, the real directory is flat. */
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define LAYOUT_FILE ".tagdb.layout"
+#define LAYOUT_MAX_LEVELS 2
+// Size of a buffer for the path of a real file, relative to the real directory
+#define LAYOUT_PATH_MAX (LAYOUT_MAX_LEVELS * 3 + NAME_MAX + 1)
+
+#pragma region Types
+
+/* A stream of the entries of every leaf directory, i.e. of every real file */
+typedef struct
+{
+	int dirfd;
+	int levels;
+	/* The index of the leaf directory read from */
+	size_t leaf;
+	DIR *d;
+} layout_dir_t;
+
+#pragma endregion
+
+#pragma region Interface Declaration
+/* Reads the number of levels of the real directory from its layout file.
+	Returns 0 if there is no layout file, or -1 and sets errno on failure. */
+int layout_read(int dirfd);
+/* Records the number of levels of the real directory in its layout file.
+	Returns false and sets errno on failure. */
+bool layout_write(int dirfd, int levels);
+/* Returns the path of the real file with the given name, relative to the real directory.
+	Writes it to buf, which has to have room for LAYOUT_PATH_MAX characters, unless levels is 0. */
+const char *layout_path(int levels, const char *name, char *buf);
+/* Returns the number of leaf directories, i.e. directories containing real files */
+size_t layout_leaves(int levels);
+/* Returns the index of the leaf directory of the real file with the given name */
+size_t layout_leafOf(int levels, const char *name);
+/* Writes the path of the leaf directory with the given index, relative to the real directory, to buf.
+	buf needs room for LAYOUT_PATH_MAX characters. */
+void layout_leaf(int levels, size_t leaf, char *buf);
+/* Creates every missing subdirectory. Returns false and sets errno on failure. */
+bool layout_mkdirs(int dirfd, int levels);
+/* Opens a stream of the entries of every leaf directory, not including their "." and "..".
+	With 0 levels, this is every entry of the real directory, including "." and "..".
+	Returns NULL and sets errno on failure. */
+layout_dir_t *layout_opendir(int dirfd, int levels);
+/* Returns the next entry, or NULL at the end of the stream or on error, in which case errno is set. */
+struct dirent *layout_readdir(layout_dir_t *d);
+void layout_closedir(layout_dir_t *d);
+#pragma endregion
+
+#pragma region Internal Functions
+
+/* Hashes the name. Changing it moves every file, so it never changes. */
+static uint64_t _layout_hash(const char *name)
+{
+	// FNV-1a
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+
+	return h ^ (h >> 32);
+}
+
+/* Opens a directory stream relative to dirfd, independent of any other stream */
+static DIR *_layout_open(int dirfd, const char *path)
+{
+	int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if(fd < 0)
+		return NULL;
+
+	DIR *d = fdopendir(fd);
+
+	if(!d)
+		close(fd);
+
+	return d;
+}
+
+/* Opens the leaf directory the stream is at, or the next one if it's missing.
+	Returns false at the end of the stream, or on failure, in which case errno is set. */
+static bool _layout_nextLeaf(layout_dir_t *d)
+{
+	char buf[LAYOUT_PATH_MAX];
+
+	for (; d->leaf < layout_leaves(d->levels); d->leaf++)
+	{
+		layout_leaf(d->levels, d->leaf, buf);
+
+		if((d->d = _layout_open(d->dirfd, buf)))
+			return true;
+		// a missing subdirectory has no files
+		if((errno != ENOENT && errno != ENOTDIR) || !d->levels)
+			return false;
+	}
+
+	errno = 0;
+	return false;
+}
+
+#pragma endregion
+
+#pragma region Implementation
+
+int layout_read(int dirfd)
+{
+	int fd = openat(dirfd, LAYOUT_FILE, O_RDONLY | O_CLOEXEC);
+
+	if(fd < 0)
+		return (errno == ENOENT) ? 0 : -1;
+
+	FILE *f = fdopen(fd, "r");
+	int levels;
+
+	if(!f)
+	{
+		close(fd);
+		return -1;
+	}
+
+	if(fscanf(f, "levels %d", &levels) != 1 || levels < 0 || levels > LAYOUT_MAX_LEVELS)
+	{
+		fclose(f);
+		errno = EINVAL;
+		return -1;
+	}
+
+	fclose(f);
+	return levels;
+}
+
+bool layout_write(int dirfd, int levels)
+{
+	if(!levels)
+		return !unlinkat(dirfd, LAYOUT_FILE, 0) || errno == ENOENT;
+
+	int fd = openat(dirfd, LAYOUT_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if(fd < 0)
+		return false;
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "levels %d\n", levels);
+	bool ok = write(fd, buf, len) == len && !fsync(fd);
+
+	close(fd);
+
+	// replacing the layout file is atomic
+	if(!ok || renameat(dirfd, LAYOUT_FILE ".tmp", dirfd, LAYOUT_FILE))
+	{
+		int eno = errno;
+		unlinkat(dirfd, LAYOUT_FILE ".tmp", 0);
+		errno = eno;
+		return false;
+	}
+
+	return true;
+}
+
+const char *layout_path(int levels, const char *name, char *buf)
+{
+	if(!levels)
+		return name;
+
+	layout_leaf(levels, layout_leafOf(levels, name), buf);
+	size_t len = strlen(buf);
+
+	buf[len] = '/';
+	strncpy(buf + len + 1, name, LAYOUT_PATH_MAX - len - 2);
+	buf[LAYOUT_PATH_MAX - 1] = 0;
+	return buf;
+}
+
+size_t layout_leaves(int levels)
+{
+	return (size_t)1 << (8 * levels);
+}
+
+size_t layout_leafOf(int levels, const char *name)
+{
+	return _layout_hash(name) & (layout_leaves(levels) - 1);
+}
+
+void layout_leaf(int levels, size_t leaf, char *buf)
+{
+	if(!levels)
+	{
+		strcpy(buf, ".");
+		return;
+	}
+
+	// the lowest byte picks the first level
+	for (int i = 0; i < levels; i++, leaf >>= 8)
+		sprintf(buf + 3 * i, (i + 1 < levels) ? "%02zx/" : "%02zx", leaf & 0xff);
+}
+
+bool layout_mkdirs(int dirfd, int levels)
+{
+	char buf[LAYOUT_PATH_MAX];
+
+	for (int l = 1; l <= levels; l++)
+	{
+		for (size_t i = 0; i < layout_leaves(l); i++)
+		{
+			layout_leaf(l, i, buf);
+
+			if(mkdirat(dirfd, buf, 0755) && errno != EEXIST)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+layout_dir_t *layout_opendir(int dirfd, int levels)
+{
+	layout_dir_t *d = malloc(sizeof(layout_dir_t));
+
+	if(!d)
+		return NULL;
+
+	*d = (layout_dir_t){ .dirfd = dirfd, .levels = levels };
+
+	if(!_layout_nextLeaf(d) && errno)
+	{
+		int eno = errno;
+		free(d);
+		errno = eno;
+		return NULL;
+	}
+
+	return d;
+}
+
+struct dirent *layout_readdir(layout_dir_t *d)
+{
+	while(d->d)
+	{
+		errno = 0;
+		struct dirent *ent = readdir(d->d);
+
+		if(ent)
+		{
+			if(!d->levels || (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")))
+				return ent;
+
+			continue;
+		}
+		if(errno)
+			return NULL;
+
+		closedir(d->d);
+		d->d = NULL;
+		d->leaf++;
+		_layout_nextLeaf(d);
+	}
+
+	return NULL;
+}
+
+void layout_closedir(layout_dir_t *d)
+{
+	if(!d)
+		return;
+
+	if(d->d)
+		closedir(d->d);
+
+	free(d);
+}
+
+#pragma endregion
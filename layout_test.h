@@ -0,0 +1,131 @@
+// unit testing, in C
+#include "layout.h"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define FILES 500
+
+static char dirpath[32];
+static char names[FILES][16];
+
+static int setup()
+{
+	strcpy(dirpath, "/tmp/layout_testXXXXXX");
+
+	if(!mkdtemp(dirpath))
+		faile();
+
+	int dirfd = open(dirpath, O_RDONLY | O_DIRECTORY);
+
+	if(dirfd < 0)
+		faile();
+
+	for (int i = 0; i < FILES; i++)
+		snprintf(names[i], sizeof(names[i]), "file%d", i);
+
+	return dirfd;
+}
+
+static void cleanup(int dirfd, int levels)
+{
+	char buf[LAYOUT_PATH_MAX];
+
+	for (int i = 0; i < FILES; i++)
+		unlinkat(dirfd, layout_path(levels, names[i], buf), 0);
+
+	// deepest directories first
+	for (int l = levels; l > 0; l--)
+	{
+		for (size_t i = 0; i < layout_leaves(l); i++)
+		{
+			layout_leaf(l, i, buf);
+			unlinkat(dirfd, buf, AT_REMOVEDIR);
+		}
+	}
+
+	unlinkat(dirfd, LAYOUT_FILE, 0);
+	close(dirfd);
+	rmdir(dirpath);
+}
+
+void testPath()
+{
+	char buf[LAYOUT_PATH_MAX], leaf[LAYOUT_PATH_MAX];
+
+	assertMsg(layout_path(0, "a", buf)[0] == 'a', "Flat path isn't the name\n")
+
+	for (int levels = 1; levels <= LAYOUT_MAX_LEVELS; levels++)
+	{
+		const char *p = layout_path(levels, "some file.jpg", buf);
+		layout_leaf(levels, layout_leafOf(levels, "some file.jpg"), leaf);
+
+		assertMsg(strlen(p) == strlen(leaf) + 1 + strlen("some file.jpg"), "Path '%s' has the wrong length\n", p)
+		assertMsg(!strncmp(p, leaf, strlen(leaf)), "Path '%s' isn't in leaf '%s'\n", p, leaf)
+		assertMsg(!strcmp(p + strlen(leaf) + 1, "some file.jpg"), "Path '%s' doesn't end with the name\n", p)
+		assertMsg(strlen(leaf) == (size_t)(3 * levels - 1), "Leaf '%s' isn't %d levels deep\n", leaf, levels)
+	}
+
+	// the first level is the same for every number of levels, so migrating between them keeps files in their top directory
+	layout_leaf(1, layout_leafOf(1, "x"), leaf);
+	assertMsg(!strncmp(layout_path(2, "x", buf), leaf, 2), "Top directory of '%s' differs from '%s'\n", buf, leaf)
+}
+
+static void runWith(int levels)
+{
+	int dirfd = setup();
+	char buf[LAYOUT_PATH_MAX];
+
+	assertMsg(layout_read(dirfd) == 0, "Directory without layout file has %d levels\n", layout_read(dirfd))
+	assertMsg(layout_write(dirfd, levels), "layout_write failed: %s\n", strerror(errno))
+	assertMsg(layout_read(dirfd) == levels, "Read %d levels after writing %d\n", layout_read(dirfd), levels)
+	assertMsg(layout_mkdirs(dirfd, levels), "layout_mkdirs failed: %s\n", strerror(errno))
+
+	for (int i = 0; i < FILES; i++)
+	{
+		int fd = openat(dirfd, layout_path(levels, names[i], buf), O_WRONLY | O_CREAT, 0600);
+
+		if(fd < 0)
+			faile();
+
+		close(fd);
+	}
+
+	layout_dir_t *d = layout_opendir(dirfd, levels);
+	struct dirent *ent;
+	int found = 0;
+
+	assertMsg(d, "layout_opendir failed: %s\n", strerror(errno))
+
+	while((ent = layout_readdir(d)))
+	{
+		if(!strncmp(ent->d_name, "file", 4))
+		{
+			assertMsg(!d->levels || d->leaf == layout_leafOf(levels, ent->d_name), "'%s' found in the wrong leaf\n", ent->d_name)
+			found++;
+		}
+	}
+
+	assertMsg(!errno, "layout_readdir failed: %s\n", strerror(errno))
+	assertMsg(found == FILES, "Found %d of %d files\n", found, FILES)
+	layout_closedir(d);
+	cleanup(dirfd, levels);
+}
+
+void testFlat()
+{
+	runWith(0);
+}
+
+void testOneLevel()
+{
+	runWith(1);
+}
+
+void testTwoLevels()
+{
+	runWith(2);
+}
+
+const test_t tests[] = { testPath, testFlat, testOneLevel, testTwoLevels };
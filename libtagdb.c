@@ -0,0 +1,297 @@
+/* libtagdb.c: implements libtagdb.h on top of tagdb.h.
+	Only the functions declared in libtagdb.h are exported, see the makefile. */
+#define _GNU_SOURCE 1
+#include "libtagdb.h"
+#include "tagdb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#pragma region Types
+
+struct ltdb
+{
+	tagdb_t *tdb;
+	/* The file entries, by file index */
+	tagdb_entry_t **files;
+	size_t fileCount;
+	/* The indices of the files marked with tag ID t are tagFiles[tagOffs[t]] up to before tagFiles[tagOffs[t + 1]], ascending.
+		Lets queries only look at the files of one of their tags. */
+	size_t *tagOffs;
+	uint32_t *tagFiles;
+};
+
+struct ltdb_query
+{
+	ltdb_t *db;
+	/* The first pos tag IDs are of the tags files need, the one on the fewest files first, the rest of the tags they mustn't have */
+	size_t pos, count;
+	size_t tagIds[];
+};
+
+#pragma endregion
+
+#pragma region Internal Functions
+
+/* Builds the file index and the files of every tag. Returns false and sets errno on failure. */
+static bool _ltdb_index(ltdb_t *db)
+{
+	tagdb_t *tdb = db->tdb;
+	size_t files = 0;
+
+	TDB_FORALL(tdb, UNUSED name, e, {
+		if(e->kind == TDB_FILE_ENTRY)
+			files++;
+	})
+
+	if(files > UINT32_MAX)
+	{
+		errno = EOVERFLOW;
+		return false;
+	}
+
+	if(!(db->files = malloc((files ? files : 1) * sizeof(tagdb_entry_t*))) || !(db->tagOffs = calloc(tdb->tagCap + 1, sizeof(size_t))))
+		return false;
+
+	// count the files of every tag, then place them at the offsets following from the counts
+	TDB_FORALL(tdb, UNUSED name, e, {
+		if(e->kind != TDB_FILE_ENTRY)
+			continue;
+
+		db->files[db->fileCount++] = e;
+		_TDB_TAGS_FORALL(tdb, e, t, {
+			db->tagOffs[t + 1]++;
+		})
+	})
+
+	for (size_t t = 0; t < tdb->tagCap; t++)
+		db->tagOffs[t + 1] += db->tagOffs[t];
+
+	size_t *next = malloc((tdb->tagCap ? tdb->tagCap : 1) * sizeof(size_t));
+	size_t total = db->tagOffs[tdb->tagCap];
+
+	if(!next || !(db->tagFiles = malloc((total ? total : 1) * sizeof(uint32_t))))
+	{
+		free(next);
+		return false;
+	}
+
+	memcpy(next, db->tagOffs, tdb->tagCap * sizeof(size_t));
+
+	// files are visited by ascending index, so every list ends up sorted
+	for (size_t i = 0; i < db->fileCount; i++)
+		_TDB_TAGS_FORALL(tdb, db->files[i], t, {
+			db->tagFiles[next[t]++] = i;
+		})
+
+	free(next);
+
+	return true;
+}
+
+/* Resolves one name of a query path to a tag, the way tagfs resolves the name of a query directory.
+	Sets *neg if the tag is negated. Returns NULL and sets errno if there's no such tag. */
+static tagdb_entry_t *_ltdb_tag(tagdb_t *tdb, const char *name, bool *neg)
+{
+	tagdb_entry_t *e = tdb_get(tdb, name);
+
+	*neg = false;
+
+	if(e)
+	{
+		if(e->kind == TDB_TAG_ENTRY)
+			return e;
+
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	if((*name == '.' || *name == TDB_NEG_CHAR) && (e = tdb_get(tdb, name + 1)) && e->kind == TDB_TAG_ENTRY)
+	{
+		*neg = *name == TDB_NEG_CHAR;
+		return e;
+	}
+
+	errno = ENOENT;
+	return NULL;
+}
+
+static inline size_t _ltdb_tagFiles(const ltdb_t *db, size_t tagId)
+{
+	return db->tagOffs[tagId + 1] - db->tagOffs[tagId];
+}
+
+#pragma endregion
+
+#pragma region Implementation
+
+ltdb_t *ltdb_open(const char *path)
+{
+	ltdb_t *db = calloc(1, sizeof(ltdb_t));
+	FILE *f = db ? fopen(path, "r") : NULL;
+
+	if(!f)
+		goto err;
+
+	// a library doesn't print
+	if(!(db->tdb = tdb_open(f, NULL)))
+	{
+		if(!errno)
+			errno = EINVAL;
+
+		goto err;
+	}
+
+	if(!tdb_replayJournals(db->tdb, AT_FDCWD, path) || !_ltdb_index(db))
+		goto err;
+
+	return db;
+
+	err:;
+	int eno = errno;
+	ltdb_close(db);
+	errno = eno;
+
+	return NULL;
+}
+
+void ltdb_close(ltdb_t *db)
+{
+	if(!db)
+		return;
+
+	tdb_destroy(db->tdb);
+	free(db->files);
+	free(db->tagOffs);
+	free(db->tagFiles);
+	free(db);
+}
+
+ltdb_query_t *ltdb_compile(ltdb_t *db, const char *query)
+{
+	tagdb_t *tdb = db->tdb;
+	char *path = strdup(query);
+	// no query has more tags than names
+	size_t cap = 1;
+
+	for (const char *c = query; *c; c++)
+		cap += *c == '/';
+
+	ltdb_query_t *q = path ? malloc(sizeof(ltdb_query_t) + cap * sizeof(size_t)) : NULL;
+	size_t *negs = path ? malloc(cap * sizeof(size_t)) : NULL;
+	size_t count = 0;
+	char *save;
+
+	if(!q || !negs)
+		goto err;
+
+	q->db = db;
+	q->pos = 0;
+
+	for (char *name = strtok_r(path, "/", &save); name; name = strtok_r(NULL, "/", &save))
+	{
+		bool neg;
+		tagdb_entry_t *tag = _ltdb_tag(tdb, name, &neg);
+
+		if(!tag)
+			goto err;
+
+		// a tag can only be entered once along a path
+		for (size_t i = 0; i < q->pos; i++)
+			if(q->tagIds[i] == tag->tagId)
+				goto dup;
+		for (size_t i = 0; i < count; i++)
+			if(negs[i] == tag->tagId)
+				goto dup;
+
+		if(neg)
+			negs[count++] = tag->tagId;
+		else
+		{
+			q->tagIds[q->pos++] = tag->tagId;
+
+			// the files of the first tag are the candidates of the query
+			if(_ltdb_tagFiles(db, tag->tagId) < _ltdb_tagFiles(db, q->tagIds[0]))
+			{
+				q->tagIds[q->pos - 1] = q->tagIds[0];
+				q->tagIds[0] = tag->tagId;
+			}
+		}
+	}
+
+	memcpy(q->tagIds + q->pos, negs, count * sizeof(size_t));
+	q->count = q->pos + count;
+	free(negs);
+	free(path);
+
+	return q;
+
+	dup:
+	errno = ENOENT;
+	err:;
+	int eno = errno;
+	free(q);
+	free(negs);
+	free(path);
+	errno = eno;
+
+	return NULL;
+}
+
+void ltdb_free(ltdb_query_t *q)
+{
+	free(q);
+}
+
+const char *ltdb_next(const ltdb_query_t *q, size_t *pos)
+{
+	const ltdb_t *db = q->db;
+	tagdb_t *tdb = db->tdb;
+	// without tags to have, every file is a candidate
+	size_t candidates = q->pos ? _ltdb_tagFiles(db, q->tagIds[0]) : db->fileCount;
+
+	while(*pos < candidates)
+	{
+		size_t i = q->pos ? db->tagFiles[db->tagOffs[q->tagIds[0]] + *pos] : *pos;
+		tagdb_entry_t *file = db->files[i];
+		// the candidates have the first tag
+		size_t k = q->pos ? 1 : 0;
+
+		++*pos;
+
+		for (; k < q->count; k++)
+			if(tdb_entry_get(tdb, file, q->tagIds[k]) != (k < q->pos))
+				break;
+
+		if(k == q->count)
+			return hmap_key(file);
+	}
+
+	return NULL;
+}
+
+ssize_t ltdb_tags(ltdb_t *db, const char *file, const char **tags, size_t n)
+{
+	tagdb_t *tdb = db->tdb;
+	tagdb_entry_t *e = tdb_get(tdb, file);
+	size_t count = 0;
+
+	if(!e || e->kind != TDB_FILE_ENTRY)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	_TDB_TAGS_FORALL(tdb, e, t, {
+		if(count < n)
+			tags[count] = tdb->tagNames[t];
+
+		count++;
+	})
+
+	return count;
+}
+
+#pragma endregion
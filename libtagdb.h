@@ -0,0 +1,44 @@
+/* libtagdb.h: The interface of libtagdb, which answers tagfs queries from a tagdb file without mounting it.
+	Only opaque types are declared, so programs linked against one version keep working with the next one,
+	as long as LTDB_API_VERSION doesn't change. Build libtagdb.a or libtagdb.so with the makefile. */
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Changed whenever a declaration below changes incompatibly */
+#define LTDB_API_VERSION 1
+
+#define LTDB_API __attribute__ ((visibility ("default")))
+
+#pragma region Types
+
+/* A tagdb, loaded read-only */
+typedef struct ltdb ltdb_t;
+/* A query compiled against a tagdb */
+typedef struct ltdb_query ltdb_query_t;
+
+#pragma endregion
+
+#pragma region Interface Declaration
+/* Opens the tagdb file at path, in either format, including the changes in its journals, path.journal.old and path.journal.
+	Neither file is changed, and later changes to them aren't seen. The tagdb and its queries may be used by several threads at once.
+	Returns NULL and sets errno on failure. */
+LTDB_API ltdb_t *ltdb_open(const char *path);
+/* Releases the tagdb. Its queries have to be freed before. */
+LTDB_API void ltdb_close(ltdb_t *db);
+/* Compiles a query, which is a path of tag names separated by '/', like those of tagfs query directories.
+	Files match if they have every tag of the path and none of the tags prefixed with '-'. A '.' before a tag name is ignored.
+	The empty query matches every file.
+	Returns NULL and sets errno on failure; ENOENT for a path tagfs wouldn't find, e.g. of a missing tag or one named twice,
+	ENOTDIR if a name is that of a file. */
+LTDB_API ltdb_query_t *ltdb_compile(ltdb_t *db, const char *query);
+LTDB_API void ltdb_free(ltdb_query_t *q);
+/* Retrieves the name of the next file matching the query, starting from the position in *pos, which is 0 for the first file.
+	Advances *pos past the file. The name stays valid until the tagdb is closed.
+	Returns NULL once every file was retrieved. */
+LTDB_API const char *ltdb_next(const ltdb_query_t *q, size_t *pos);
+/* Stores the names of the first n tags of the named file in tags. The names stay valid until the tagdb is closed.
+	Returns the number of tags of the file, which may be more than n, or -1 and sets errno to ENOENT if there's no such file. */
+LTDB_API ssize_t ltdb_tags(ltdb_t *db, const char *file, const char **tags, size_t n);
+#pragma endregion
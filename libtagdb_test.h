@@ -0,0 +1,148 @@
+// unit testing, in C
+#include "libtagdb.c"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+#define FILES 1000
+#define TAGS 20
+
+/* Tag t is on file f if f is divisible by t + 1 */
+static bool tagged(size_t f, size_t t)
+{
+	return !(f % (t + 1));
+}
+
+static char path[32], jpath[sizeof(path) + sizeof(".journal")];
+
+/* Writes a binary tagdb with the files and tags given by tagged(), then changes it through a journal next to it:
+	tag1 is removed, and "new file" is added with tag0 */
+static void create()
+{
+	strcpy(path, "/tmp/libtagdb_testXXXXXX");
+
+	int fd = mkstemp(path);
+	FILE *text = tmpfile();
+
+	if(fd < 0 || !text)
+		faile();
+
+	snprintf(jpath, sizeof(jpath), "%s.journal", path);
+
+	for (size_t t = 0; t < TAGS; t++)
+	{
+		fprintf(text, "tag%zu\n", t);
+
+		for (size_t i = 0; i < FILES; i++)
+			if(tagged(i, t))
+				fprintf(text, "file%zu.jpg\n", i);
+
+		fputc('\n', text);
+	}
+
+	rewind(text);
+
+	tagdb_t *tdb = tdb_open(text, stderr);
+	FILE *f = fdopen(fd, "w+");
+
+	assertMsg(tdb && f && tdb_write(tdb, f) && !fflush(f), "Writing the tagdb failed: %s\n", strerror(errno))
+	tdb_destroy(tdb);
+	rewind(f);
+
+	tdb = tdb_open(f, stderr);
+	assertMsg(tdb && tdb_journal(tdb, open(jpath, O_RDWR | O_CREAT | O_APPEND, 0600)), "Opening the journal failed: %s\n", strerror(errno))
+
+	tagdb_entry_t *file = tdb_ins(tdb, "new file", TDB_FILE_ENTRY);
+
+	tdb_entry_set(tdb, file, tdb_get(tdb, "tag0")->tagId, true);
+	tdb_rm(tdb, "tag1");
+	assertMsg(journal_sync(tdb->journal), "journal_sync failed: %s\n", strerror(errno))
+	tdb_destroy(tdb);
+}
+
+static void destroy()
+{
+	unlink(path);
+	unlink(jpath);
+}
+
+/* Counts the files matching the query, asserting that each is matched once */
+static size_t count(ltdb_t *db, const char *query)
+{
+	ltdb_query_t *q = ltdb_compile(db, query);
+	size_t pos = 0, n = 0;
+	const char *name;
+	char seen[FILES + 1] = { 0 };
+
+	assertMsg(q, "Compiling '%s' failed: %s\n", query, strerror(errno))
+
+	while((name = ltdb_next(q, &pos)))
+	{
+		size_t f = strcmp(name, "new file") ? strtoul(name + 4, NULL, 10) : FILES;
+
+		assertMsg(!seen[f]++, "'%s' matched '%s' twice\n", query, name)
+		n++;
+	}
+
+	ltdb_free(q);
+
+	return n;
+}
+
+void testQuery()
+{
+	create();
+
+	ltdb_t *db = ltdb_open(path);
+
+	assertMsg(db, "ltdb_open failed: %s\n", strerror(errno))
+
+	// the journal added a file and removed tag1
+	assertMsg(count(db, "") == FILES + 1, "The empty query matched %zu files\n", count(db, ""))
+	assertMsg(count(db, "/tag0") == FILES + 1, "tag0 matched %zu files\n", count(db, "/tag0"))
+
+	for (size_t a = 2; a < TAGS; a += 3)
+		for (size_t b = 3; b < TAGS; b += 4)
+		{
+			char query[64];
+			size_t expected = 0, exclusive = 0;
+
+			for (size_t i = 0; i < FILES; i++)
+			{
+				expected += tagged(i, a) && tagged(i, b);
+				exclusive += tagged(i, a) && !tagged(i, b);
+			}
+
+			snprintf(query, sizeof(query), "tag%zu/.tag%zu", a, b);
+
+			if(a == b)
+			{
+				assertMsg(!ltdb_compile(db, query) && errno == ENOENT, "'%s' names a tag twice, but compiled\n", query)
+				continue;
+			}
+
+			assertMsg(count(db, query) == expected, "'%s' matched %zu files instead of %zu\n", query, count(db, query), expected)
+			snprintf(query, sizeof(query), "/tag%zu/-tag%zu/", a, b);
+			assertMsg(count(db, query) == exclusive, "'%s' matched %zu files instead of %zu\n", query, count(db, query), exclusive)
+			// negated tags alone are checked on every file
+			snprintf(query, sizeof(query), "-tag%zu", b);
+			assertMsg(count(db, query) == FILES + 1 - (FILES + b) / (b + 1), "'%s' matched %zu files\n", query, count(db, query))
+		}
+
+	assertMsg(!ltdb_compile(db, "tag1") && errno == ENOENT, "Removed tag was found\n")
+	assertMsg(!ltdb_compile(db, "tag0/file3.jpg") && errno == ENOTDIR, "File was taken for a tag\n")
+
+	const char *tags[TAGS];
+	ssize_t n = ltdb_tags(db, "file6.jpg", tags, TAGS);
+
+	// tag0, tag2 and tag5, since tag1 was removed
+	assertMsg(n == 3, "file6.jpg has %zd tags\n", n)
+	assertMsg(ltdb_tags(db, "file6.jpg", tags, 1) == 3, "Tags weren't counted past n\n")
+	assertMsg(ltdb_tags(db, "new file", tags, TAGS) == 1 && !strcmp(tags[0], "tag0"), "New file has the wrong tags\n")
+	assertMsg(ltdb_tags(db, "tag0", tags, TAGS) == -1 && errno == ENOENT, "Tag was taken for a file\n")
+
+	ltdb_close(db);
+	destroy();
+}
+
+const test_t tests[] = { testQuery };
@@ -0,0 +1,176 @@
+/* loadbench.c: measures how fast tagdbs are loaded, in the text format by both of its readers and in the binary format */
+#define _GNU_SOURCE 1
+#include "tagdb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char usage[] =
+	"Usage:\n"
+	"	tagfs-loadbench [files] [tags]\n"
+	"Generates a tagdb with the given number of files (default 200000) and tags (default 100), where tag t is on every (t + 1)th file.\n"
+	"Loads it as text character by character, by the parser on one thread and on as many as fit, then as binary with five times the files.\n";
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Tag t is on file f if f is divisible by t + 1 */
+static bool tagged(size_t f, size_t t)
+{
+	return !(f % (t + 1));
+}
+
+static size_t count(tagdb_t *tdb)
+{
+	size_t n = 0;
+
+	TDB_FORALL(tdb, UNUSED name, UNUSED e, {
+		n++;
+	})
+
+	return n;
+}
+
+/* Loads the text tagdb in the stream into a new tagdb, with readfield if threads is negative, otherwise with the parser.
+	Returns the seconds it took, or -1 on failure. */
+static double parseTime(FILE *f, tagdb_t **tdb, int threads)
+{
+	// an empty tagdb, with a stream of its own on the text
+	if(!(*tdb = tdb_open(tmpfile(), stderr)))
+		return -1;
+
+	fclose((*tdb)->file);
+
+	if(!((*tdb)->file = fdopen(dup(fileno(f)), "r")))
+	{
+		// tdb_destroy closes the file
+		(*tdb)->file = tmpfile();
+		return -1;
+	}
+
+	rewind((*tdb)->file);
+
+	double start = now();
+	bool ok = (threads < 0) ? _tdb_readText(*tdb, (*tdb)->file) : _tdb_parseText(*tdb, (*tdb)->file, threads) == 1;
+
+	return ok ? now() - start : -1;
+}
+
+int main(int argc, char **argv)
+{
+	long files = (argc > 1) ? atol(argv[1]) : 200000, tags = (argc > 2) ? atol(argv[2]) : 100;
+	FILE *f = tmpfile();
+
+	if(argc > 3 || files <= 0 || tags <= 0)
+	{
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+	if(!f)
+	{
+		perror("tmpfile");
+		return 1;
+	}
+
+	for (long t = 0; t < tags; t++)
+	{
+		fprintf(f, "tag %ld\n", t);
+
+		for (long i = 0; i < files; i++)
+			if(tagged(i, t))
+				fprintf(f, "some file %ld.jpg\n", i);
+
+		fputc('\n', f);
+	}
+
+	double mb = ftell(f) / 1e6;
+	tagdb_t *expected = NULL, *one = NULL, *many = NULL;
+
+	fflush(f);
+
+	double tr = parseTime(f, &expected, -1), t1 = parseTime(f, &one, 1), tn = parseTime(f, &many, 0);
+	int ret = 1;
+
+	if(tr < 0 || t1 < 0 || tn < 0)
+		perror("Cannot parse the text tagdb");
+	else if(count(expected) != count(one) || count(expected) != count(many))
+		fprintf(stderr, "The readers loaded %zu, %zu and %zu entries\n", count(expected), count(one), count(many));
+	else
+	{
+		printf("Loaded %.1fMB of text: %.1fMB/s with readfield, %.1fMB/s parsed on one thread, %.1fMB/s on up to %ld\n",
+			mb, mb / tr, mb / t1, mb / tn, sysconf(_SC_NPROCESSORS_ONLN));
+		ret = 0;
+	}
+
+	tdb_destroy(expected);
+	tdb_destroy(one);
+	tdb_destroy(many);
+	fclose(f);
+
+	if(ret)
+		return ret;
+
+	// the binary tagdb is loaded without parsing, so it takes more files to measure
+	tagdb_t *tdb = tdb_open(tmpfile(), stderr);
+	char name[64];
+	size_t *tagIds = malloc(tags * sizeof(size_t));
+
+	if(!tdb || !tagIds)
+		goto fail;
+
+	for (long t = 0; t < tags; t++)
+	{
+		snprintf(name, sizeof(name), "tag %ld", t);
+		tagdb_entry_t *tag = tdb_ins(tdb, name, TDB_TAG_ENTRY);
+
+		if(!tag)
+			goto fail;
+
+		tagIds[t] = tag->tagId;
+	}
+
+	for (long i = 0; i < files * 5; i++)
+	{
+		snprintf(name, sizeof(name), "some file %ld.jpg", i);
+		tagdb_entry_t *file = tdb_ins(tdb, name, TDB_FILE_ENTRY);
+
+		if(!file)
+			goto fail;
+
+		for (long t = 0; t < tags; t++)
+			if(tagged(i, t))
+				tdb_entry_set(tdb, file, tagIds[t], true);
+	}
+
+	if(!(f = tmpfile()) || !tdb_write(tdb, f))
+		goto fail;
+
+	tdb_destroy(tdb);
+	rewind(f);
+
+	double start = now();
+
+	if(!(tdb = tdb_open(f, stderr)))
+		goto fail;
+
+	printf("Loaded %ld binary files in %.3fs\n", files * 5, now() - start);
+	tdb_destroy(tdb);
+	free(tagIds);
+
+	return 0;
+
+	fail:
+	perror("Cannot load the binary tagdb");
+	tdb_destroy(tdb);
+	free(tagIds);
+
+	return 1;
+}
@@ -0,0 +1,245 @@
+/* migrate.c: moves the real files of an unmounted tagfs directory to a different number of subdirectory levels, see layout.h */
+#define _GNU_SOURCE 1
+#include "layout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Holds files that are in the way of subdirectories during a migration. Ignored by tagfs like every .tagdb file.
+#define MIGRATE_STAGE ".tagdb.migrate"
+
+static const char usage[] =
+	"Usage:\n"
+	"	tagfs-migrate <real directory> <levels>\n"
+	"Moves every real file into levels of 256 hashed subdirectories each, or back into the real directory itself for 0 levels.\n"
+	"Levels range from 0 to %d.\n"
+	"The directory must not be mounted meanwhile. An interrupted migration is completed by running it again.\n";
+
+/* Determines if the name is that of a subdirectory */
+static bool isLeafName(const char *name)
+{
+	return strlen(name) == 2 && strspn(name, "0123456789abcdef") == 2;
+}
+
+/* Determines if the entry is a directory, which real files never are */
+static bool isDir(int dirfd, const char *path, const struct dirent *ent)
+{
+	struct stat st;
+
+	if(ent->d_type != DT_UNKNOWN)
+		return ent->d_type == DT_DIR;
+
+	return !fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+}
+
+/* Moves every real file found in the leaf directories of the given number of levels to its place with target levels.
+	Returns the number of files moved, or -1 on failure. */
+static long migrateFrom(int dirfd, int levels, int target)
+{
+	layout_dir_t *d = layout_opendir(dirfd, levels);
+	struct dirent *ent;
+	long moved = 0;
+
+	if(!d)
+		return -1;
+
+	while((ent = layout_readdir(d)))
+	{
+		char from[LAYOUT_PATH_MAX], to[sizeof(MIGRATE_STAGE) + NAME_MAX + 1];
+		const char *src = ent->d_name;
+		const char *dst = layout_path(target, ent->d_name, to);
+
+		// the tagdb stays in the real directory
+		if(!levels && (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") || !strncmp(ent->d_name, ".tagdb", 6)))
+			continue;
+
+		// files in the wrong leaf are moved as well, so the path comes from the leaf rather than the name
+		if(levels)
+		{
+			layout_leaf(levels, d->leaf, from);
+			strcat(from, "/");
+			strncat(from, ent->d_name, LAYOUT_PATH_MAX - strlen(from) - 1);
+			src = from;
+		}
+
+		if(isDir(dirfd, src, ent) || !strcmp(src, dst))
+			continue;
+		// a file can't take the place of a subdirectory of a deeper layout before it's removed, it's counted once it's moved there
+		bool staged = target < LAYOUT_MAX_LEVELS && isLeafName(ent->d_name);
+
+		if(staged)
+		{
+			if(mkdirat(dirfd, MIGRATE_STAGE, 0755) && errno != EEXIST)
+				return -1;
+
+			snprintf(to, sizeof(to), "%s/%s", MIGRATE_STAGE, ent->d_name);
+			dst = to;
+		}
+
+		if(renameat2(dirfd, src, dirfd, dst, RENAME_NOREPLACE))
+		{
+			fprintf(stderr, "Cannot move '%s' to '%s': %s\n", src, dst, strerror(errno));
+			layout_closedir(d);
+			return -1;
+		}
+
+		moved += !staged;
+	}
+
+	int eno = errno;
+	layout_closedir(d);
+	errno = eno;
+
+	return eno ? -1 : moved;
+}
+
+/* Moves real files in the way of the subdirectories of target levels to the staging directory, so the subdirectories can be created.
+	Returns false on failure. */
+static bool stage(int dirfd, int target)
+{
+	char name[LAYOUT_PATH_MAX], path[sizeof(MIGRATE_STAGE) + NAME_MAX + 1];
+	struct stat st;
+
+	for (int l = 1; l <= target; l++)
+	{
+		for (size_t i = 0; i < layout_leaves(l); i++)
+		{
+			layout_leaf(l, i, name);
+
+			if(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) || S_ISDIR(st.st_mode))
+				continue;
+
+			// the file name is the last path component, i.e. the name of the subdirectory
+			snprintf(path, sizeof(path), "%s/%.2s", MIGRATE_STAGE, name + 3 * (l - 1));
+
+			if((mkdirat(dirfd, MIGRATE_STAGE, 0755) && errno != EEXIST) || renameat2(dirfd, name, dirfd, path, RENAME_NOREPLACE))
+			{
+				fprintf(stderr, "Cannot move '%s' to '%s': %s\n", name, path, strerror(errno));
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Moves every file in the staging directory to its place with target levels and removes the staging directory.
+	Returns the number of files moved, or -1 on failure. */
+static long unstage(int dirfd, int target)
+{
+	int fd = openat(dirfd, MIGRATE_STAGE, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *d = (fd < 0) ? NULL : fdopendir(fd);
+	struct dirent *ent;
+	long moved = 0;
+
+	if(!d)
+		return (errno == ENOENT) ? 0 : -1;
+
+	while((errno = 0, ent = readdir(d)))
+	{
+		char from[sizeof(MIGRATE_STAGE) + NAME_MAX + 1], to[LAYOUT_PATH_MAX];
+
+		if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		snprintf(from, sizeof(from), "%s/%s", MIGRATE_STAGE, ent->d_name);
+
+		if(renameat2(dirfd, from, dirfd, layout_path(target, ent->d_name, to), RENAME_NOREPLACE))
+		{
+			fprintf(stderr, "Cannot move '%s' to '%s': %s\n", from, to, strerror(errno));
+			closedir(d);
+			return -1;
+		}
+
+		moved++;
+	}
+
+	int eno = errno;
+	closedir(d);
+	errno = eno;
+
+	return (eno || unlinkat(dirfd, MIGRATE_STAGE, AT_REMOVEDIR)) ? -1 : moved;
+}
+
+int main(int argc, char **argv)
+{
+	char *end;
+	long target = (argc == 3) ? strtol(argv[2], &end, 10) : -1;
+
+	if(argc != 3 || *end || target < 0 || target > LAYOUT_MAX_LEVELS)
+	{
+		fprintf(stderr, usage, LAYOUT_MAX_LEVELS);
+		return 1;
+	}
+
+	int dirfd = open(argv[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int levels = (dirfd < 0) ? -1 : layout_read(dirfd);
+
+	if(levels < 0)
+	{
+		fprintf(stderr, "Cannot read the layout of '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	// files named like subdirectories are moved out of their way first
+	if(!stage(dirfd, target))
+		return 1;
+	if(!layout_mkdirs(dirfd, target))
+	{
+		fprintf(stderr, "Cannot create subdirectories in '%s': %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	long total = 0;
+
+	// files of an interrupted migration may be at any number of levels
+	for (int l = 0; l <= LAYOUT_MAX_LEVELS; l++)
+	{
+		long moved = migrateFrom(dirfd, l, target);
+
+		if(moved < 0)
+		{
+			fprintf(stderr, "Cannot migrate '%s': %s\n", argv[1], strerror(errno));
+			return 1;
+		}
+
+		total += moved;
+	}
+
+	if(!layout_write(dirfd, target))
+	{
+		fprintf(stderr, "Cannot write '%s' in '%s': %s\n", LAYOUT_FILE, argv[1], strerror(errno));
+		return 1;
+	}
+
+	// remove the subdirectories of deeper layouts, deepest first. Flat files may have their names.
+	for (int l = LAYOUT_MAX_LEVELS; l > target; l--)
+	{
+		char buf[LAYOUT_PATH_MAX];
+
+		for (size_t i = 0; i < layout_leaves(l); i++)
+		{
+			layout_leaf(l, i, buf);
+
+			if(unlinkat(dirfd, buf, AT_REMOVEDIR) && errno != ENOENT && errno != ENOTDIR)
+				fprintf(stderr, "Cannot remove '%s' from '%s': %s\n", buf, argv[1], strerror(errno));
+		}
+	}
+
+	long staged = unstage(dirfd, target);
+
+	if(staged < 0)
+	{
+		fprintf(stderr, "Cannot move the files in '%s' out of '%s': %s\n", argv[1], MIGRATE_STAGE, strerror(errno));
+		return 1;
+	}
+
+	printf("Moved %ld files in '%s' from %d to %ld levels\n", total + staged, argv[1], levels, target);
+	close(dirfd);
+	return 0;
+}
@@ -0,0 +1,139 @@
+/* query.c: answers tagfs queries read from stdin with libtagdb, without mounting the tagdb */
+#define _GNU_SOURCE 1
+#include "libtagdb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+static const char usage[] =
+	"Usage:\n"
+	"	tagfs-query [-c | -t] <tagdb>\n"
+	"Reads a query per line from stdin, a path of tags like those in a tagfs mount, e.g. 'tag0/-tag1'.\n"
+	"Writes the files matching each query to stdout, one per line, followed by an empty line.\n"
+	"With -c, writes the number of matching files instead. With -t, every line names a file instead, and its tags are written.\n"
+	"Changes in the journals next to the tagdb, <tagdb>.journal and <tagdb>.journal.old, are included.\n"
+	"A query that fails is reported on stderr, and answered with an empty line.\n";
+
+/* Writes the tags of the named file. Returns false if there's no such file. */
+static bool printTags(ltdb_t *db, const char *file)
+{
+	const char *buf[64], **tags = buf;
+	ssize_t n = ltdb_tags(db, file, buf, 64);
+
+	if(n < 0)
+		return false;
+
+	// there's room for every tag on the second try
+	if(n > 64 && (!(tags = malloc(n * sizeof(char*))) || ltdb_tags(db, file, tags, n) < 0))
+	{
+		free(tags);
+		return false;
+	}
+
+	for (ssize_t i = 0; i < n; i++)
+		puts(tags[i]);
+
+	if(tags != buf)
+		free(tags);
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	bool count = false, tags = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, "ct")) != -1)
+	{
+		if(opt == 'c')
+			count = true;
+		else if(opt == 't')
+			tags = true;
+		else
+			break;
+	}
+
+	if(opt != -1 || (count && tags) || argc - optind != 1)
+	{
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+
+	ltdb_t *db = ltdb_open(argv[optind]);
+
+	if(!db)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+
+	// answers are only flushed in large blocks, unless stdout is interactive
+	static char out[1 << 16];
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int ret = 0;
+
+	if(!isatty(STDOUT_FILENO))
+		setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+	while((len = getline(&line, &cap, stdin)) >= 0)
+	{
+		if(len && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if(tags)
+		{
+			if(!printTags(db, line))
+			{
+				fprintf(stderr, "'%s': %s\n", line, strerror(errno));
+				ret = 1;
+			}
+
+			putchar('\n');
+			continue;
+		}
+
+		ltdb_query_t *q = ltdb_compile(db, line);
+		size_t pos = 0, matches = 0;
+		const char *file;
+
+		if(!q)
+		{
+			fprintf(stderr, "'%s': %s\n", line, strerror(errno));
+			putchar('\n');
+			ret = 1;
+			continue;
+		}
+
+		while((file = ltdb_next(q, &pos)))
+		{
+			if(count)
+				matches++;
+			else
+				puts(file);
+		}
+
+		if(count)
+			printf("%zu\n", matches);
+		else
+			putchar('\n');
+
+		ltdb_free(q);
+	}
+
+	free(line);
+	ltdb_close(db);
+
+	if(fflush(stdout) || ferror(stdout))
+	{
+		perror("stdout");
+		return 1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,295 @@
+/* realdir.h: Checks a tagdb against the real directory holding its files, by the rules tagfs mounts it with.
+	Checking only lists the real directory; the changes it finds are made by realdir_fix, so the tagdb can be saved before. */
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "tagdb.h"
+#include "layout.h"
+#include "batchstat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#pragma region Types
+
+/* The changes the tagdb needs to match the real directory */
+typedef struct
+{
+	/* Whether the entry in each slot of the hashmap was found in the real directory */
+	bool *found;
+	/* The real files without an entry, if they were asked for */
+	char **missing;
+	size_t missingCount, missingCap;
+} realdir_fix_t;
+
+#pragma endregion
+
+#pragma region Interface Declaration
+/* Checks the tagdb against the real directory dirfd, whose files are spread over the given number of layout levels.
+	Every problem is reported to log. Fills fix with the file entries without a real file, and if add is set,
+	with the real files without an entry. The tagdb isn't changed.
+	Returns 0 if no entry has to be removed, 1 if some have to and -1 if the tagdb is invalid, in which case fix is left empty. */
+int realdir_chk(tagdb_t *tdb, int dirfd, int levels, FILE *log, bool add, realdir_fix_t *fix);
+/* Removes the entries and adds the files found by realdir_chk, and frees fix. The tagdb must not have changed since the check.
+	Returns the number of entries removed, or -1 and sets errno if an entry couldn't be added. */
+ssize_t realdir_fix(tagdb_t *tdb, realdir_fix_t *fix, FILE *log);
+#pragma endregion
+
+#pragma region Internal Functions
+
+struct _realdir_stat
+{
+	FILE *log;
+	int err;
+};
+
+/* Reports real files that are directories, once their type is known */
+static int _realdir_stat(void *_s, bstat_t *req)
+{
+	struct _realdir_stat *s = _s;
+
+	if(!req->err && S_ISDIR(req->stx.stx_mode))
+	{
+		fprintf(s->log, "Tagdb invalid; Real file '%s' may not be a directory\n", req->name);
+		s->err = -1;
+	}
+
+	return 0;
+}
+
+/* Opens a new directory stream on the real directory, independent of any other stream.
+	Returns NULL and sets errno on failure. */
+static DIR *_realdir_open(int dirfd)
+{
+	int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if(fd < 0)
+		return NULL;
+
+	DIR *d = fdopendir(fd);
+
+	if(!d)
+		close(fd);
+
+	return d;
+}
+
+/* Whether name is no real file, but a special directory or part of the tagdb */
+static inline bool _realdir_skip(const char *name)
+{
+	return !strcmp(name, ".") || !strcmp(name, "..") || !strncmp(name, ".tagdb", 6);
+}
+
+/* Appends a copy of name to the array. Returns false on malloc failure. */
+static bool _realdir_push(char ***arr, size_t *count, size_t *cap, const char *name)
+{
+	if(*count == *cap)
+	{
+		size_t c = *cap ? *cap * 2 : 64;
+		char **a = realloc(*arr, c * sizeof(char*));
+
+		if(!a)
+			return false;
+
+		*arr = a;
+		*cap = c;
+	}
+
+	if(!((*arr)[*count] = strdup(name)))
+		return false;
+
+	++*count;
+
+	return true;
+}
+
+static void _realdir_free(char **arr, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		free(arr[i]);
+
+	free(arr);
+}
+
+#pragma endregion
+
+#pragma region Implementation
+
+int realdir_chk(tagdb_t *tdb, int dirfd, int levels, FILE *log, bool add, realdir_fix_t *fix)
+{
+	struct _realdir_stat s = { .log = log };
+	#define IERR(...) { fprintf(log, "Tagdb invalid; " __VA_ARGS__); s.err = -1; continue; }
+
+	*fix = (realdir_fix_t){ 0 };
+
+	TDB_FORALL(tdb, name, UNUSED entry, {
+		if(name[0] == TDB_NEG_CHAR)
+			IERR("Entry name '%s' may not start with '%c' as it is reserved for negating tags\n", name, TDB_NEG_CHAR)
+		if(name[0] == '.' && tdb_get(tdb, name + 1))
+			IERR("Entry name '%s' conflicts with entry '%s'\n", name, name)
+		if(strchr(name, '/'))
+			IERR("Entry name '%s' may not contain '/'\n", name)
+	})
+
+	struct dirent *ent;
+	// real files of unknown type, which are stat'ed together once listed
+	char **unknown = NULL;
+	size_t unknowns = 0, unknownCap = 0;
+	layout_dir_t *dir = (fix->found = calloc(tdb->map->len, sizeof(bool))) ? layout_opendir(dirfd, levels) : NULL;
+
+	if(!dir)
+	{
+		fprintf(log, "Cannot list real directory: %s\n", strerror(errno));
+		free(fix->found);
+		fix->found = NULL;
+		return -1;
+	}
+
+	// the real directory is listed once and joined with the tagdb by name, so no file entry is looked up on its own
+	while((ent = layout_readdir(dir)))
+	{
+		char path[LAYOUT_PATH_MAX];
+
+		if(_realdir_skip(ent->d_name))
+			continue;
+		if(ent->d_name[0] == TDB_NEG_CHAR)
+			IERR("Real file '%s' may not start with '%c' as it is reserved for negating tags\n", ent->d_name, TDB_NEG_CHAR)
+		if(ent->d_name[0] == '.' && tdb_get(tdb, ent->d_name + 1))
+			IERR("Real file '%s' conflicts with tag '%s'\n", ent->d_name, ent->d_name + 1)
+		if(ent->d_type == DT_DIR)
+			IERR("Real file '%s' may not be a directory\n", ent->d_name)
+		if(levels && dir->leaf != layout_leafOf(levels, ent->d_name))
+			IERR("Real file '%s' is in the wrong subdirectory; move it to '%s'\n", ent->d_name, layout_path(levels, ent->d_name, path))
+
+		tagdb_entry_t *e = tdb_get(tdb, ent->d_name);
+
+		if(e && e->kind == TDB_TAG_ENTRY)
+			IERR("Tag '%s' conflicts with existing file\n", ent->d_name)
+		if(e)
+			fix->found[_hmap_entry(e) - tdb->map->entries] = true;
+		// inserting entries now would move the ones already found
+		else if(add && !s.err && !_realdir_push(&fix->missing, &fix->missingCount, &fix->missingCap, ent->d_name))
+		{
+			fprintf(log, "Cannot add entries for real files: %s\n", strerror(errno));
+			s.err = -1;
+			break;
+		}
+
+		if(ent->d_type == DT_UNKNOWN && !_realdir_push(&unknown, &unknowns, &unknownCap, layout_path(levels, ent->d_name, path)))
+		{
+			fprintf(log, "Cannot check the types of real files: %s\n", strerror(errno));
+			s.err = -1;
+			break;
+		}
+	}
+
+	layout_closedir(dir);
+
+	// the filesystem doesn't list types, so their stat calls are batched
+	if(!s.err && unknowns)
+	{
+		bstat_t *reqs = malloc(unknowns * sizeof(bstat_t));
+
+		if(!reqs)
+		{
+			fprintf(log, "Cannot check the types of real files: %s\n", strerror(errno));
+			s.err = -1;
+		}
+		else
+		{
+			for (size_t i = 0; i < unknowns; i++)
+				reqs[i] = (bstat_t){ .name = unknown[i] };
+
+			bstat_run(dirfd, reqs, unknowns, _realdir_stat, &s, 0);
+			free(reqs);
+		}
+	}
+
+	_realdir_free(unknown, unknowns);
+
+	// with subdirectories, the real directory itself only holds them and the tagdb
+	if(levels)
+	{
+		DIR *top = _realdir_open(dirfd);
+
+		if(!top)
+		{
+			fprintf(log, "Cannot list real directory: %s\n", strerror(errno));
+			s.err = -1;
+		}
+
+		while(top && (ent = readdir(top)))
+		{
+			if(_realdir_skip(ent->d_name)
+				|| (ent->d_type == DT_DIR && strlen(ent->d_name) == 2 && isxdigit(ent->d_name[0]) && isxdigit(ent->d_name[1])))
+				continue;
+
+			IERR("Real file '%s' isn't in a subdirectory; run tagfs-migrate to move it\n", ent->d_name)
+		}
+
+		if(top)
+			closedir(top);
+	}
+
+	#undef IERR
+
+	if(s.err)
+	{
+		free(fix->found);
+		_realdir_free(fix->missing, fix->missingCount);
+		*fix = (realdir_fix_t){ 0 };
+
+		return -1;
+	}
+
+	TDB_FORALL(tdb, UNUSED name, entry, {
+		if(entry->kind == TDB_FILE_ENTRY && !fix->found[_hmap_entry(entry) - tdb->map->entries])
+			return 1;
+	})
+
+	return 0;
+}
+
+ssize_t realdir_fix(tagdb_t *tdb, realdir_fix_t *fix, FILE *log)
+{
+	ssize_t removed = 0;
+
+	// removing an entry doesn't move any other one
+	if(fix->found)
+	{
+		TDB_FORALL(tdb, name, entry, {
+			if(entry->kind == TDB_FILE_ENTRY && !fix->found[_hmap_entry(entry) - tdb->map->entries])
+			{
+				fprintf(log, "No file for entry '%s'\nRemoving bad entry from TDB\n", name);
+				tdb_rmE(tdb, entry);
+				removed++;
+			}
+		})
+	}
+
+	for (size_t i = 0; removed >= 0 && i < fix->missingCount; i++)
+	{
+		if(!tdb_ins(tdb, fix->missing[i], TDB_FILE_ENTRY))
+		{
+			fprintf(log, "Cannot create entry for real file '%s': %s\n", fix->missing[i], strerror(errno));
+			removed = -1;
+		}
+	}
+
+	int eno = errno;
+
+	free(fix->found);
+	_realdir_free(fix->missing, fix->missingCount);
+	*fix = (realdir_fix_t){ 0 };
+	errno = eno;
+
+	return removed;
+}
+
+#pragma endregion
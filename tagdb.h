@@ -3,10 +3,19 @@
 
 #include "bitarr.h"
 #include "futil.h"
+#include "journal.h"
 #include <errno.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <fcntl.h>
 
 #pragma region Types
 const char * const tagdb_entrykind_names[] = { "empty", "tag", "file" };
@@ -21,22 +30,68 @@ typedef enum
 	TDB_FILE_ENTRY,
 } tagdb_entrykind_t;
 
+/* Cached attributes of a real file */
+typedef struct
+{
+	struct stat st;
+	/* CLOCK_MONOTONIC time at which st was retrieved. Zero if st is stale. */
+	struct timespec time;
+} tagdb_attr_t;
+
 typedef struct
 {
 	tagdb_entrykind_t kind;
+	// Only valid if kind==TDB_FILE_ENTRY and fileTags is NULL, the ID of the file in the binary tagdb it was loaded from
+	uint32_t fileId;
 
 	union
 	{
 		// Only valid if kind==TDB_TAG_ENTRY, in 0..tagCap
 		size_t tagId;
-		// Only valid if kind==TDB_FILE_ENTRY, has length of at least tagCap
-		bitarr_t fileTags;
+
+		struct
+		{
+			// Only valid if kind==TDB_FILE_ENTRY, has length of at least tagCap. NULL until first used if loaded from a binary tagdb, see tdb_tags
+			bitarr_t fileTags;
+			// Only valid if kind==TDB_FILE_ENTRY, NULL until the user of the tagdb caches attributes
+			tagdb_attr_t *fileAttr;
+		};
 	};
 } tagdb_entry_t;
 
 #define HVAL_T tagdb_entry_t
 #include "hashmap.h"
 
+/* The ascending file IDs of a tag of a binary tagdb, decoded from its list once it's looked at */
+typedef struct
+{
+	size_t count;
+	uint32_t ids[];
+} tagdb_idlist_t;
+
+/* The binary tagdb file entries were loaded from, so their tags are only set up once they're used */
+typedef struct
+{
+	/* The mapping of the file. The names of entries loaded from it are used in place, see hmap_lend */
+	const char *map;
+	size_t size;
+	/* Version of the file and the number of files in it */
+	uint32_t version;
+	uint64_t files;
+	/* The file ID list of tag ID t in the mapping is made of the IDs from idOffs[t] up to before idOffs[t + 1] at ids,
+		counted in uint32_t for version 2, see tagdb_binhdr_t */
+	const uint64_t *idOffs;
+	const unsigned char *ids;
+	/* Number of tags loaded, which got the tag IDs 0..tags. tagAlive[t] is cleared once tag ID t is removed, so it may be reused. */
+	size_t tags;
+	bool *tagAlive;
+	/* Length of tags. The decoded list of tag ID t, NULL until it's first looked at and for bitmaps, which are read in place */
+	tagdb_idlist_t **tagFiles;
+	/* NULL until the tags of a file are first listed, then the tag IDs of file ID i are fileTagIds[fileOffs[i]]
+		up to before fileTagIds[fileOffs[i + 1]], ascending, with fileTagIds following fileOffs[files], see _tdb_fileOffs */
+	uint64_t *fileOffs;
+} tagdb_lazy_t;
+
 typedef struct
 {
 	/* Maps entry names to tagdb_entry_t structures */
@@ -45,20 +100,172 @@ typedef struct
 	bitarr_t tagIds;
 	/* Upper limit on tag IDs */
 	size_t tagCap;
+	/* Length of tagCap. The names of the tags by tag ID, owned by their entries, or NULL for free tag IDs */
+	const char **tagNames;
 	/* The underlying file stream */
 	FILE *file;
+	/* Where problems with the loaded data are reported, or NULL to not report them */
+	FILE *log;
+	/* Every change is logged to the journal if it isn't NULL, see tdb_journal */
+	journal_t *journal;
+	/* Identifies the tagdb file the tagdb was loaded from plus the changes made since, so a journal is only replayed
+		onto the file it was started for. Journals and tagdb files store the ID. 0 for text tagdb files. */
+	uint64_t id;
+	/* Set if the tagdb was loaded from a binary tagdb */
+	tagdb_lazy_t *lazy;
 } tagdb_t;
 
+/* The kinds of journal records. Records are made of the kind, as a byte, followed by NUL terminated names.
+	They name entries rather than tag IDs, so replaying a record applied before doesn't change the tagdb. */
+typedef enum
+{
+	// Creates the tag with the given name
+	TDB_LOG_TAG = 1,
+	// Creates the file with the given name
+	TDB_LOG_FILE,
+	// Removes the entry with the given name
+	TDB_LOG_RM,
+	// Renames the entry with the first name to the second name, unless the second one exists
+	TDB_LOG_RENAME,
+	// Marks the file with the first name with exactly the tags named by the remaining names
+	TDB_LOG_TAGS,
+	// Changes the ID of the tagdb to the uint64_t following the kind, since the journal continues in a new file
+	TDB_LOG_NEXT,
+} tagdb_logkind_t;
+
+/* Identifies a binary tagdb. Text tagdbs can't start with it, since fields never contain NUL. */
+#define TDB_MAGIC "tagdb\0bn"
+#define TDB_VERSION 3
+/* The oldest version that can still be loaded. Version 2 stored the file IDs of tags as plain uint32_t. */
+#define TDB_VERSION_MIN 2
+
+/* Encodings of the file ID list of a tag in a binary tagdb */
+typedef enum
+{
+	// The IDs as LEB128 varints, each the distance to the ID following the previous one
+	TDB_IDS_VARINT = 1,
+	// A bitmap with bit i of byte i / 8 set for file ID i, as long as needed for the highest ID
+	TDB_IDS_BITMAP,
+} tagdb_idskind_t;
+
+/* Header of a binary tagdb, followed by
+	- a tagdb_binentry_t for every tag, in order of their dense tag ID, then for every file, in order of their file ID
+	- tags + 1 uint64_t offsets into the file ID lists; the list of a tag is made of the bytes between its offset and the next one
+	- ids bytes of file ID lists. Every list is either empty, or a tagdb_idskind_t byte followed by the IDs in that encoding,
+		whichever is shorter, so files are stored once with tags only listing their IDs
+	- the string table, holding the NUL terminated entry names
+	Numbers are in host byte order, so a tagdb from a host of different endianness fails the version check. */
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	/* Reserved, 0 */
+	uint32_t flags;
+	/* The ID of the tagdb when it was written, see tagdb_t */
+	uint64_t id;
+	/* Counts of tags and files, and the length of the file ID lists */
+	uint64_t tags, files, ids;
+	/* Length of the string table */
+	uint64_t strings;
+	/* FNV-1a hash of everything following the header */
+	uint64_t checksum;
+} tagdb_binhdr_t;
+
+/* An entry of a binary tagdb */
+typedef struct
+{
+	/* The hashmap digest of the name, so loading doesn't rehash it */
+	uint64_t primary, secondary, len;
+	/* Offset of the name in the string table */
+	uint64_t name;
+} tagdb_binentry_t;
+
+/* A copy of a tagdb in the binary format, written without needing the tagdb */
+typedef struct
+{
+	/* ids is the number of file IDs, and offs index them. Lists are only encoded, and the checksum computed, when writing the snapshot. */
+	tagdb_binhdr_t h;
+	tagdb_binentry_t *entries;
+	uint64_t *offs;
+	uint32_t *ids;
+	char *strings;
+} tagdb_snapshot_t;
+
+/* Least number of bytes of a text tagdb each thread parses, so small tagdbs aren't split up */
+#define TDB_PARSE_CHUNK (1 << 20)
+/* Most threads parsing a text tagdb */
+#define TDB_PARSE_THREADS 16
+
+/* A non-empty field of a text tagdb or manifest */
+typedef struct
+{
+	/* Offset of the unescaped, NUL terminated name in the names of the parser */
+	size_t name;
+	struct hmap_digest digest;
+	/* Set for tag names, which are followed by the names of their files in a text tagdb, and follow their file in a manifest */
+	bool tag;
+} _tdb_field_t;
+
+/* Parses a part of a text tagdb, which starts with a tag name and ends before one, see _tdb_parseText,
+	or whole lines of a manifest, see tdb_import */
+typedef struct
+{
+	const char *start, *end;
+	char *names;
+	size_t namesLen, namesCap;
+	_tdb_field_t *fields;
+	size_t count, cap;
+	/* errno of the failure that stopped parsing, or 0 */
+	int err;
+	/* Separates the fields of a line of a manifest */
+	char sep;
+	/* Set if the parser runs on its own thread */
+	bool threaded;
+	pthread_t thread;
+} _tdb_parser_t;
+
 #pragma endregion
 
 #pragma region Interface Declaration
-/* Opens the given filename as tagdb.
+/* Opens the given filename as tagdb, either in the binary or in the text format.
 	The file stream is used internally after the call and is managed by the tagdb.
-	Returns NULL and prints an error message on IO or malloc error. */
-tagdb_t *tdb_open(FILE *f);
-/* Serializes the tagdb to the stream given with tdb_open.
-	Returns false and prints an error message to the given error stream on IO error, true on success. */
-bool tdb_flush(tagdb_t *tdb, FILE *log);
+	Errors and duplicate definitions are reported to log, unless it's NULL. Returns NULL and sets errno on IO or malloc error. */
+tagdb_t *tdb_open(FILE *f, FILE *log);
+/* Writes the tagdb to the stream in the binary format.
+	Returns false and sets errno on failure. */
+bool tdb_write(tagdb_t *tdb, FILE *f);
+/* Copies the tagdb as it is now, so it can be written while the tagdb changes. Takes about as much memory as the written file.
+	Returns NULL and sets errno on failure. */
+tagdb_snapshot_t *tdb_snapshot(tagdb_t *tdb);
+/* Writes the snapshot to the stream in the binary format. Returns false and sets errno on failure. */
+bool tdb_writeSnapshot(tagdb_snapshot_t *s, FILE *f);
+void tdb_freeSnapshot(tagdb_snapshot_t *s);
+/* Writes the tagdb to the stream in the text format, i.e. every tag followed by its files and an empty line.
+	Returns false and sets errno on failure. */
+bool tdb_writeText(tagdb_t *tdb, FILE *f);
+/* Adds the files and tags listed in the manifest in the stream to the tagdb, parsing it on the given number of threads,
+	or on as many as fit its size if 0. Every line names a file followed by its tags, separated by sep.
+	With ',' as separator, fields may be quoted with '"' to contain commas, with quotes doubled inside; no field contains a newline.
+	Empty fields are ignored, as are lines starting with one. Changes aren't logged to the journal.
+	Returns the number of lines naming a file, or -1 and sets errno on failure; EINVAL if a name is both a tag and a file,
+	ENODEV if the stream isn't a mappable file. */
+ssize_t tdb_import(tagdb_t *tdb, FILE *f, char sep, size_t threads);
+/* Replays the journal in the file onto the tagdb, then logs every change of the tagdb to it.
+	A journal started for another ID is stale, i.e. already part of the tagdb file, and is emptied instead.
+	Changes are only durable once journal_sync(tdb->journal) returns. The tagdb owns fd afterwards.
+	Returns false and sets errno on failure. */
+bool tdb_journal(tagdb_t *tdb, int fd);
+/* Replays the journal in the file onto the tagdb if it was started for the ID of the tagdb, without logging to it.
+	Closes fd. Returns false and sets errno on failure. */
+bool tdb_replay(tagdb_t *tdb, int fd);
+/* Replays the journals of the tagdb file at path, relative to dirfd, without logging to them: the old one left by
+	an interrupted checkpoint, then the current one. Missing journals are skipped. Returns false and sets errno on failure. */
+bool tdb_replayJournals(tagdb_t *tdb, int dirfd, const char *path);
+/* Gives the tagdb a new ID and logs it, e.g. to continue the journal in a new file with journal_switch.
+	Returns false and sets errno if the change can't be made durable. */
+bool tdb_nextId(tagdb_t *tdb);
+/* Logs the tags of the file entry after they were changed without tdb_entry_set, e.g. with bitarr_copy */
+void tdb_changed(tagdb_t *tdb, tagdb_entry_t *fileEntry);
 /* Releases all resources of the given tagdb. */
 void tdb_destroy(tagdb_t *tdb);
 
@@ -92,15 +299,22 @@ const char *tdb_entryName(tagdb_entry_t *entry);
 	Returns -1 and sets errno on error. */
 int tdb_rename(tagdb_t *tdb, tagdb_entry_t *entry, const char *key);
 
-/* Gets the value for the given tagId in the given file entry */
-bool tdb_entry_get(tagdb_entry_t *fileEntry, size_t tagId);
-/* Sets the value for the given tagId in the given file entry */
-void tdb_entry_set(tagdb_entry_t *fileEntry, size_t tagId, bool value);
+/* Returns the tags of the file entry, setting them up if the entry was loaded from a binary tagdb and isn't used yet.
+	Safe to call from several threads as long as the tagdb doesn't change meanwhile.
+	Returns NULL and sets errno on malloc failure. */
+bitarr_t tdb_tags(tagdb_t *tdb, tagdb_entry_t *fileEntry);
+/* Gets the value for the given tagId in the given file entry, without setting up its tags */
+bool tdb_entry_get(tagdb_t *tdb, tagdb_entry_t *fileEntry, size_t tagId);
+/* Sets the value for the given tagId in the given file entry.
+	A change that can't be made for lack of memory fails the journal, if there is one. */
+void tdb_entry_set(tagdb_t *tdb, tagdb_entry_t *fileEntry, size_t tagId, bool value);
 
 #pragma endregion
 
 #pragma region Macros
 #define UNUSED __attribute__ ((unused))
+// Negates tags in queries, so no entry or real file name may start with it
+#define TDB_NEG_CHAR '-'
 
 /* Iterates over all entries in tdb.
 	tdb must be tagdb_t*.
@@ -116,7 +330,7 @@ void tdb_entry_set(tagdb_entry_t *fileEntry, size_t tagId, bool value);
 	Declares entry as tagdb_entry_t* to the current tag.
 	Continue and break work as expected. */
 #define TDB_FILE_FORALL(tdb, file, tagname, tag, body) TDB_FORALL(tdb, tagname, tag, { \
-	if(tag->kind == TDB_TAG_ENTRY && bitarr_get(file->fileTags, tag->tagId)) \
+	if(tag->kind == TDB_TAG_ENTRY && tdb_entry_get(tdb, file, tag->tagId)) \
 		body \
 })
 
@@ -127,19 +341,53 @@ void tdb_entry_set(tagdb_entry_t *fileEntry, size_t tagId, bool value);
 	Declares entry as tagdb_entry_t* to the current file.
 	Continue and break work as expected. */
 #define TDB_TAG_FORALL(tdb, tag, filename, file, body) TDB_FORALL(tdb, filename, file, { \
-	if(file->kind == TDB_FILE_ENTRY && bitarr_get(file->fileTags, tag->tagId)) \
+	if(file->kind == TDB_FILE_ENTRY && tdb_entry_get(tdb, file, tag->tagId)) \
 		body \
 })
 
 /* Asserts that an entry is valid */
 #define assertEntry(e) assert(!e \
-	|| (e->kind == TDB_FILE_ENTRY && bitarr_match(tdb->tagIds, tdb->tagCap, e->fileTags, NULL)) \
+	|| (e->kind == TDB_FILE_ENTRY && (!e->fileTags || bitarr_match(tdb->tagIds, tdb->tagCap, e->fileTags, NULL))) \
 	|| (e->kind == TDB_TAG_ENTRY && e->tagId < tdb->tagCap && bitarr_get(tdb->tagIds, e->tagId)))
 
 
 #pragma endregion
 
 #pragma region Internal Functions
+/* Runs body with t declared as every tag ID of the file entry, in ascending order, without setting up the tags of the entry */
+#define _TDB_TAGS_FORALL(tdb, file, t, body) { \
+	bitarr_t _tags = __atomic_load_n(&(file)->fileTags, __ATOMIC_ACQUIRE); \
+	if(_tags) \
+	{ \
+		for (size_t t = 0; t < (tdb)->tagCap; t++) \
+			if(bitarr_get((tdb)->tagIds, t) && bitarr_get(_tags, t)) \
+				body \
+	} \
+	else \
+	{ \
+		tagdb_lazy_t *_l = (tdb)->lazy; \
+		uint64_t *_offs = _tdb_fileOffs(tdb); \
+		if(_offs) \
+		{ \
+			const uint32_t *_ids = (const uint32_t*)(_offs + _l->files + 1); \
+			for (uint64_t _k = _offs[(file)->fileId]; _k < _offs[(file)->fileId + 1]; _k++) \
+			{ \
+				size_t t = _ids[_k]; \
+				/* tags may have been removed since */ \
+				if(_l->tagAlive[t]) \
+					body \
+			} \
+		} \
+		else \
+		{ \
+			/* without the memory to turn the lists around, every tag is looked at */ \
+			for (size_t t = 0; t < _l->tags; t++) \
+				if(_tdb_lazyHas(tdb, t, (file)->fileId)) \
+					body \
+		} \
+	} \
+}
+
 /* Finalizes the given entry. Allocates file tag array or finds a free tagID. */
 bool _tdb_mkentry(tagdb_t *tdb, tagdb_entry_t *e, tagdb_entrykind_t k)
 {
@@ -149,6 +397,8 @@ bool _tdb_mkentry(tagdb_t *tdb, tagdb_entry_t *e, tagdb_entrykind_t k)
 	{
 		if(!(e->fileTags = bitarr_new(tdb->tagCap)))
 			return false;
+
+		e->fileAttr = NULL;
 	}
 	else
 	{
@@ -158,8 +408,9 @@ bool _tdb_mkentry(tagdb_t *tdb, tagdb_entry_t *e, tagdb_entrykind_t k)
 		{ // Need to expand every file entry's bitarray
 			size_t newCap = tdb->tagCap * 2;
 
+			// entries without tags yet get them at the new size
 			HMAP_FORALL(tdb->map, UNUSED const char *key, tagdb_entry_t *fe, {
-				if(fe->kind != TDB_FILE_ENTRY)
+				if(fe->kind != TDB_FILE_ENTRY || !fe->fileTags)
 					continue;
 
 				bitarr_t nb = bitarr_resize(fe->fileTags, tdb->tagCap, newCap);
@@ -175,237 +426,1724 @@ bool _tdb_mkentry(tagdb_t *tdb, tagdb_entry_t *e, tagdb_entrykind_t k)
 			if(!ntb)
 				return false;
 
-			freeId = tdb->tagCap;
 			tdb->tagIds = ntb;
+
+			const char **names = realloc(tdb->tagNames, newCap * sizeof(char*));
+
+			if(!names)
+				return false;
+
+			memset(names + tdb->tagCap, 0, (newCap - tdb->tagCap) * sizeof(char*));
+			freeId = tdb->tagCap;
+			tdb->tagNames = names;
 			tdb->tagCap = newCap;
 		}
 
 		bitarr_set(tdb->tagIds, freeId, true);
+		tdb->tagNames[freeId] = hmap_key(e);
 		e->tagId = freeId;
 	}
 
 	e->kind = k;
 	return true;
 }
-#pragma endregion
-
-#pragma region Implementation
 
-tagdb_entry_t *tdb_get(tagdb_t *tdb, const char *entryName)
+/* Reports a problem with the loaded data to the log of the tagdb, if it has one. Keeps errno. */
+static void __attribute__ ((format (printf, 2, 3))) _tdb_warn(tagdb_t *tdb, const char *fmt, ...)
 {
-	tagdb_entry_t *e = hmap_get(tdb->map, entryName);
-	assertEntry(e);
-	return e;
+	if(!tdb->log)
+		return;
+
+	int eno = errno;
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(tdb->log, fmt, args);
+	va_end(args);
+	errno = eno;
 }
 
-tagdb_entry_t *tdb_ins(tagdb_t *tdb, const char *entryName, tagdb_entrykind_t k)
+/* Returns the bitmap of the file IDs of tag ID t of the binary tagdb in the mapping and stores its length in *bytes,
+	or returns NULL if the list of the tag isn't a bitmap */
+static const unsigned char *_tdb_bitmap(const tagdb_lazy_t *l, size_t t, uint64_t *bytes)
 {
-	tagdb_entry_t *e = NULL;
+	const unsigned char *p = l->ids + l->idOffs[t];
 
-	if(hmap_tryIns(tdb->map, entryName, (tagdb_entry_t){ .kind = TDB_EMPTY_ENTRY }, &e) == 1 && !_tdb_mkentry(tdb, e, k))
-		goto fail;
+	if(l->version == 2 || l->idOffs[t] == l->idOffs[t + 1] || *p != TDB_IDS_BITMAP)
+		return NULL;
 
-	assertEntry(e);
+	*bytes = l->idOffs[t + 1] - l->idOffs[t] - 1;
+	return p + 1;
+}
 
-	return e;
+/* Reads the file IDs of a list of a binary tagdb that isn't a bitmap, see _tdb_nextId */
+typedef struct
+{
+	const unsigned char *p, *end;
+	// the lowest ID the next one may have
+	uint64_t next;
+} tagdb_idreader_t;
 
-	fail:
-	hmap_delVal(e);
-	return NULL;
+/* Starts reading the list of tag ID t of the binary tagdb, which isn't a bitmap */
+static tagdb_idreader_t _tdb_readIds(const tagdb_lazy_t *l, size_t t)
+{
+	size_t w = (l->version == 2) ? sizeof(uint32_t) : 1;
+	tagdb_idreader_t r = { l->ids + l->idOffs[t] * w, l->ids + l->idOffs[t + 1] * w, 0 };
+
+	// past the kind of the list, checked by _tdb_load
+	if(l->version > 2 && r.p < r.end)
+		r.p++;
+
+	return r;
 }
 
-int tdb_tryIns(tagdb_t *tdb, const char *entryName, tagdb_entrykind_t k, tagdb_entry_t **_entry)
+/* Reads the next ID from the list into *id.
+	Returns 1 for an ID, 0 at the end of the list, or -1 if the list is damaged or names a file ID from files on. */
+static int _tdb_nextId(const tagdb_lazy_t *l, tagdb_idreader_t *r, uint32_t *id)
 {
-	tagdb_entry_t *entry;
-	int c = hmap_tryIns(tdb->map, entryName, (tagdb_entry_t){ .kind = TDB_EMPTY_ENTRY }, &entry);
+	uint64_t d = 0;
 
-	if(_entry)
-		*_entry = entry;
+	if(r->p == r->end)
+		return 0;
 
-	if(c == 1 && !_tdb_mkentry(tdb, entry, k))
+	if(l->version == 2)
 	{
-		hmap_delVal(entry);
-		return -1;
+		uint32_t v;
+
+		memcpy(&v, r->p, sizeof(v));
+		r->p += sizeof(v);
+
+		if(v < r->next)
+			return -1;
+
+		d = v - r->next;
 	}
+	else
+	{
+		// file IDs fit into 32 bits, so no varint is longer than 5 bytes
+		for (int shift = 0; ; shift += 7)
+		{
+			if(r->p == r->end || shift > 28)
+				return -1;
 
-	return c;
-}
+			d |= (uint64_t)(*r->p & 0x7f) << shift;
 
-bool tdb_rm(tagdb_t *tdb, const char *entryName)
-{
-	tagdb_entry_t *e = hmap_get(tdb->map, entryName);
+			if(!(*r->p++ & 0x80))
+				break;
+		}
+	}
 
-	assertEntry(e);
+	if(d >= l->files - r->next)
+		return -1;
 
-	if(e)
-		tdb_rmE(tdb, e);
+	*id = r->next + d;
+	r->next = *id + 1ULL;
 
-	return (bool)e;
+	return 1;
 }
 
-void tdb_rmE(tagdb_t *tdb, tagdb_entry_t *entry)
+/* Returns the decoded list of tag ID t of the binary tagdb, which isn't a bitmap, decoding it the first time.
+	Safe to call under a read lock. A damaged list is reported and taken as empty.
+	Returns NULL on malloc failure. */
+static tagdb_idlist_t *_tdb_tagFiles(tagdb_t *tdb, size_t t)
 {
-	// TODO: Shrink tagCap back down
+	tagdb_lazy_t *l = tdb->lazy;
+	tagdb_idlist_t *list = __atomic_load_n(&l->tagFiles[t], __ATOMIC_ACQUIRE), *set = NULL;
 
-	if(entry->kind == TDB_FILE_ENTRY)
-		free(entry->fileTags);
-	else
-		bitarr_set(tdb->tagIds, entry->tagId, false);
+	if(list)
+		return list;
 
-	hmap_delVal(entry);
-}
+	// every ID takes at least a byte, or a uint32_t in version 2
+	if(!(list = malloc(sizeof(tagdb_idlist_t) + (l->idOffs[t + 1] - l->idOffs[t]) * sizeof(uint32_t))))
+		return NULL;
 
-const char *tdb_entryName(tagdb_entry_t *entry)
-{
-	return hmap_key(entry);
-}
+	tagdb_idreader_t r = _tdb_readIds(l, t);
+	int c;
 
-bool tdb_entry_get(tagdb_entry_t *fileEntry, size_t tagId)
-{
-	return bitarr_get(fileEntry->fileTags, tagId);
+	list->count = 0;
+
+	while((c = _tdb_nextId(l, &r, list->ids + list->count)) == 1)
+		list->count++;
+
+	if(c == -1)
+	{
+		_tdb_warn(tdb, "Damaged file list of tag '%s', taken as empty\n", tdb->tagNames[t]);
+		list->count = 0;
+	}
+
+	// readers may decode the same list at once, and the first one wins
+	if(!__atomic_compare_exchange_n(&l->tagFiles[t], &set, list, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free(list);
+		list = set;
+	}
+
+	return list;
 }
 
-void tdb_entry_set(tagdb_entry_t *fileEntry, size_t tagId, bool value)
+/* Determines if tag ID t of the binary tagdb is on file ID id, without setting up the tags of the file.
+	Safe to call under a read lock. */
+static bool _tdb_lazyHas(tagdb_t *tdb, size_t t, uint32_t id)
 {
-	bitarr_set(fileEntry->fileTags, tagId, value);
+	tagdb_lazy_t *l = tdb->lazy;
+	const unsigned char *bits;
+	uint64_t bytes;
+
+	if(t >= l->tags || !l->tagAlive[t])
+		return false;
+	if((bits = _tdb_bitmap(l, t, &bytes)))
+		return id / 8 < bytes && (bits[id / 8] >> (id % 8) & 1);
+
+	tagdb_idlist_t *list = _tdb_tagFiles(tdb, t);
+
+	if(!list)
+	{
+		// without the memory to decode the list, it's read in place
+		tagdb_idreader_t r = _tdb_readIds(l, t);
+		uint32_t cur;
+
+		while(_tdb_nextId(l, &r, &cur) == 1)
+			if(cur >= id)
+				return cur == id;
+
+		return false;
+	}
+
+	size_t lo = 0, hi = list->count;
+
+	while(lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if(list->ids[mid] == id)
+			return true;
+		if(list->ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return false;
 }
 
-int tdb_rename(tagdb_t *tdb, tagdb_entry_t *entry, const char *key)
+/* Adds every tag of the binary tagdb that wasn't removed to the files in its list: stores tag t at tagIds[pos[id]++] for every file ID,
+	or only counts the tags of every file in pos if tagIds is NULL.
+	Returns false on malloc failure, which can't happen once every list was decoded by a call without tagIds. */
+static bool _tdb_invertTags(tagdb_t *tdb, uint64_t *pos, uint32_t *tagIds)
 {
-	if(hmap_get(tdb->map, key))
-		return 1;
+	#define ADD(id) { if(tagIds) tagIds[pos[id]] = t; pos[id]++; }
+	tagdb_lazy_t *l = tdb->lazy;
 
-	tagdb_entry_t e = *entry;
-	hmap_delVal(entry);
+	for (uint32_t t = 0; t < l->tags; t++)
+	{
+		const unsigned char *bits;
+		uint64_t bytes;
+		tagdb_idlist_t *list;
+
+		if(!l->tagAlive[t])
+			continue;
+		if((bits = _tdb_bitmap(l, t, &bytes)))
+		{
+			for (uint64_t i = 0; i < bytes; i++)
+				for (unsigned b = bits[i]; b; b &= b - 1)
+					ADD(i * 8 + __builtin_ctz(b))
+
+			continue;
+		}
+
+		if(!(list = _tdb_tagFiles(tdb, t)))
+			return false;
+
+		for (size_t k = 0; k < list->count; k++)
+			ADD(list->ids[k])
+	}
 
-	return hmap_ins(tdb->map, key, e) ? 0 : -1;
+	return true;
+	#undef ADD
 }
 
-void tdb_destroy(tagdb_t *tdb)
+/* Returns the offsets of the tag IDs of every file of the binary tagdb, see tagdb_lazy_t, turning the lists of the tags
+	around the first time. Safe to call under a read lock.
+	Returns NULL on malloc failure. */
+static uint64_t *_tdb_fileOffs(tagdb_t *tdb)
 {
-	if(tdb)
+	tagdb_lazy_t *l = tdb->lazy;
+	uint64_t *offs = __atomic_load_n(&l->fileOffs, __ATOMIC_ACQUIRE), *set = NULL;
+
+	if(offs)
+		return offs;
+	if(!(offs = calloc(l->files + 1, sizeof(uint64_t))))
+		return NULL;
+
+	// the tags of every file are counted, then stored by file
+	if(!_tdb_invertTags(tdb, offs + 1, NULL))
+		goto err;
+
+	for (size_t i = 0; i < l->files; i++)
+		offs[i + 1] += offs[i];
+
+	uint64_t *all = realloc(offs, (l->files + 1) * sizeof(uint64_t) + (offs[l->files] + 1) * sizeof(uint32_t));
+
+	if(!all)
+		goto err;
+
+	offs = all;
+
+	// storing moves the offset of every file to that of the next one
+	_tdb_invertTags(tdb, offs, (uint32_t*)(offs + l->files + 1));
+	memmove(offs + 1, offs, l->files * sizeof(uint64_t));
+	offs[0] = 0;
+
+	if(!__atomic_compare_exchange_n(&l->fileOffs, &set, offs, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
 	{
-		fclose(tdb->file);
-		hmap_destroy(tdb->map);
-		bitarr_destroy(tdb->tagIds);
-		free(tdb);
+		free(offs);
+		offs = set;
 	}
+
+	return offs;
+
+	err:
+	free(offs);
+	return NULL;
 }
 
-tagdb_t *tdb_open(FILE *f)
+/* Appends a record of the given kind with one or two names to the journal, if there is one.
+	A failed append is reported by the next journal_sync. */
+static void _tdb_log(tagdb_t *tdb, tagdb_logkind_t k, const char *a, const char *b)
 {
-	#define ERRPE(msg) { perror(msg); goto err; }
-	tagdb_t *tdb = (tagdb_t*)malloc(sizeof(tagdb_t));
+	if(!tdb->journal)
+		return;
 
-	if(!tdb)
+	size_t la = strlen(a) + 1, lb = b ? strlen(b) + 1 : 0;
+	char *rec = malloc(1 + la + lb);
+
+	// the journal must not miss a change
+	if(!rec)
 	{
-		perror("Malloc failure");
-		return NULL;
+		journal_fail(tdb->journal, errno);
+		return;
 	}
 
-	tdb->file = f;
-	tdb->map = hmap_new();
-	tdb->tagCap = 16;
-	tdb->tagIds = bitarr_new(16);
+	rec[0] = k;
+	memcpy(rec + 1, a, la);
 
-	if(!tdb->map || !tdb->tagIds)
-		ERRPE("Malloc failure")
+	if(b)
+		memcpy(rec + 1 + la, b, lb);
 
-	do
+	journal_append(tdb->journal, rec, 1 + la + lb);
+	free(rec);
+}
+
+/* Appends a TDB_LOG_TAGS record of the file entry to the journal, if there is one */
+static void _tdb_logTags(tagdb_t *tdb, tagdb_entry_t *file)
+{
+	if(!tdb->journal)
+		return;
+
+	const char *name = hmap_key(file);
+	size_t len = 1 + strlen(name) + 1;
+
+	_TDB_TAGS_FORALL(tdb, file, t, {
+		len += strlen(tdb->tagNames[t]) + 1;
+	})
+
+	char *rec = malloc(len), *p = rec;
+
+	if(!rec)
 	{
-		char *tagName = readfield(f);
+		journal_fail(tdb->journal, errno);
+		return;
+	}
 
-		if(!tagName)
-			ERRPE("Cannot read field")
-		if(!*tagName)
-		{
-			free(tagName);
-			continue;
-		}
+	*p++ = TDB_LOG_TAGS;
+	p = stpcpy(p, name) + 1;
 
-		tagdb_entry_t *tag;
-		int c = tdb_tryIns(tdb, tagName, TDB_TAG_ENTRY, &tag);
-		// tag may get invalidated by file insertion.
-		size_t tagId = tag->tagId;
+	_TDB_TAGS_FORALL(tdb, file, t, {
+		p = stpcpy(p, tdb->tagNames[t]) + 1;
+	})
 
-		if(c == -1)
-			ERRPE("Cannot insert tag")
-		else if(c == 0)
-			fprintf(stderr, "Tag '%s' present twice - merging definitions\n", tagName);
+	journal_append(tdb->journal, rec, len);
+	free(rec);
+}
 
-		for (;;)
-		{
-			char *fileName = readfield(f);
+/* Applies a journal record to the tagdb, which doesn't log it again. Used as journal_cb_t.
+	Returns false and sets errno on malloc failure or if the record is malformed. */
+static bool _tdb_apply(void *_tdb, const void *_rec, size_t len)
+{
+	tagdb_t *tdb = _tdb;
+	const char *rec = _rec, *end = rec + len;
+	const char *a = rec + 1, *b = a + strnlen(a, end - a) + 1;
+	tagdb_entry_t *e;
+	bitarr_t tags;
 
-			if(!fileName)
-			{
-				free(tagName);
-				ERRPE("Cannot read field")
-			}
-			if(!*fileName)
-			{
-				free(fileName);
+	if(len == 1 + sizeof(uint64_t) && rec[0] == TDB_LOG_NEXT)
+	{
+		memcpy(&tdb->id, rec + 1, sizeof(uint64_t));
+		return true;
+	}
+	// every name is NUL terminated
+	if(len < 2 || end[-1])
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	switch(rec[0])
+	{
+		case TDB_LOG_TAG:
+		case TDB_LOG_FILE:
+			return tdb_tryIns(tdb, a, (rec[0] == TDB_LOG_TAG) ? TDB_TAG_ENTRY : TDB_FILE_ENTRY, NULL) != -1;
+		case TDB_LOG_RM:
+			tdb_rm(tdb, a);
+			return true;
+		case TDB_LOG_RENAME:
+			if(b >= end)
 				break;
-			}
+			// the record may have been applied before, when the journal was compacted
+			if((e = tdb_get(tdb, a)) && !tdb_get(tdb, b))
+				return tdb_rename(tdb, e, b) != -1;
+
+			return true;
+		case TDB_LOG_TAGS:
+			if(!(e = tdb_get(tdb, a)) || e->kind != TDB_FILE_ENTRY)
+				return true;
+			if(!(tags = tdb_tags(tdb, e)))
+				return false;
 
-			tagdb_entry_t *file = tdb_ins(tdb, fileName, TDB_FILE_ENTRY);
+			bitarr_fill(tags, 0, tdb->tagCap, false);
 
-			if(!file)
+			for (; b < end; b += strlen(b) + 1)
 			{
-				free(fileName);
-				free(tagName);
-				ERRPE("Cannot insert file")
+				tagdb_entry_t *tag = tdb_get(tdb, b);
+
+				// entries move when others are inserted, but not when bits change
+				if(tag && tag->kind == TDB_TAG_ENTRY)
+					bitarr_set(tags, tag->tagId, true);
 			}
 
-			if(bitarr_get(file->fileTags, tagId))
-				fprintf(stderr, "Relationship %s->%s present twice - ignoring duplicate definition\n", tagName, fileName);
-			else
-				bitarr_set(file->fileTags, tagId, true);
+			return true;
+	}
 
-			free(fileName);
-		}
+	errno = EINVAL;
+	return false;
+}
 
-		free(tagName);
-	} while(!feof(f));
+#define _TDB_SUM_INIT 14695981039346656037ULL
 
-	clearerr(tdb->file);
+/* Continues the FNV-1a hash h over len bytes at p */
+static uint64_t _tdb_sum(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *c = p;
 
-	return tdb;
-	err:
-	tdb_destroy(tdb);
-	return NULL;
-	#undef ERRPE
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ c[i]) * 1099511628211ULL;
+
+	return h;
 }
 
-bool tdb_flush(tagdb_t *tdb, FILE *log)
+/* Returns the number of bytes of n as LEB128 varint */
+static size_t _tdb_varintLen(uint64_t n)
 {
-	// Does it need to be truncated?
-	bool s = !ftruncate(fileno(tdb->file), 0);
-	rewind(tdb->file);
+	size_t len = 1;
 
-	#define WRITE(str) if(!writefield(tdb->file, str)) { \
-			fprintf(log, "IO error: %s\n", strerror(errno)); \
-			s = false; \
-		}
+	while(n >>= 7)
+		len++;
 
-	TDB_FORALL(tdb, tagname, tag, {
-		if(tag->kind != TDB_TAG_ENTRY)
-			continue;
+	return len;
+}
 
-		WRITE(tagname)
+/* Returns the length of the encoded list of the ascending file IDs, and sets *bitmap if it's encoded as bitmap.
+	A bitmap is shorter for tags on more than about every eighth file. */
+static size_t _tdb_idsLen(const uint32_t *ids, size_t count, bool *bitmap)
+{
+	uint64_t next = 0, varints = 1;
 
-		TDB_TAG_FORALL(tdb, tag, filename, file, {
-			WRITE(filename)
-		})
+	*bitmap = false;
 
-		putc('\n', tdb->file);
-	});
+	if(!count)
+		return 0;
 
-	fflush(tdb->file);
-	rewind(tdb->file);
+	for (size_t i = 0; i < count; i++)
+	{
+		varints += _tdb_varintLen(ids[i] - next);
+		next = ids[i] + 1ULL;
+	}
 
-	return s;
-	#undef WRITE
+	uint64_t bytes = 1 + ids[count - 1] / 8 + 1;
+
+	*bitmap = bytes < varints;
+
+	return *bitmap ? bytes : varints;
+}
+
+/* Encodes the ascending file IDs to o as returned by _tdb_idsLen. Returns the end of the list. */
+static unsigned char *_tdb_encodeIds(unsigned char *o, const uint32_t *ids, size_t count, bool bitmap)
+{
+	if(!count)
+		return o;
+
+	*o++ = bitmap ? TDB_IDS_BITMAP : TDB_IDS_VARINT;
+
+	if(bitmap)
+	{
+		size_t bytes = ids[count - 1] / 8 + 1;
+
+		memset(o, 0, bytes);
+
+		for (size_t i = 0; i < count; i++)
+			o[ids[i] / 8] |= 1 << (ids[i] % 8);
+
+		return o + bytes;
+	}
+
+	uint64_t next = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		uint64_t d = ids[i] - next;
+
+		for (; d >= 0x80; d >>= 7)
+			*o++ = d | 0x80;
+
+		*o++ = d;
+		next = ids[i] + 1ULL;
+	}
+
+	return o;
+}
+
+/* Releases the binary tagdb entries were loaded from */
+static void _tdb_freeLazy(tagdb_lazy_t *l)
+{
+	if(!l)
+		return;
+	if(l->map)
+		munmap((void*)l->map, l->size);
+
+	for (size_t t = 0; l->tagFiles && t < l->tags; t++)
+		free(l->tagFiles[t]);
+
+	free(l->tagFiles);
+	free(l->fileOffs);
+	free(l->tagAlive);
+	free(l);
+}
+
+/* Loads the binary tagdb in the file of the stream into the empty tagdb.
+	Maps the file and inserts every entry with its stored digest into the presized hashmap, so no name is hashed.
+	Names are used in place from the mapping. The file ID lists of tags are only decoded once they're looked at,
+	and file entries only get their tags once they're used, see tdb_tags.
+	Loading still takes a checksum pass over the file and an insert per file: every user of the tagdb finds files
+	through the hashmap, and a mount compares every real file with its entry anyway, see realdir_chk.
+	Returns false and sets errno on failure, after which the tagdb has to be destroyed; EINVAL if the file is damaged. */
+static bool _tdb_load(tagdb_t *tdb, FILE *f)
+{
+	#define BAD { errno = EINVAL; return false; }
+	struct stat st;
+	int fd = fileno(f);
+
+	if(fstat(fd, &st))
+		return false;
+	if((size_t)st.st_size < sizeof(tagdb_binhdr_t))
+		BAD
+
+	size_t size = st.st_size;
+	const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if(map == MAP_FAILED)
+		return false;
+	// the tagdb keeps the mapping from here on
+	if(!(tdb->lazy = calloc(1, sizeof(tagdb_lazy_t))))
+	{
+		munmap((void*)map, size);
+		return false;
+	}
+
+	tagdb_lazy_t *l = tdb->lazy;
+
+	l->map = map;
+	l->size = size;
+	madvise((void*)map, size, MADV_SEQUENTIAL);
+
+	const tagdb_binhdr_t *h = (const tagdb_binhdr_t*)map;
+
+	// every count is bounded by the size first, so the sum can't overflow
+	if(memcmp(h->magic, TDB_MAGIC, sizeof(h->magic)) || h->version < TDB_VERSION_MIN || h->version > TDB_VERSION || h->flags
+		|| h->tags > size || h->tags > UINT32_MAX || h->files > size || h->files > UINT32_MAX || h->ids > size || h->strings > size
+		|| sizeof(tagdb_binhdr_t) + (h->tags + h->files) * sizeof(tagdb_binentry_t) + (h->tags + 1) * sizeof(uint64_t)
+			+ h->ids * ((h->version == 2) ? sizeof(uint32_t) : 1) + h->strings != size)
+		BAD
+	if(_tdb_sum(_TDB_SUM_INIT, map + sizeof(tagdb_binhdr_t), size - sizeof(tagdb_binhdr_t)) != h->checksum)
+		BAD
+
+	const tagdb_binentry_t *entries = (const tagdb_binentry_t*)(h + 1);
+	const uint64_t *offs = (const uint64_t*)(entries + h->tags + h->files);
+	const unsigned char *ids = (const unsigned char*)(offs + h->tags + 1);
+	const char *strings = (const char*)ids + h->ids * ((h->version == 2) ? sizeof(uint32_t) : 1);
+
+	if(offs[0] || offs[h->tags] != h->ids)
+		BAD
+
+	tdb->id = h->id;
+
+	for (size_t t = 0; t < h->tags; t++)
+	{
+		uint64_t len = offs[t + 1] - offs[t];
+
+		// later offsets aren't checked yet, so each one is bounded by the end of the lists
+		if(offs[t] > offs[t + 1] || offs[t + 1] > h->ids)
+			BAD
+		if(h->version == 2 || !len)
+			continue;
+		if(ids[offs[t]] != TDB_IDS_VARINT && ids[offs[t]] != TDB_IDS_BITMAP)
+			BAD
+
+		// a bitmap ends with the byte holding its highest ID, which is checked here, unlike the IDs of varint lists
+		unsigned char last = ids[offs[t + 1] - 1];
+
+		if(ids[offs[t]] == TDB_IDS_BITMAP
+			&& (len < 2 || !last || (len - 2) * 8 + (31 - __builtin_clz(last)) >= h->files))
+			BAD
+	}
+
+	// tag IDs are dense, with room for new tags
+	size_t cap = tdb->tagCap;
+
+	while(cap <= h->tags)
+		cap *= 2;
+
+	bitarr_t tagIds = bitarr_resize(tdb->tagIds, tdb->tagCap, cap);
+	const char **tagNames = tagIds ? calloc(cap, sizeof(char*)) : NULL;
+
+	if(tagIds)
+		tdb->tagIds = tagIds;
+	if(!tagNames)
+		return false;
+
+	free(tdb->tagNames);
+	tdb->tagNames = tagNames;
+	tdb->tagCap = cap;
+	bitarr_fill(tdb->tagIds, 0, h->tags, true);
+
+	if(!hmap_reserve(tdb->map, h->tags + h->files) || !(l->tagAlive = malloc(h->tags + 1))
+		|| !(l->tagFiles = calloc(h->tags + 1, sizeof(tagdb_idlist_t*))))
+		return false;
+
+	hmap_lend(tdb->map, strings, h->strings);
+
+	for (size_t i = 0; i < h->tags + h->files; i++)
+	{
+		const tagdb_binentry_t *b = entries + i;
+		const char *name = strings + b->name;
+		tagdb_entry_t e = { .kind = TDB_TAG_ENTRY, .tagId = i };
+
+		// the checksum covers the names, so they're only checked to end in the string table
+		if(b->name >= h->strings || b->len >= h->strings - b->name || name[b->len])
+			BAD
+		if(i >= h->tags)
+			e = (tagdb_entry_t){ .kind = TDB_FILE_ENTRY, .fileId = i - h->tags };
+
+		tagdb_entry_t *p;
+		int c = hmap_tryInsDigest(tdb->map, name, (struct hmap_digest){ b->primary, b->secondary, b->len }, e, &p);
+
+		if(c == -1)
+			return false;
+		// names are unique
+		if(c == 0)
+			BAD
+		if(i < h->tags)
+			tdb->tagNames[i] = hmap_key(p);
+	}
+
+	l->version = h->version;
+	l->files = h->files;
+	l->idOffs = offs;
+	l->ids = ids;
+	l->tags = h->tags;
+	memset(l->tagAlive, true, h->tags);
+
+	// names are only read by lookups from here on
+	madvise((void*)map, size, MADV_RANDOM);
+
+	return true;
+	#undef BAD
+}
+
+/* Like tdb_tryIns, with the digest of the name known beforehand, and without logging a new entry */
+static int _tdb_tryInsDigest(tagdb_t *tdb, const char *entryName, struct hmap_digest digest, tagdb_entrykind_t k, tagdb_entry_t **_entry)
+{
+	tagdb_entry_t *entry = NULL;
+	int c = hmap_tryInsDigest(tdb->map, entryName, digest, (tagdb_entry_t){ .kind = TDB_EMPTY_ENTRY }, &entry);
+
+	if(_entry)
+		*_entry = entry;
+
+	if(c == 1 && !_tdb_mkentry(tdb, entry, k))
+	{
+		hmap_delVal(tdb->map, entry);
+		return -1;
+	}
+
+	return c;
+}
+
+/* Reads the text tagdb from the stream into the tagdb, one character at a time.
+	Works on any stream, and with NUL characters, which end a field wherever they are.
+	Returns false and prints an error on failure. */
+static bool _tdb_readText(tagdb_t *tdb, FILE *f)
+{
+	#define ERRPE(msg) { _tdb_warn(tdb, msg ": %s\n", strerror(errno)); goto err; }
+	char *tagName = NULL, *fileName = NULL;
+
+	do
+	{
+		if(!(tagName = readfield(f)))
+			ERRPE("Cannot read field")
+		if(!*tagName)
+		{
+			free(tagName);
+			tagName = NULL;
+			continue;
+		}
+
+		tagdb_entry_t *tag;
+		int c = tdb_tryIns(tdb, tagName, TDB_TAG_ENTRY, &tag);
+
+		if(c == -1)
+			ERRPE("Cannot insert tag")
+		else if(c == 0)
+			_tdb_warn(tdb, "Tag '%s' present twice - merging definitions\n", tagName);
+
+		// tag may get invalidated by file insertion.
+		size_t tagId = tag->tagId;
+
+		for (;;)
+		{
+			if(!(fileName = readfield(f)))
+				ERRPE("Cannot read field")
+			if(!*fileName)
+				break;
+
+			tagdb_entry_t *file = tdb_ins(tdb, fileName, TDB_FILE_ENTRY);
+
+			if(!file)
+				ERRPE("Cannot insert file")
+
+			if(bitarr_get(file->fileTags, tagId))
+				_tdb_warn(tdb, "Relationship %s->%s present twice - ignoring duplicate definition\n", tagName, fileName);
+			else
+				bitarr_set(file->fileTags, tagId, true);
+
+			free(fileName);
+		}
+
+		free(fileName);
+		free(tagName);
+		fileName = tagName = NULL;
+	} while(!feof(f));
+
+	return true;
+
+	err:
+	free(fileName);
+	free(tagName);
+	return false;
+	#undef ERRPE
+}
+
+/* Determines if the newline at nl ends the field starting at start, i.e. isn't escaped by an odd number of backslashes */
+static bool _tdb_fieldEnd(const char *start, const char *nl)
+{
+	const char *b = nl;
+
+	while(b > start && b[-1] == '\\')
+		b--;
+
+	return !((nl - b) & 1);
+}
+
+/* Finds the first tag name at or after p in the text tagdb at map, i.e. the field after the first empty one.
+	Which newlines end fields only depends on the backslashes right before them, so the search can start anywhere.
+	Returns end if there is none. */
+static const char *_tdb_nextBlock(const char *map, const char *p, const char *end)
+{
+	const char *nl = (p - map >= 2) ? p - 2 : map;
+
+	while((nl = memchr(nl, '\n', end - nl)))
+	{
+		// an unescaped newline followed by a newline, which can't be escaped
+		if(nl + 1 < end && nl[1] == '\n' && _tdb_fieldEnd(map, nl))
+			return nl + 2;
+
+		nl++;
+	}
+
+	return end;
+}
+
+/* Makes room for len more bytes of names in the parser. Returns false and sets errno on malloc failure. */
+static bool _tdb_reserveNames(_tdb_parser_t *p, size_t len)
+{
+	if(p->namesLen + len <= p->namesCap)
+		return true;
+
+	size_t cap = p->namesCap ? p->namesCap : 4096;
+
+	while(cap < p->namesLen + len)
+		cap *= 2;
+
+	char *names = realloc(p->names, cap);
+
+	if(!names)
+		return false;
+
+	p->names = names;
+	p->namesCap = cap;
+
+	return true;
+}
+
+/* Appends a field for the name at the given offset in the names of the parser, hashing it.
+	Returns false and sets errno on malloc failure. */
+static bool _tdb_pushField(_tdb_parser_t *p, size_t name, bool tag)
+{
+	if(p->count == p->cap)
+	{
+		size_t cap = p->cap ? p->cap * 2 : 1024;
+		_tdb_field_t *fields = realloc(p->fields, cap * sizeof(_tdb_field_t));
+
+		if(!fields)
+			return false;
+
+		p->fields = fields;
+		p->cap = cap;
+	}
+
+	p->fields[p->count++] = (_tdb_field_t){ .name = name, .digest = _hmap_hash(p->names + name), .tag = tag };
+
+	return true;
+}
+
+/* Appends the field at s, unescaped, to the names of the parser.
+	Returns the start of the next field, or NULL and sets errno on failure. */
+static const char *_tdb_parseField(_tdb_parser_t *p, const char *s)
+{
+	const char *nl = memchr(s, '\n', p->end - s);
+
+	// most fields contain no backslash, so the first newline ends them
+	if(nl && memchr(s, '\\', nl - s))
+		while(nl && !_tdb_fieldEnd(s, nl))
+			nl = memchr(nl + 1, '\n', p->end - nl - 1);
+
+	const char *e = nl ? nl : p->end;
+
+	// unescaping never makes a field longer
+	if(!_tdb_reserveNames(p, (e - s) + 1))
+		return NULL;
+
+	char *o = p->names + p->namesLen;
+
+	for (const char *c = s; c < e; c++)
+	{
+		// backslashes before other characters, and one ending the tagdb, are kept like readfield does
+		if(*c == '\\' && c + 1 < e && (c[1] == '\\' || c[1] == '\n'))
+			c++;
+
+		*o++ = *c;
+	}
+
+	*o++ = 0;
+	p->namesLen = o - p->names;
+
+	return nl ? nl + 1 : e;
+}
+
+/* Parses the fields between start and end of the parser, unescaping and hashing every name */
+static void *_tdb_parse(void *_p)
+{
+	_tdb_parser_t *p = _p;
+	const char *s = p->start;
+	bool tag = true;
+
+	while(s < p->end)
+	{
+		size_t name = p->namesLen;
+
+		if(!(s = _tdb_parseField(p, s)))
+		{
+			p->err = errno;
+			break;
+		}
+
+		// an empty field ends the files of a tag, and empty tag names are skipped
+		if(p->namesLen - name == 1)
+		{
+			p->namesLen = name;
+			tag = true;
+			continue;
+		}
+
+		if(!_tdb_pushField(p, name, tag))
+		{
+			p->err = errno;
+			break;
+		}
+
+		tag = false;
+	}
+
+	return NULL;
+}
+
+/* Parses the lines of a manifest between start and end of the parser, unquoting and hashing every name */
+static void *_tdb_parseManifest(void *_p)
+{
+	_tdb_parser_t *p = _p;
+	const char *line = p->start;
+
+	while(line < p->end)
+	{
+		const char *nl = memchr(line, '\n', p->end - line);
+		const char *e = nl ? nl : p->end;
+		bool file = true;
+
+		if(e > line && e[-1] == '\r')
+			e--;
+		// every field takes at most its length plus a terminator
+		if(!_tdb_reserveNames(p, 2 * (e - line) + 1))
+		{
+			p->err = errno;
+			break;
+		}
+
+		for (const char *c = line, *end; c <= e; c = end + 1)
+		{
+			size_t name = p->namesLen;
+			char *o = p->names + name;
+			bool quoted = p->sep == ',' && c < e && *c == '"';
+
+			for (end = c + quoted; end < e && (quoted || *end != p->sep); end++)
+			{
+				// a doubled quote stands for one, a single one ends the quoted part
+				if(quoted && *end == '"' && !(end + 1 < e && end[1] == '"'))
+				{
+					quoted = false;
+					continue;
+				}
+
+				end += quoted && *end == '"';
+				*o++ = *end;
+			}
+
+			*o++ = 0;
+
+			// a line without file is skipped
+			if(o - p->names - name == 1)
+			{
+				if(file)
+					break;
+
+				continue;
+			}
+
+			p->namesLen = o - p->names;
+
+			if(!_tdb_pushField(p, name, !file))
+			{
+				p->err = errno;
+				return NULL;
+			}
+
+			file = false;
+		}
+
+		line = nl ? nl + 1 : p->end;
+	}
+
+	return NULL;
+}
+
+/* Returns the number of threads to parse size bytes on if the caller asks for the given number, where 0 picks as many as fit */
+static size_t _tdb_threads(size_t size, size_t threads)
+{
+	// every share starts at least a byte into the file
+	if(threads > size)
+		threads = size;
+	if(threads)
+		return threads;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	threads = size / TDB_PARSE_CHUNK;
+
+	if(cpus > 0 && threads > (size_t)cpus)
+		threads = cpus;
+	if(threads > TDB_PARSE_THREADS)
+		threads = TDB_PARSE_THREADS;
+
+	return threads ? threads : 1;
+}
+
+/* Runs the parse function on every parser, on threads of their own but the first */
+static void _tdb_runParsers(_tdb_parser_t *parsers, size_t threads, void *(*parse)(void*))
+{
+	// the first share is parsed on this thread, as well as those of threads that couldn't be started
+	for (size_t i = 1; i < threads; i++)
+		parsers[i].threaded = !pthread_create(&parsers[i].thread, NULL, parse, parsers + i);
+
+	parse(parsers);
+
+	for (size_t i = 1; i < threads; i++)
+	{
+		if(parsers[i].threaded)
+			pthread_join(parsers[i].thread, NULL);
+		else
+			parse(parsers + i);
+	}
+}
+
+/* Inserts the fields found by the parser into the tagdb, in order. Returns false and sets errno on failure. */
+static bool _tdb_merge(tagdb_t *tdb, _tdb_parser_t *p)
+{
+	const char *tagName = NULL;
+	size_t tagId = 0;
+
+	for (size_t i = 0; i < p->count; i++)
+	{
+		const _tdb_field_t *f = p->fields + i;
+		const char *name = p->names + f->name;
+		tagdb_entrykind_t k = f->tag ? TDB_TAG_ENTRY : TDB_FILE_ENTRY;
+		tagdb_entry_t *e;
+		int c = _tdb_tryInsDigest(tdb, name, f->digest, k, &e);
+
+		assert(f->tag || tagName);
+
+		if(c == -1)
+			return false;
+		if(e->kind != k)
+		{
+			_tdb_warn(tdb, "'%s' is both a tag and a file\n", name);
+			errno = EINVAL;
+			return false;
+		}
+
+		if(f->tag)
+		{
+			if(!c)
+				_tdb_warn(tdb, "Tag '%s' present twice - merging definitions\n", name);
+
+			tagName = name;
+			tagId = e->tagId;
+		}
+		else if(bitarr_get(e->fileTags, tagId))
+			_tdb_warn(tdb, "Relationship %s->%s present twice - ignoring duplicate definition\n", tagName, name);
+		else
+			bitarr_set(e->fileTags, tagId, true);
+	}
+
+	return true;
+}
+
+/* Inserts the fields found by the parsers of a manifest into the tagdb: every tag first, so the tags of files are only allocated once,
+	then every file, marked with the tags following it. Returns false and sets errno on failure. */
+static bool _tdb_mergeManifest(tagdb_t *tdb, _tdb_parser_t *parsers, size_t threads, size_t files)
+{
+	tagdb_entry_t *e;
+
+	for (size_t i = 0; i < threads; i++)
+	{
+		for (size_t j = 0; j < parsers[i].count; j++)
+		{
+			const _tdb_field_t *f = parsers[i].fields + j;
+
+			if(!f->tag)
+				continue;
+			if(_tdb_tryInsDigest(tdb, parsers[i].names + f->name, f->digest, TDB_TAG_ENTRY, &e) == -1)
+				return false;
+			if(e->kind != TDB_TAG_ENTRY)
+				goto both;
+		}
+	}
+
+	// a file on several lines is counted for each, which errs on the large side
+	if(!hmap_reserve(tdb->map, tdb->map->len / 2 + files))
+		return false;
+
+	for (size_t i = 0; i < threads; i++)
+	{
+		bitarr_t tags = NULL;
+
+		for (size_t j = 0; j < parsers[i].count; j++)
+		{
+			const _tdb_field_t *f = parsers[i].fields + j;
+			const char *name = parsers[i].names + f->name;
+
+			// tags are all inserted, so the file entry doesn't move until the next file
+			if(f->tag)
+			{
+				bitarr_set(tags, _hmap_get(tdb->map, f->digest, name)->data.tagId, true);
+				continue;
+			}
+
+			if(_tdb_tryInsDigest(tdb, name, f->digest, TDB_FILE_ENTRY, &e) == -1 || (e->kind == TDB_FILE_ENTRY && !(tags = tdb_tags(tdb, e))))
+				return false;
+			if(e->kind != TDB_FILE_ENTRY)
+				goto both;
+		}
+	}
+
+	return true;
+
+	both:
+	_tdb_warn(tdb, "'%s' is both a tag and a file\n", hmap_key(e));
+	errno = EINVAL;
+	return false;
+}
+
+/* Parses the text tagdb in the file of the stream into the empty tagdb, on the given number of threads, or as many as fit its size if 0.
+	Maps the file and splits it at empty fields, so every thread unescapes and hashes whole tags with their files,
+	which are then inserted in the order of the file, so the result is the same as that of _tdb_readText.
+	Returns 1 on success, 0 if the stream isn't a mappable file or contains NUL characters, or -1 and sets errno on failure. */
+static int _tdb_parseText(tagdb_t *tdb, FILE *f, size_t threads)
+{
+	struct stat st;
+	int fd = fileno(f);
+
+	if(fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return 0;
+	if(!st.st_size)
+		return 1;
+
+	size_t size = st.st_size;
+	const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if(map == MAP_FAILED)
+		return 0;
+
+	madvise((void*)map, size, MADV_WILLNEED);
+
+	_tdb_parser_t *parsers = NULL;
+	int r = 0;
+
+	if(memchr(map, 0, size))
+		goto done;
+
+	threads = _tdb_threads(size, threads);
+	r = -1;
+
+	if(!(parsers = calloc(threads, sizeof(_tdb_parser_t))))
+		goto done;
+
+	// every parser starts at the first tag name in its share of the file
+	parsers[0].start = map;
+
+	for (size_t i = 1; i < threads; i++)
+		parsers[i - 1].end = parsers[i].start = _tdb_nextBlock(map, map + size / threads * i, map + size);
+
+	parsers[threads - 1].end = map + size;
+	_tdb_runParsers(parsers, threads, _tdb_parse);
+	r = 1;
+
+	for (size_t i = 0; r == 1 && i < threads; i++)
+	{
+		if(parsers[i].err)
+		{
+			errno = parsers[i].err;
+			r = -1;
+		}
+		else if(!_tdb_merge(tdb, parsers + i))
+			r = -1;
+	}
+
+	done:;
+	int eno = errno;
+
+	for (size_t i = 0; parsers && i < threads; i++)
+	{
+		free(parsers[i].names);
+		free(parsers[i].fields);
+	}
+
+	free(parsers);
+	munmap((void*)map, size);
+	errno = eno;
+
+	return r;
+}
+
+#pragma endregion
+
+#pragma region Implementation
+
+tagdb_entry_t *tdb_get(tagdb_t *tdb, const char *entryName)
+{
+	tagdb_entry_t *e = hmap_get(tdb->map, entryName);
+	assertEntry(e);
+	return e;
+}
+
+tagdb_entry_t *tdb_ins(tagdb_t *tdb, const char *entryName, tagdb_entrykind_t k)
+{
+	tagdb_entry_t *e = NULL;
+
+	int c = hmap_tryIns(tdb->map, entryName, (tagdb_entry_t){ .kind = TDB_EMPTY_ENTRY }, &e);
+
+	if(c == -1)
+		return NULL;
+	if(c == 1 && !_tdb_mkentry(tdb, e, k))
+		goto fail;
+	if(c == 1)
+		_tdb_log(tdb, (k == TDB_TAG_ENTRY) ? TDB_LOG_TAG : TDB_LOG_FILE, entryName, NULL);
+
+	assertEntry(e);
+
+	return e;
+
+	fail:
+	hmap_delVal(tdb->map, e);
+	return NULL;
+}
+
+int tdb_tryIns(tagdb_t *tdb, const char *entryName, tagdb_entrykind_t k, tagdb_entry_t **_entry)
+{
+	int c = _tdb_tryInsDigest(tdb, entryName, _hmap_hash(entryName), k, _entry);
+
+	if(c == 1)
+		_tdb_log(tdb, (k == TDB_TAG_ENTRY) ? TDB_LOG_TAG : TDB_LOG_FILE, entryName, NULL);
+
+	return c;
+}
+
+bool tdb_rm(tagdb_t *tdb, const char *entryName)
+{
+	tagdb_entry_t *e = hmap_get(tdb->map, entryName);
+
+	assertEntry(e);
+
+	if(e)
+		tdb_rmE(tdb, e);
+
+	return (bool)e;
+}
+
+void tdb_rmE(tagdb_t *tdb, tagdb_entry_t *entry)
+{
+	// TODO: Shrink tagCap back down
+	_tdb_log(tdb, TDB_LOG_RM, hmap_key(entry), NULL);
+
+	if(entry->kind == TDB_FILE_ENTRY)
+	{
+		free(entry->fileTags);
+		free(entry->fileAttr);
+	}
+	else
+	{
+		// a new tag reusing the ID mustn't start out on the files of this one
+		HMAP_FORALL(tdb->map, UNUSED const char *name, tagdb_entry_t *e, {
+			if(e->kind == TDB_FILE_ENTRY && e->fileTags)
+				bitarr_set(e->fileTags, entry->tagId, false);
+		})
+
+		if(tdb->lazy && entry->tagId < tdb->lazy->tags)
+			tdb->lazy->tagAlive[entry->tagId] = false;
+
+		bitarr_set(tdb->tagIds, entry->tagId, false);
+		tdb->tagNames[entry->tagId] = NULL;
+	}
+
+	hmap_delVal(tdb->map, entry);
+}
+
+const char *tdb_entryName(tagdb_entry_t *entry)
+{
+	return hmap_key(entry);
+}
+
+bitarr_t tdb_tags(tagdb_t *tdb, tagdb_entry_t *fileEntry)
+{
+	bitarr_t tags = __atomic_load_n(&fileEntry->fileTags, __ATOMIC_ACQUIRE);
+
+	if(tags)
+		return tags;
+	if(!(tags = bitarr_new(tdb->tagCap)))
+		return NULL;
+
+	_TDB_TAGS_FORALL(tdb, fileEntry, t, {
+		bitarr_set(tags, t, true);
+	})
+
+	bitarr_t set = NULL;
+
+	// readers may set up the same entry at once, and the first one wins
+	if(!__atomic_compare_exchange_n(&fileEntry->fileTags, &set, tags, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free(tags);
+		tags = set;
+	}
+
+	return tags;
+}
+
+bool tdb_entry_get(tagdb_t *tdb, tagdb_entry_t *fileEntry, size_t tagId)
+{
+	bitarr_t tags = __atomic_load_n(&fileEntry->fileTags, __ATOMIC_ACQUIRE);
+
+	if(tags)
+		return bitarr_get(tags, tagId);
+
+	return _tdb_lazyHas(tdb, tagId, fileEntry->fileId);
+}
+
+void tdb_entry_set(tagdb_t *tdb, tagdb_entry_t *fileEntry, size_t tagId, bool value)
+{
+	bitarr_t tags = tdb_tags(tdb, fileEntry);
+
+	if(!tags)
+	{
+		if(tdb->journal)
+			journal_fail(tdb->journal, errno);
+
+		return;
+	}
+	if(bitarr_get(tags, tagId) == value)
+		return;
+
+	bitarr_set(tags, tagId, value);
+	_tdb_logTags(tdb, fileEntry);
+}
+
+void tdb_changed(tagdb_t *tdb, tagdb_entry_t *fileEntry)
+{
+	_tdb_logTags(tdb, fileEntry);
+}
+
+int tdb_rename(tagdb_t *tdb, tagdb_entry_t *entry, const char *key)
+{
+	if(hmap_get(tdb->map, key))
+		return 1;
+
+	_tdb_log(tdb, TDB_LOG_RENAME, hmap_key(entry), key);
+
+	tagdb_entry_t e = *entry;
+	hmap_delVal(tdb->map, entry);
+
+	if(!(entry = hmap_ins(tdb->map, key, e)))
+		return -1;
+	if(entry->kind == TDB_TAG_ENTRY)
+		tdb->tagNames[entry->tagId] = hmap_key(entry);
+
+	return 0;
+}
+
+bool tdb_journal(tagdb_t *tdb, int fd)
+{
+	journal_t *j = journal_open(fd, tdb->id);
+
+	if(!j)
+		return false;
+	if(j->id == tdb->id ? !journal_replay(j, _tdb_apply, tdb) : !journal_reset(j, tdb->id))
+	{
+		int eno = errno;
+		journal_close(j);
+		errno = eno;
+		return false;
+	}
+
+	tdb->journal = j;
+	return true;
+}
+
+bool tdb_replay(tagdb_t *tdb, int fd)
+{
+	struct stat st;
+
+	// an empty journal has no ID yet, and fd may be read-only
+	if(!fstat(fd, &st) && !st.st_size)
+		return !close(fd);
+
+	journal_t *j = journal_open(fd, tdb->id);
+	bool ok = j && (j->id != tdb->id || journal_replay(j, _tdb_apply, tdb));
+	int eno = errno;
+
+	journal_close(j);
+	errno = eno;
+
+	return ok;
+}
+
+bool tdb_replayJournals(tagdb_t *tdb, int dirfd, const char *path)
+{
+	// the old journal holds the changes of an interrupted checkpoint, which come first
+	static const char *const journals[] = { ".journal.old", ".journal" };
+	char jpath[strlen(path) + sizeof(".journal.old")];
+
+	for (size_t i = 0; i < sizeof(journals) / sizeof(*journals); i++)
+	{
+		snprintf(jpath, sizeof(jpath), "%s%s", path, journals[i]);
+
+		int fd = openat(dirfd, jpath, O_RDONLY | O_CLOEXEC);
+
+		if((fd < 0 && errno != ENOENT) || (fd >= 0 && !tdb_replay(tdb, fd)))
+			return false;
+	}
+
+	return true;
+}
+
+bool tdb_nextId(tagdb_t *tdb)
+{
+	char rec[1 + sizeof(uint64_t)] = { TDB_LOG_NEXT };
+
+	tdb->id++;
+	memcpy(rec + 1, &tdb->id, sizeof(uint64_t));
+
+	return !tdb->journal || (journal_append(tdb->journal, rec, sizeof(rec)) && journal_sync(tdb->journal));
+}
+
+void tdb_destroy(tagdb_t *tdb)
+{
+	if(tdb)
+	{
+		fclose(tdb->file);
+		journal_close(tdb->journal);
+		hmap_destroy(tdb->map);
+		_tdb_freeLazy(tdb->lazy);
+		bitarr_destroy(tdb->tagIds);
+		free(tdb->tagNames);
+		free(tdb);
+	}
+}
+
+tagdb_t *tdb_open(FILE *f, FILE *log)
+{
+	#define ERRPE(msg) { _tdb_warn(tdb, msg ": %s\n", strerror(errno)); goto err; }
+	tagdb_t *tdb = (tagdb_t*)malloc(sizeof(tagdb_t));
+
+	if(!tdb)
+	{
+		if(log)
+			fprintf(log, "Malloc failure: %s\n", strerror(errno));
+
+		return NULL;
+	}
+
+	tdb->file = f;
+	tdb->log = log;
+	tdb->journal = NULL;
+	tdb->id = 0;
+	tdb->lazy = NULL;
+	tdb->map = hmap_new();
+	tdb->tagCap = 16;
+	tdb->tagIds = bitarr_new(16);
+	tdb->tagNames = calloc(16, sizeof(char*));
+
+	if(!tdb->map || !tdb->tagIds || !tdb->tagNames)
+		ERRPE("Malloc failure")
+
+	char magic[sizeof(((tagdb_binhdr_t*)0)->magic)];
+
+	// binary tagdbs are loaded in one go, text ones parsed line by line
+	if(fread(magic, 1, sizeof(magic), f) == sizeof(magic) && !memcmp(magic, TDB_MAGIC, sizeof(magic)))
+	{
+		if(!_tdb_load(tdb, f))
+			ERRPE("Cannot load binary tagdb")
+
+		return tdb;
+	}
+
+	rewind(f);
+
+	int r = _tdb_parseText(tdb, f, 0);
+
+	if(r == -1)
+		ERRPE("Cannot parse text tagdb")
+	if(!r && !_tdb_readText(tdb, f))
+		goto err;
+
+	clearerr(tdb->file);
+
+	return tdb;
+	err:;
+	int eno = errno;
+	tdb_destroy(tdb);
+	errno = eno;
+	return NULL;
+	#undef ERRPE
+}
+
+tagdb_snapshot_t *tdb_snapshot(tagdb_t *tdb)
+{
+	tagdb_snapshot_t *s = calloc(1, sizeof(tagdb_snapshot_t));
+	tagdb_binhdr_t *h = &s->h;
+	size_t *dense = malloc(tdb->tagCap * sizeof(size_t));
+	uint64_t *pos = NULL;
+	bool ok = false;
+
+	if(!s || !dense)
+		goto done;
+
+	memcpy(h->magic, TDB_MAGIC, sizeof(h->magic));
+	h->version = TDB_VERSION;
+	h->id = tdb->id;
+
+	// tags are numbered densely, in any order
+	HMAP_FORALL(tdb->map, UNUSED const char *name, tagdb_entry_t *e, {
+		if(e->kind == TDB_TAG_ENTRY)
+			dense[e->tagId] = h->tags++;
+		else
+			h->files++;
+
+		h->strings += hmap_digest(e).keyLen + 1;
+	})
+
+	if(h->files > UINT32_MAX)
+	{
+		errno = EOVERFLOW;
+		goto done;
+	}
+
+	if(!(s->entries = malloc((h->tags + h->files) * sizeof(tagdb_binentry_t))) || !(s->offs = calloc(h->tags + 1, sizeof(uint64_t)))
+		|| !(pos = malloc((h->tags + 1) * sizeof(uint64_t))) || !(s->strings = malloc(h->strings + 1)))
+		goto done;
+
+	size_t file = 0;
+	uint64_t str = 0;
+
+	// names go to the string table in iteration order, and the files of each tag are counted
+	HMAP_FORALL(tdb->map, const char *name, tagdb_entry_t *e, {
+		struct hmap_digest d = hmap_digest(e);
+		tagdb_binentry_t *b = s->entries + ((e->kind == TDB_TAG_ENTRY) ? dense[e->tagId] : h->tags + file++);
+
+		b->primary = d.primary;
+		b->secondary = d.secondary;
+		b->len = d.keyLen;
+		b->name = str;
+		memcpy(s->strings + str, name, d.keyLen + 1);
+		str += d.keyLen + 1;
+
+		if(e->kind != TDB_FILE_ENTRY)
+			continue;
+
+		// files without tags set up yet are read from the lists they were loaded from
+		_TDB_TAGS_FORALL(tdb, e, t, {
+			s->offs[dense[t] + 1]++;
+			h->ids++;
+		})
+	})
+
+	for (size_t t = 0; t < h->tags; t++)
+		s->offs[t + 1] += s->offs[t];
+
+	memcpy(pos, s->offs, (h->tags + 1) * sizeof(uint64_t));
+
+	if(!(s->ids = malloc((h->ids + 1) * sizeof(uint32_t))))
+		goto done;
+
+	file = 0;
+
+	// files are visited in ascending ID order, so every tag's file IDs are sorted
+	HMAP_FORALL(tdb->map, UNUSED const char *name, tagdb_entry_t *e, {
+		if(e->kind != TDB_FILE_ENTRY)
+			continue;
+
+		_TDB_TAGS_FORALL(tdb, e, t, {
+			s->ids[pos[dense[t]]++] = file;
+		})
+
+		file++;
+	})
+
+	ok = true;
+
+	done:;
+	int eno = errno;
+
+	free(dense);
+	free(pos);
+
+	if(!ok)
+	{
+		tdb_freeSnapshot(s);
+		s = NULL;
+	}
+
+	errno = eno;
+	return s;
+}
+
+bool tdb_writeSnapshot(tagdb_snapshot_t *s, FILE *f)
+{
+	tagdb_binhdr_t h = s->h;
+	uint64_t *offs = malloc((h.tags + 1) * sizeof(uint64_t));
+	bool *bitmaps = malloc((h.tags + 1) * sizeof(bool));
+	unsigned char *lists = NULL;
+	bool ok = false;
+
+	if(!offs || !bitmaps)
+		goto done;
+
+	// every list is measured first, so they're encoded into a buffer of the right size
+	offs[0] = 0;
+
+	for (size_t t = 0; t < h.tags; t++)
+		offs[t + 1] = offs[t] + _tdb_idsLen(s->ids + s->offs[t], s->offs[t + 1] - s->offs[t], bitmaps + t);
+
+	h.ids = offs[h.tags];
+
+	if(!(lists = malloc(h.ids + 1)))
+		goto done;
+
+	for (size_t t = 0; t < h.tags; t++)
+		_tdb_encodeIds(lists + offs[t], s->ids + s->offs[t], s->offs[t + 1] - s->offs[t], bitmaps[t]);
+
+	h.checksum = _tdb_sum(_TDB_SUM_INIT, s->entries, (h.tags + h.files) * sizeof(tagdb_binentry_t));
+	h.checksum = _tdb_sum(h.checksum, offs, (h.tags + 1) * sizeof(uint64_t));
+	h.checksum = _tdb_sum(h.checksum, lists, h.ids);
+	h.checksum = _tdb_sum(h.checksum, s->strings, h.strings);
+
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(s->entries, sizeof(tagdb_binentry_t), h.tags + h.files, f);
+	fwrite(offs, sizeof(uint64_t), h.tags + 1, f);
+	fwrite(lists, 1, h.ids, f);
+	fwrite(s->strings, 1, h.strings, f);
+
+	ok = !fflush(f) && !ferror(f);
+
+	done:;
+	int eno = errno;
+
+	free(offs);
+	free(bitmaps);
+	free(lists);
+	errno = eno;
+
+	return ok;
+}
+
+void tdb_freeSnapshot(tagdb_snapshot_t *s)
+{
+	if(!s)
+		return;
+
+	free(s->entries);
+	free(s->offs);
+	free(s->ids);
+	free(s->strings);
+	free(s);
+}
+
+bool tdb_write(tagdb_t *tdb, FILE *f)
+{
+	tagdb_snapshot_t *s = tdb_snapshot(tdb);
+
+	if(!s)
+		return false;
+
+	bool ok = tdb_writeSnapshot(s, f);
+	int eno = errno;
+
+	tdb_freeSnapshot(s);
+	errno = eno;
+
+	return ok;
+}
+
+bool tdb_writeText(tagdb_t *tdb, FILE *f)
+{
+	TDB_FORALL(tdb, tagname, tag, {
+		if(tag->kind != TDB_TAG_ENTRY)
+			continue;
+		if(!writefield(f, tagname))
+			return false;
+
+		TDB_TAG_FORALL(tdb, tag, filename, file, {
+			if(!writefield(f, filename))
+				return false;
+		})
+
+		if(putc('\n', f) == EOF)
+			return false;
+	})
+
+	return !fflush(f);
+}
+
+ssize_t tdb_import(tagdb_t *tdb, FILE *f, char sep, size_t threads)
+{
+	struct stat st;
+	int fd = fileno(f);
+
+	if(fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+	{
+		errno = ENODEV;
+		return -1;
+	}
+	if(!st.st_size)
+		return 0;
+
+	size_t size = st.st_size;
+	const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if(map == MAP_FAILED)
+		return -1;
+
+	madvise((void*)map, size, MADV_WILLNEED);
+	threads = _tdb_threads(size, threads);
+
+	_tdb_parser_t *parsers = calloc(threads, sizeof(_tdb_parser_t));
+	ssize_t files = -1;
+
+	if(!parsers)
+		goto done;
+
+	// every parser starts at the first line in its share of the file
+	parsers[0].start = map;
+
+	for (size_t i = 1; i < threads; i++)
+	{
+		const char *nl = memchr(map + size / threads * i - 1, '\n', size - size / threads * i + 1);
+
+		parsers[i - 1].end = parsers[i].start = nl ? nl + 1 : map + size;
+	}
+
+	parsers[threads - 1].end = map + size;
+
+	for (size_t i = 0; i < threads; i++)
+		parsers[i].sep = sep;
+
+	_tdb_runParsers(parsers, threads, _tdb_parseManifest);
+
+	size_t lines = 0;
+
+	for (size_t i = 0; i < threads; i++)
+	{
+		if(parsers[i].err)
+		{
+			errno = parsers[i].err;
+			goto done;
+		}
+
+		for (size_t j = 0; j < parsers[i].count; j++)
+			lines += !parsers[i].fields[j].tag;
+	}
+
+	if(_tdb_mergeManifest(tdb, parsers, threads, lines))
+		files = lines;
+
+	done:;
+	int eno = errno;
+
+	for (size_t i = 0; parsers && i < threads; i++)
+	{
+		free(parsers[i].names);
+		free(parsers[i].fields);
+	}
+
+	free(parsers);
+	munmap((void*)map, size);
+	errno = eno;
+
+	return files;
 }
 
 #pragma endregion
\ No newline at end of file
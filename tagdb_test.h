@@ -0,0 +1,459 @@
+// unit testing, in C
+#define _GNU_SOURCE 1
+#include "tagdb.h"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+#define FILES 1000
+#define TAGS 20
+
+/* Tag t is on file f if f is divisible by t + 1 */
+static bool tagged(size_t f, size_t t)
+{
+	return !(f % (t + 1));
+}
+
+/* Writes a text tagdb to a temporary file and opens it */
+static tagdb_t *openText()
+{
+	FILE *f = tmpfile();
+
+	if(!f)
+		faile();
+
+	for (size_t t = 0; t < TAGS; t++)
+	{
+		fprintf(f, "tag%zu\n", t);
+
+		for (size_t i = 0; i < FILES; i++)
+			if(tagged(i, t))
+				fprintf(f, "file%zu.jpg\n", i);
+
+		fputc('\n', f);
+	}
+
+	rewind(f);
+	tagdb_t *tdb = tdb_open(f, stderr);
+
+	assertMsg(tdb, "Cannot open text tagdb\n")
+	return tdb;
+}
+
+/* Asserts that the tagdb contains exactly what openText() wrote */
+static void check(tagdb_t *tdb)
+{
+	char name[32];
+	size_t count = 0;
+
+	HMAP_FORALL(tdb->map, UNUSED const char *n, UNUSED tagdb_entry_t *e, {
+		count++;
+	})
+
+	assertMsg(count == FILES + TAGS, "Tagdb has %zu entries instead of %d\n", count, FILES + TAGS)
+
+	for (size_t i = 0; i < FILES; i++)
+	{
+		snprintf(name, sizeof(name), "file%zu.jpg", i);
+		tagdb_entry_t *file = tdb_get(tdb, name);
+
+		assertMsg(file && file->kind == TDB_FILE_ENTRY, "File '%s' is missing\n", name)
+
+		for (size_t t = 0; t < TAGS; t++)
+		{
+			snprintf(name, sizeof(name), "tag%zu", t);
+			tagdb_entry_t *tag = tdb_get(tdb, name);
+
+			assertMsg(tag && tag->kind == TDB_TAG_ENTRY, "Tag '%s' is missing\n", name)
+			assertMsg(tdb_entry_get(tdb, file, tag->tagId) == tagged(i, t), "File %zu has the wrong value for tag '%s'\n", i, name)
+		}
+	}
+}
+
+/* Writes the tagdb in the binary format to a temporary file and destroys it */
+static FILE *toBinary(tagdb_t *tdb)
+{
+	FILE *f = tmpfile();
+
+	if(!f)
+		faile();
+
+	assertMsg(tdb_write(tdb, f), "tdb_write failed: %s\n", strerror(errno))
+	tdb_destroy(tdb);
+	rewind(f);
+
+	return f;
+}
+
+void testText()
+{
+	tagdb_t *tdb = openText();
+
+	check(tdb);
+	tdb_destroy(tdb);
+}
+
+void testBinary()
+{
+	FILE *f = toBinary(openText());
+	tagdb_binhdr_t h;
+	size_t ids = 0;
+
+	for (size_t t = 0; t < TAGS; t++)
+		for (size_t i = 0; i < FILES; i++)
+			ids += tagged(i, t);
+
+	// dense tags are bitmaps, and the others take a byte per file
+	if(fread(&h, sizeof(h), 1, f) != 1)
+		faile();
+
+	assertMsg(h.ids < ids, "File ID lists take %ju bytes for %zu IDs\n", (uintmax_t)h.ids, ids)
+	rewind(f);
+
+	tagdb_t *tdb = tdb_open(f, stderr);
+
+	assertMsg(tdb, "Cannot open binary tagdb\n")
+	check(tdb);
+
+	// new tags still get an ID
+	assertMsg(tdb_ins(tdb, "new tag", TDB_TAG_ENTRY), "Cannot insert tag: %s\n", strerror(errno))
+	assertMsg(tdb_ins(tdb, "new file", TDB_FILE_ENTRY), "Cannot insert file: %s\n", strerror(errno))
+	tdb_destroy(tdb);
+}
+
+void testExport()
+{
+	tagdb_t *tdb = tdb_open(toBinary(openText()), stderr);
+	FILE *f = tmpfile();
+
+	if(!tdb || !f)
+		faile();
+
+	assertMsg(tdb_writeText(tdb, f), "tdb_writeText failed: %s\n", strerror(errno))
+	tdb_destroy(tdb);
+	rewind(f);
+
+	assertMsg((tdb = tdb_open(f, stderr)), "Cannot reopen exported tagdb\n")
+	check(tdb);
+	tdb_destroy(tdb);
+}
+
+void testDamaged()
+{
+	FILE *f = toBinary(openText());
+
+	// flip a bit in the string table
+	fseek(f, -2, SEEK_END);
+	int c = fgetc(f);
+	fseek(f, -2, SEEK_END);
+	fputc(c ^ 1, f);
+	fflush(f);
+	rewind(f);
+
+	fprintf(stderr, "Expecting an error message:\n");
+	assertMsg(!tdb_open(f, stderr), "Damaged tagdb was opened\n")
+}
+
+void testDamagedList()
+{
+	FILE *f = toBinary(openText());
+	tagdb_t *tdb = tdb_open(fdopen(dup(fileno(f)), "r"), NULL);
+
+	if(!tdb)
+		faile();
+
+	// end the varint list of a tag in the middle of an ID, and sum the file up again
+	size_t t = tdb_get(tdb, "tag19")->tagId;
+	long end = (const char*)tdb->lazy->ids + tdb->lazy->idOffs[t + 1] - tdb->lazy->map;
+	size_t size = tdb->lazy->size;
+	char *data = malloc(size);
+
+	tdb_destroy(tdb);
+	rewind(f);
+
+	if(!data || fread(data, 1, size, f) != size)
+		faile();
+
+	tagdb_binhdr_t *h = (tagdb_binhdr_t*)data;
+
+	data[end - 1] |= 0x80;
+	h->checksum = _tdb_sum(_TDB_SUM_INIT, data + sizeof(*h), size - sizeof(*h));
+	rewind(f);
+	fwrite(data, 1, size, f);
+	fflush(f);
+	rewind(f);
+	free(data);
+
+	// lists are only read once they're looked at
+	assertMsg((tdb = tdb_open(f, stderr)), "Tagdb with a damaged list wasn't opened: %s\n", strerror(errno))
+	fprintf(stderr, "Expecting an error message:\n");
+	assertMsg(!tdb_entry_get(tdb, tdb_get(tdb, "file0.jpg"), t), "Damaged list wasn't taken as empty\n")
+	assertMsg(tdb_entry_get(tdb, tdb_get(tdb, "file0.jpg"), tdb_get(tdb, "tag0")->tagId), "Other lists were lost\n")
+	tdb_destroy(tdb);
+}
+
+/* Attaches a journal in a temporary file to the tagdb */
+static void attach(tagdb_t *tdb, FILE *j)
+{
+	assertMsg(tdb_journal(tdb, dup(fileno(j))), "tdb_journal failed: %s\n", strerror(errno))
+}
+
+void testJournal()
+{
+	tagdb_t *tdb = openText();
+	FILE *j = tmpfile();
+
+	if(!j)
+		faile();
+
+	attach(tdb, j);
+
+	tagdb_entry_t *tag = tdb_ins(tdb, "new tag", TDB_TAG_ENTRY);
+	size_t tagId = tag->tagId;
+	tagdb_entry_t *file = tdb_ins(tdb, "new file", TDB_FILE_ENTRY);
+
+	tdb_entry_set(tdb, file, tagId, true);
+	tdb_rename(tdb, tdb_get(tdb, "file0.jpg"), "renamed.jpg");
+	tdb_rm(tdb, "file1.jpg");
+	tdb_rm(tdb, "tag1");
+	assertMsg(tdb_nextId(tdb), "tdb_nextId failed: %s\n", strerror(errno))
+
+	FILE *f = toBinary(tdb);
+
+	// the journal is replayed onto the old tagdb, but not onto the one written afterwards, which has a new ID
+	for (int i = 0; i < 2; i++)
+	{
+		tdb = i ? tdb_open(f, stderr) : openText();
+		attach(tdb, j);
+
+		assertMsg(tdb->id == 1, "Tagdb has ID %ju instead of 1 (%d)\n", (uintmax_t)tdb->id, i)
+
+		file = tdb_get(tdb, "new file");
+		tag = tdb_get(tdb, "new tag");
+
+		assertMsg(file && tag && tdb_entry_get(tdb, file, tag->tagId), "New file isn't tagged (%d)\n", i)
+		assertMsg(!tdb_get(tdb, "file0.jpg") && tdb_get(tdb, "renamed.jpg"), "File wasn't renamed (%d)\n", i)
+		assertMsg(tdb_entry_get(tdb, tdb_get(tdb, "renamed.jpg"), tdb_get(tdb, "tag0")->tagId), "Renamed file lost its tag (%d)\n", i)
+		assertMsg(!tdb_get(tdb, "file1.jpg") && !tdb_get(tdb, "tag1"), "Entries weren't removed (%d)\n", i)
+		tdb_destroy(tdb);
+	}
+
+	fclose(j);
+}
+
+/* Asserts that both tagdbs have the same entries, with the same tags by name */
+static void same(tagdb_t *a, tagdb_t *b)
+{
+	size_t ca = 0, cb = 0;
+
+	TDB_FORALL(a, name, e, {
+		tagdb_entry_t *o = tdb_get(b, name);
+
+		ca++;
+		assertMsg(o && o->kind == e->kind, "Entry '%s' is missing or has the wrong kind\n", name)
+
+		if(e->kind == TDB_FILE_ENTRY)
+		{
+			for (size_t t = 0; t < a->tagCap; t++)
+				if(bitarr_get(a->tagIds, t))
+					assertMsg(tdb_entry_get(a, e, t) == tdb_entry_get(b, o, tdb_get(b, a->tagNames[t])->tagId), "File '%s' has the wrong value for tag '%s'\n", name, a->tagNames[t])
+		}
+	})
+
+	TDB_FORALL(b, UNUSED name, UNUSED e, {
+		cb++;
+	})
+
+	assertMsg(ca == cb, "Tagdbs have %zu and %zu entries\n", ca, cb)
+}
+
+/* Creates an empty tagdb to parse a text tagdb into, with the stream as its file */
+static tagdb_t *empty(FILE *f)
+{
+	tagdb_t *tdb = tdb_open(tmpfile(), stderr);
+
+	if(!tdb)
+		faile();
+
+	fclose(tdb->file);
+	tdb->file = f;
+	rewind(f);
+
+	return tdb;
+}
+
+void testParse()
+{
+	FILE *f = tmpfile();
+
+	if(!f)
+		faile();
+
+	// escaped newlines and backslashes, backslashes kept before other characters, empty tag names and merged tags
+	fputs("\n\n", f);
+
+	for (size_t t = 0; t < TAGS; t++)
+	{
+		fprintf(f, "tag\\\n%zu\n", (t == TAGS - 1) ? 1 : t);
+
+		for (size_t i = 0; i < FILES; i++)
+			if(tagged(i, t))
+				fprintf(f, (t == TAGS - 1) ? "extra%zu\n" : (i % 3) ? "file%zu\\\\\n" : "fi\\le\\\n%zu\n", i);
+
+		fputs((t % 4) ? "\n" : "\n\n\n", f);
+	}
+
+	fputs("last\nunterminated\\", f);
+	fflush(f);
+
+	tagdb_t *expected = empty(f);
+
+	assertMsg(_tdb_readText(expected, f), "_tdb_readText failed\n")
+	assertMsg(tdb_get(expected, "tag\n1") && tdb_get(expected, "fi\\le\n3") && tdb_get(expected, "file1\\") && tdb_get(expected, "extra20") && tdb_get(expected, "unterminated\\"),
+		"Escapes weren't read as expected\n")
+
+	// shares of the file start wherever, and are moved to the next tag
+	for (size_t threads = 1; threads <= 16; threads++)
+	{
+		tagdb_t *tdb = empty(fdopen(dup(fileno(f)), "r"));
+
+		assertMsg(_tdb_parseText(tdb, tdb->file, threads) == 1, "_tdb_parseText failed on %zu threads: %s\n", threads, strerror(errno))
+		same(expected, tdb);
+		same(tdb, expected);
+		tdb_destroy(tdb);
+	}
+
+	tdb_destroy(expected);
+}
+
+void testImport()
+{
+	FILE *f = tmpfile();
+
+	if(!f)
+		faile();
+
+	// quotes, CRLF line ends, empty fields and lines, and files listed on several lines
+	fputs("\n,skipped\n\"a, \"\"quoted\"\"\",tag0,,\"tag,1\"\r\nplain,tag0\n", f);
+
+	for (size_t i = 0; i < FILES; i++)
+		fprintf(f, (i % 2) ? "file%zu.jpg,tag%zu\n" : "file%zu.jpg,tag%zu,\n", i, i % TAGS);
+
+	for (size_t i = 0; i < FILES; i += 7)
+		fprintf(f, "file%zu.jpg,tag%zu\n", i, (i + 1) % TAGS);
+
+	fputs("untagged", f);
+	fflush(f);
+
+	for (size_t threads = 1; threads <= 8; threads++)
+	{
+		tagdb_t *tdb = empty(tmpfile());
+		ssize_t lines = tdb_import(tdb, f, ',', threads);
+
+		assertMsg(lines == 3 + FILES + (FILES + 6) / 7, "tdb_import returned %zd on %zu threads: %s\n", lines, threads, strerror(errno))
+
+		tagdb_entry_t *q = tdb_get(tdb, "a, \"quoted\""), *t0 = tdb_get(tdb, "tag0"), *t1 = tdb_get(tdb, "tag,1");
+
+		assertMsg(q && t0 && t1 && tdb_entry_get(tdb, q, t0->tagId) && tdb_entry_get(tdb, q, t1->tagId), "Quoted fields weren't read as expected\n")
+		assertMsg(tdb_get(tdb, "plain") && tdb_get(tdb, "untagged") && !tdb_get(tdb, "skipped") && !tdb_get(tdb, ""), "Lines weren't read as expected\n")
+
+		for (size_t i = 0; i < FILES; i++)
+		{
+			char name[32];
+
+			snprintf(name, sizeof(name), "file%zu.jpg", i);
+			tagdb_entry_t *file = tdb_get(tdb, name);
+
+			assertMsg(file && file->kind == TDB_FILE_ENTRY, "File '%s' is missing\n", name)
+
+			for (size_t t = 0; t < TAGS; t++)
+			{
+				snprintf(name, sizeof(name), "tag%zu", t);
+				bool expected = t == i % TAGS || (!(i % 7) && t == (i + 1) % TAGS);
+
+				assertMsg(tdb_entry_get(tdb, file, tdb_get(tdb, name)->tagId) == expected, "File %zu has the wrong value for tag '%s'\n", i, name)
+			}
+		}
+
+		tdb_destroy(tdb);
+	}
+
+	// names can't be both
+	fputs("\ntag3,file1.jpg\n", f);
+	fflush(f);
+
+	tagdb_t *tdb = empty(tmpfile());
+
+	fprintf(stderr, "Expecting an error message:\n");
+	assertMsg(tdb_import(tdb, f, ',', 1) == -1 && errno == EINVAL, "Tag named like a file was imported\n")
+	tdb_destroy(tdb);
+	fclose(f);
+
+	// more threads than bytes
+	if(!(f = tmpfile()))
+		faile();
+
+	fputs("a\n", f);
+	fflush(f);
+	tdb = empty(tmpfile());
+	assertMsg(tdb_import(tdb, f, ',', 8) == 1 && tdb_get(tdb, "a"), "Tiny manifest wasn't imported on 8 threads: %s\n", strerror(errno))
+	tdb_destroy(tdb);
+	fclose(f);
+}
+
+void testLazy()
+{
+	tagdb_t *tdb = tdb_open(toBinary(openText()), stderr);
+
+	if(!tdb)
+		faile();
+
+	// a lookup only decodes the list of its tag, and the lists are only turned around once the tags of a file are listed
+	tagdb_lazy_t *l = tdb->lazy;
+	size_t sparse = tdb_get(tdb, "tag19")->tagId;
+
+	for (size_t t = 0; t < l->tags; t++)
+		assertMsg(!l->tagFiles[t], "Tag %zu was decoded on load\n", t)
+
+	assertMsg(tdb_entry_get(tdb, tdb_get(tdb, "file40.jpg"), sparse) && !tdb_entry_get(tdb, tdb_get(tdb, "file41.jpg"), sparse),
+		"Files have the wrong value for 'tag19'\n")
+	assertMsg(l->tagFiles[sparse] && !l->fileOffs, "Tag lookup didn't decode only its list\n")
+
+	for (size_t t = 0; t < l->tags; t++)
+		assertMsg(t == sparse || !l->tagFiles[t], "Tag %zu was decoded by a lookup of another\n", t)
+
+	// a new tag reusing the ID of a removed one isn't on the files of the removed tag, whether their tags are set up or not
+	tagdb_entry_t *file = tdb_get(tdb, "file2.jpg");
+	bitarr_t tags = tdb_tags(tdb, file);
+	size_t id = tdb_get(tdb, "tag1")->tagId;
+
+	assertMsg(tags && bitarr_get(tags, id), "File has the wrong tags\n")
+	tdb_rm(tdb, "tag1");
+
+	tagdb_entry_t *tag = tdb_ins(tdb, "new tag", TDB_TAG_ENTRY);
+
+	assertMsg(tag && tag->tagId == id, "New tag doesn't reuse the ID\n")
+	assertMsg(!tdb_entry_get(tdb, file, tag->tagId) && !tdb_entry_get(tdb, tdb_get(tdb, "file4.jpg"), tag->tagId), "Files have the new tag\n")
+	assertMsg(!bitarr_get(tdb_tags(tdb, tdb_get(tdb, "file6.jpg")), tag->tagId), "Set up tags have the new tag\n")
+
+	// files without their tags set up are written from the lists they were loaded from
+	tdb_entry_set(tdb, tdb_get(tdb, "file3.jpg"), tag->tagId, true);
+
+	FILE *f = tmpfile();
+
+	if(!f)
+		faile();
+
+	assertMsg(tdb_write(tdb, f), "tdb_write failed: %s\n", strerror(errno))
+	rewind(f);
+
+	tagdb_t *copy = tdb_open(f, stderr);
+
+	assertMsg(copy, "Cannot reopen tagdb\n")
+	same(tdb, copy);
+	same(copy, tdb);
+	tdb_destroy(copy);
+	tdb_destroy(tdb);
+}
+
+const test_t tests[] = { testText, testBinary, testExport, testDamaged, testDamagedList, testJournal, testParse, testImport, testLazy };
@@ -1,10 +1,12 @@
 /* tagfs.c: handled initializing and interfacing with fuse. The actual functions are declared in tagfs.h */
 #include "config.h"
 #include "tagfs.h"
+#include "realdir.h"
 #include <unistd.h>
 #include <limits.h>
-#include <libexplain/opendir.h>
-#include <libexplain/dirfd.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <libexplain/open.h>
 #include <libexplain/malloc.h>
 #include <libexplain/openat.h>
 #include <libexplain/fopen.h>
@@ -17,117 +19,138 @@
 const char *usage =
 	"Proper usage:\n"
 	"	tagfs [-l|--log <log file>] <mount point> [FUSE arguments...]\n"
-	"	tagfs [-q|--quiet] <mount point> [FUSE arguments...]\n";
+	"	tagfs [-q|--quiet] <mount point> [FUSE arguments...]\n"
+	"Options:\n"
+	"	-t|--attr-ttl <seconds>	How long attributes of real files are cached. Defaults to 1, 0 disables the cache.\n"
+	"	-e|--entry-ttl <seconds>	How long the kernel caches entries and attributes.\n"
+	"		Defaults to 3600 if the real directory can be watched and 1 otherwise.\n"
+	"Mount options:\n"
+	"	-o workers=<n>	Maximum number of worker threads. Defaults to twice the number of CPUs.\n"
+	"	-o no_clone_fd	Makes all workers share a single /dev/fuse file descriptor.\n"
+	"	-o fd_cache=<n>	How many real files stay open after they're closed, for reopening them quickly. Defaults to 128.\n"
+	"		Only used if the real directory can be watched.\n"
+	"	-o no_passthrough	Reads and writes real files through tagfs even if the kernel could access them directly.\n"
+	"	-o no_writeback_cache	Disables caching of writes in the kernel. Use this if the real directory is written to directly.\n"
+	"		Writes aren't cached when passing through.\n"
+	"	-o no_splice_read|no_splice_write	Copies written or read data through memory instead of splicing it.\n"
+	"	-o max_write=<bytes>	Maximum size of write requests. Defaults to 1MiB.\n"
+	"	-o max_read=<bytes>	Maximum size of read requests. Unlimited by default.\n"
+	"	-o control=<path>	Creates a Unix socket at path, on which many files can be queried and tagged at once, see tagfs_ctlkind_t.\n";
+
+/* Mount options handled by tagfs itself */
+struct tagfs_opts
+{
+	/* Maximum number of worker threads */
+	unsigned workers;
+	/* Whether every worker reads from its own /dev/fuse file descriptor */
+	int cloneFd;
+	/* Whether the kernel may access real files directly */
+	int passthrough;
+	/* How many unused real file descriptors stay open */
+	unsigned fdCache;
+	/* The path of the control socket, or NULL */
+	char *control;
+};
 
-static struct fuse_operations op =
+static const struct fuse_opt tagfs_optspec[] =
+{
+	{ "workers=%u", offsetof(struct tagfs_opts, workers), 0 },
+	{ "clone_fd", offsetof(struct tagfs_opts, cloneFd), 1 },
+	{ "no_clone_fd", offsetof(struct tagfs_opts, cloneFd), 0 },
+	{ "passthrough", offsetof(struct tagfs_opts, passthrough), 1 },
+	{ "no_passthrough", offsetof(struct tagfs_opts, passthrough), 0 },
+	{ "fd_cache=%u", offsetof(struct tagfs_opts, fdCache), 0 },
+	{ "control=%s", offsetof(struct tagfs_opts, control), 0 },
+	FUSE_OPT_END
+};
+
+static struct fuse_lowlevel_ops op =
 {
-	.readdir = tagfs_readdir,
 	.init = tagfs_init,
+	.destroy = tagfs_destroy,
+	.lookup = tagfs_lookup,
+	.forget = tagfs_forget,
+	.opendir = tagfs_opendir,
+	.readdir = tagfs_readdir,
+	.releasedir = tagfs_releasedir,
 	.getattr = tagfs_getattr,
+	.setattr = tagfs_setattr,
 	.mknod = tagfs_mknod,
-	.destroy = tagfs_destroy,
 	.mkdir = tagfs_mkdir,
-	.utimens = tagfs_utimens,
 	.open = tagfs_open,
 	.read = tagfs_read,
-	.write = tagfs_write,
-	.truncate = tagfs_truncate,
+	.write_buf = tagfs_write_buf,
 	.unlink = tagfs_unlink,
 	.rmdir = tagfs_rmdir,
 	.rename = tagfs_rename,
 	.release = tagfs_release,
 	.fsync = tagfs_fsync,
+	.copy_file_range = tagfs_copy_file_range,
+	.fallocate = tagfs_fallocate,
+	.lseek = tagfs_lseek,
 	.getxattr = tagfs_getxattr,
 	.setxattr = tagfs_setxattr,
 	.listxattr = tagfs_listxattr,
 };
 
-/* Makes sure the loaded tagdb is valid and obeys all asserts.
-	Returns 0 if the tdb is clean, 1 on recoverable error and -1 on irrecoverable error. */
-int tagfs_chk(tagfs_context_t *context)
-{
-	int err = 0;
-	#define IERR(...) { fprintf(stderr, "Tagdb invalid; " __VA_ARGS__); err = -1; continue; }
-
-	TDB_FORALL(context->tdb, name, entry,{
-		if(name[0] == TAGFS_NEG_CHAR)
-			IERR("Entry name '%s' may not start with '%c' as it is reserved for negating tags\n", name, TAGFS_NEG_CHAR)
-		if(name[0] == '.' && tdb_get(context->tdb, name + 1))
-			IERR("Entry name '%s' conflicts with entry '%s'\n", name, name)
-		if(strchr(name, '/'))
-			IERR("Entry name '%s' may not contain '/'\n", name)
-		if(entry->kind == TDB_TAG_ENTRY && !faccessat(context->dirfd, name, F_OK, AT_SYMLINK_NOFOLLOW))
-			IERR("Tag '%s' conflicts with existing file\n", name)
-	})
-
-	struct dirent *ent;
-
-	// iterate over existing real files
-	while((ent = readdir(context->dir)))
-	{
-		if(specialDir(ent->d_name) || tdbFile(ent->d_name))
-			continue;
-		if(ent->d_name[0] == TAGFS_NEG_CHAR)
-			IERR("Real file '%s' may not start with '%c' as it is reserved for negating tags\n", ent->d_name, TAGFS_NEG_CHAR)
-		if(ent->d_name[0] == '.' && tdb_get(context->tdb, ent->d_name + 1))
-			IERR("Real file '%s' conflicts with tag '%s'\n", ent->d_name, ent->d_name + 1);
-		if(ent->d_type == DT_DIR)
-			IERR("Real file '%s' may not be a directory", ent->d_name);
-	}
-
-	if(err)
-		return err;
-
-	// seek and remove nonexistant files
-	rerun:
-	TDB_FORALL(context->tdb, name, entry,{
-		if(entry->kind == TDB_FILE_ENTRY && faccessat(context->dirfd, name, F_OK, AT_SYMLINK_NOFOLLOW))
-		{
-			fprintf(stderr, "No file for entry '%s': %s\nRemoving bad entry from TDB\n", name, strerror(errno));
-			tdb_rmE(context->tdb, entry);
-			err = 1;
-			// the indices used by TDB_FORALL are no longer valid after hashmap update
-			goto rerun;
-		}
-	})
-
-
-	rewinddir(context->dir);
-
-	return err;
-	#undef IERR
-}
-
 #define printdie(...) printf(__VA_ARGS__), exit(EXIT_FAILURE)
 
 int main(int argc, char **argv)
 {
 	tagfs_context_t *context = explain_malloc_or_die(sizeof(tagfs_context_t));
 
+	context->log = NULL;
+	context->attrTTL = 1000000000LL;
+	context->timeout = -1;
+
 	// parse arguments
 	{
 		#define push() argc--,argv++
 		push();
 
-		if(argc && (!strcmp("-l", *argv) || !strcmp("--log", *argv)))
+		while(argc && **argv == '-')
 		{
-			if(argc < 2)
-				printdie("Invalid usage; missing logfile after %s\n%s", *argv, usage);
+			if(!strcmp("-l", *argv) || !strcmp("--log", *argv))
+			{
+				if(argc < 2)
+					printdie("Invalid usage; missing logfile after %s\n%s", *argv, usage);
+
+				push();
+				if(strcmp(*argv, "-"))
+					context->log = explain_fopen_or_die(*argv, "a");
+				else
+					context->log = stderr;
+				push();
+			}
+			else if(!strcmp("-q", *argv) || !strcmp("--quiet", *argv))
+				push();
+			else if(!strcmp("-t", *argv) || !strcmp("--attr-ttl", *argv) || !strcmp("-e", *argv) || !strcmp("--entry-ttl", *argv))
+			{
+				char *end;
+				bool attr = !strcmp("-t", *argv) || !strcmp("--attr-ttl", *argv);
+
+				if(argc < 2)
+					printdie("Invalid usage; missing seconds after %s\n%s", *argv, usage);
+
+				push();
+				double ttl = strtod(*argv, &end);
+
+				if(*end || ttl < 0)
+					printdie("Invalid %s timeout '%s'\n%s", attr ? "attribute cache" : "entry cache", *argv, usage);
+
+				if(attr)
+					context->attrTTL = ttl * 1e9;
+				else
+					context->timeout = ttl;
 
-			push();
-			if(strcmp(*argv, "-"))
-				context->log = explain_fopen_or_die(*argv, "a");
+				push();
+			}
 			else
-				context->log = stderr;
-			push();
+				printdie("Invalid usage; unknown option %s\n%s", *argv, usage);
 		}
-		else
-		{
-			if(argc && (!strcmp("-q", *argv) || !strcmp("--quiet", *argv)))
-				push();
 
+		if(!context->log)
 			context->log = explain_fopen_or_die("/dev/null", "w");
-		}
 
 		if(!argc)
 			printdie("Invalid usage; missing mount point\n%s", usage);
@@ -137,27 +160,90 @@ int main(int argc, char **argv)
 
 	// init lock
 	explain_pthread_rwlock_init_or_die(&context->lock, NULL);
+	pthread_mutex_init(&context->attrLock, NULL);
+	pthread_mutex_init(&context->nodeLock, NULL);
+	context->attrHits = context->attrMisses = 0;
+	context->watchfd = -1;
+	// the root is never forgotten
+	context->root = (tagfs_node_t){ .kind = TDB_TAG_ENTRY, .nlookup = 1 };
+	context->nodes = NULL;
+	context->nodeCap = context->nodeCount = 0;
+	context->se = NULL;
+	context->invalHead = NULL;
+	context->invalTail = &context->invalHead;
+	context->notifying = false;
+	context->fdHead = context->fdTail = NULL;
+	context->fdIdle = 0;
+	context->fdHits = context->fdMisses = 0;
+	pthread_mutex_init(&context->fdLock, NULL);
+	context->rsvs = NULL;
+	pthread_mutex_init(&context->rsvLock, NULL);
+	pthread_cond_init(&context->rsvCond, NULL);
+	context->ctlfd = -1;
+	context->ctlPath = NULL;
+	context->ctlOpen = false;
+	context->conns = NULL;
+	pthread_mutex_init(&context->ctlLock, NULL);
+	pthread_cond_init(&context->ctlCond, NULL);
+	pthread_mutex_init(&context->invalLock, NULL);
+	pthread_cond_init(&context->invalCond, NULL);
+	context->checkpointing = context->checkpointNow = false;
+	context->pending = NULL;
+	pthread_mutex_init(&context->checkpointLock, NULL);
+	pthread_cond_init(&context->checkpointCond, NULL);
 
 	// open the base directory
-	context->dir = explain_opendir_or_die(*argv);
-	context->dirfd = explain_dirfd_or_die(context->dir);
+	context->dirfd = explain_open_or_die(*argv, O_RDONLY | O_DIRECTORY, 0);
 	explain_fstat_or_die(context->dirfd, &context->realStat);
 
+	// real files may be spread over subdirectories
+	if((context->levels = layout_read(context->dirfd)) < 0)
+		printdie("Cannot read '%s' in '%s': %s\n", LAYOUT_FILE, *argv, strerror(errno));
+	if(!layout_mkdirs(context->dirfd, context->levels))
+		printdie("Cannot create the subdirectories of '%s': %s\n", *argv, strerror(errno));
+
 	context->tdb = tdb_open(
 		explain_fdopen_or_die(
 			explain_openat_or_die(context->dirfd, ".tagdb",
 				O_RDWR | O_CREAT,
 				S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH),
-			"r+"));
+			"r+"),
+		stderr);
 
 	if(!context->tdb)
 		goto fail;
 
-	// final check of the tagdb and real directory
-	int chk = tagfs_chk(context);
+	// changes since the tagdb file was last written are in the journal, or in two if a checkpoint was interrupted
+	int oldfd = openat(context->dirfd, ".tagdb.journal.old", O_RDONLY | O_CLOEXEC);
+
+	if(oldfd < 0 && errno != ENOENT)
+		printdie("Cannot open the old journal of the tagdb: %s\n", strerror(errno));
+	if(oldfd >= 0 && !tdb_replay(context->tdb, oldfd))
+		printdie("Cannot replay the old journal of the tagdb: %s\n", strerror(errno));
+	if(!tdb_journal(context->tdb, explain_openat_or_die(context->dirfd, ".tagdb.journal", O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)))
+		printdie("Cannot replay the journal of the tagdb: %s\n", strerror(errno));
+
+	// the watch has to exist before the check lists the real directory, so no change goes unnoticed
+	if(!tagfs_watch_init(context, *argv))
+		fprintf(stderr, "Cannot watch '%s' for changes, listings will read it directly: %s\n", *argv, strerror(errno));
+
+	// final check of the tagdb and real directory. While watching, the same listing adds the entries of untracked files.
+	realdir_fix_t fix;
+	int chk = realdir_chk(context->tdb, context->dirfd, context->levels, stderr, context->watchfd >= 0, &fix);
 
 	if(chk == -1)
 		goto fail;
+	// the backup of the tagdb file has to contain the journals, and the next checkpoint would overwrite the old journal.
+	// Anything else is left to the checkpointer.
+	if((chk == 1 || oldfd >= 0) && !tagfs_compact(context))
+		printdie("Cannot write the tagdb: %s\n", strerror(errno));
+
+	context->listed = realdir_fix(context->tdb, &fix, stderr) >= 0 && context->watchfd >= 0;
+
+	// changes to the real directory are only noticed while watching it
+	if(context->timeout < 0)
+		context->timeout = context->listed ? 3600 : 1;
 	if(chk == 1)
 	{
 		char bakfile[400];
@@ -194,18 +280,86 @@ int main(int argc, char **argv)
 
 	fprintf(stderr, "Mounting at '%s'\n", *argv);
 
-	char **fuseopts = explain_malloc_or_die((argc + 4) * sizeof(char*));
+	char **fuseopts = explain_malloc_or_die((argc + 2) * sizeof(char*));
 
 	fuseopts[0] = "tagfs";
 	fuseopts[1] = *argv;
-	fuseopts[2] = "-o";
-	fuseopts[3] = "nonempty";
-	fuseopts[argc+3] = NULL;
+	fuseopts[argc+1] = NULL;
 
 	for (int i = 1; i < argc; i++)
-		fuseopts[i + 3] = argv[i];
+		fuseopts[i + 1] = argv[i];
+
+	struct fuse_args args = FUSE_ARGS_INIT(argc + 1, fuseopts);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se = NULL;
+	struct tagfs_opts topts = { .cloneFd = 1, .passthrough = 1, .fdCache = TAGFS_FD_CACHE };
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// requests mostly wait on the disk, so there should be more workers than CPUs
+	topts.workers = (cpus > 2) ? cpus * 2 : 4;
+
+	if(fuse_opt_parse(&args, &topts, tagfs_optspec, NULL) == -1 || fuse_parse_cmdline(&args, &opts))
+		goto fail;
+	if(opts.show_help)
+	{
+		printf("%s", usage);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		return 0;
+	}
+	if(!(context->connOpts = fuse_parse_conn_info_opts(&args)))
+		goto fail;
+
+	context->passthrough = topts.passthrough;
+	// a cached fd would keep referring to a file replaced behind tagfs' back
+	context->fdCap = context->listed ? topts.fdCache : 0;
+
+	if(topts.control && !tagfs_ctl_open(context, topts.control))
+		printdie("Cannot create the control socket '%s': %s\n", topts.control, strerror(errno));
 
-	fuse_main(argc + 3, fuseopts, &op, context);
+	free(topts.control);
+
+	if((se = context->se = fuse_session_new(&args, &op, sizeof(op), context)))
+	{
+		if(fuse_set_signal_handlers(se) != -1)
+		{
+			if(fuse_session_mount(se, opts.mountpoint) != -1)
+			{
+				if(fuse_daemonize(opts.foreground) != -1)
+				{
+					if(opts.singlethread)
+						fuse_session_loop(se);
+					else
+					{
+						struct fuse_loop_config *cfg = fuse_loop_cfg_create();
+
+						if(!cfg)
+						{ // one thread still serves every request
+							lprintf("Cannot configure the worker threads, serving on one thread: %s\n", strerror(errno));
+							fuse_session_loop(se);
+						}
+						else
+						{
+							fuse_loop_cfg_set_clone_fd(cfg, topts.cloneFd);
+							fuse_loop_cfg_set_max_threads(cfg, topts.workers);
+							fuse_loop_cfg_set_idle_threads(cfg, opts.max_idle_threads);
+							fuse_session_loop_mt(se, cfg);
+							fuse_loop_cfg_destroy(cfg);
+						}
+					}
+				}
+
+				fuse_session_unmount(se);
+			}
+
+			fuse_remove_signal_handlers(se);
+		}
+
+		fuse_session_destroy(se);
+	}
+
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
 
 	fail:
 	if(context)
@@ -213,8 +367,19 @@ int main(int argc, char **argv)
 		if(context->tdb)
 			tdb_destroy(context->tdb);
 
-		if(context->dir)
-			closedir(context->dir);
+		if(context->dirfd >= 0)
+			close(context->dirfd);
+
+		if(context->watchfd >= 0)
+			close(context->watchfd);
+
+		// the session never started
+		if(context->ctlfd >= 0)
+		{
+			close(context->ctlfd);
+			unlink(context->ctlPath);
+			free(context->ctlPath);
+		}
 
 		if(context->log)
 			fclose(context->log);
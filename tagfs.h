@@ -4,41 +4,73 @@
 #define _DEFAULT_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #define _GNU_SOURCE 1
-// /usr/include/fuse/fuse_common.h:33:2: error: #error Please add -D_FILE_OFFSET_BITS=64 to your compile flags!
+// /usr/include/fuse3/fuse_common.h: error: #error Please add -D_FILE_OFFSET_BITS=64 to your compile flags!
 #define _FILE_OFFSET_BITS 64
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 312
 
 #ifndef DEBUG
 	#define NDEBUG
 #endif
 
 #include "tagdb.h"
+#include "batchstat.h"
+#include "layout.h"
 #include <sys/types.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
-#include <fuse/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
 #include <dirent.h>
 #include <time.h>
 #include <assert.h>
 #include <sys/xattr.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+
+// Passthrough of file data needs libfuse 3.16
+#ifndef FUSE_CAP_PASSTHROUGH
+	#define FUSE_CAP_PASSTHROUGH 0
+	#define fuse_passthrough_close(req, backingId) ((void)(req))
+#endif
 
 #pragma region Macros
 
-// Mark context as const so its cached when the CONTEXT macro is used a lot.
-extern struct fuse_context *fuse_get_context() __attribute__ ((const));
-
-#define CONTEXT ((tagfs_context_t*)fuse_get_context()->private_data)
-#define TDB (CONTEXT->tdb)
-#define TAGFS_NEG_CHAR '-'
-#define lprintf(...) fprintf(CONTEXT->log, __VA_ARGS__)
-#define lflush() fflush(CONTEXT->log)
-#define LOCK (&(CONTEXT->lock))
+/* The following macros require a tagfs_context_t *context in scope */
+#define TDB (context->tdb)
+#define lprintf(...) fprintf(context->log, __VA_ARGS__)
+#define lflush() fflush(context->log)
+#define LOCK (&(context->lock))
 #define lock_r() pthread_rwlock_rdlock(LOCK)
 #define lock_w() pthread_rwlock_wrlock(LOCK)
 #define unlock() pthread_rwlock_unlock(LOCK)
+// The path of the real file with the given name, relative to the real directory. Valid until the end of the enclosing block.
+#define REAL(name) layout_path(context->levels, name, (char[LAYOUT_PATH_MAX]){ 0 })
+
+#define TAGFS_NEG_CHAR TDB_NEG_CHAR
+// Listings with less uncached files than this don't use batched stat calls
+#define TAGFS_BATCH_MIN 32
+// How many files readdir retrieves attributes for at once
+#define TAGFS_READDIR_WINDOW 256
+// Default number of unused real file descriptors kept open
+#define TAGFS_FD_CACHE 128
+// Default size of write requests, in bytes. The kernel may still send smaller ones.
+#define TAGFS_MAX_WRITE (1 << 20)
+// Size of the journal, in bytes, from which on a checkpoint is written right away
+#define TAGFS_JOURNAL_MAX (16 << 20)
+// Seconds between checkpoints of a changed tagdb
+#define TAGFS_CHECKPOINT_INTERVAL 300
+// Milliseconds the watcher waits for the MOVED_TO event of a MOVED_FROM at the end of a read
+#define TAGFS_MOVE_WAIT 10
+// Most bytes of a request on the control socket, see tagfs_ctlkind_t
+#define TAGFS_CTL_MAX (64 << 20)
+// Most requests of a connection to the control socket run under one lock
+#define TAGFS_CTL_BATCH 4096
 
 #ifdef DEBUG
 #define dbprintf(...) (lprintf(__VA_ARGS__), lflush())
@@ -50,20 +82,210 @@ extern struct fuse_context *fuse_get_context() __attribute__ ((const));
 
 #pragma region Types
 
+/* An inode handed out to the kernel. The inode number of a node is its address, except for the root. */
+typedef struct tagfs_node
+{
+	/* TDB_TAG_ENTRY for query directories, TDB_FILE_ENTRY for real files */
+	tagdb_entrykind_t kind;
+	/* The number of lookups the kernel hasn't forgotten yet */
+	uint64_t nlookup;
+	/* Hash of the query or filename */
+	uint64_t key;
+	/* Set while the node can be found by its query or filename */
+	bool indexed;
+
+	union
+	{
+		/* Only valid for query directories. The tags that have to be present/absent, both of length cap. */
+		struct
+		{
+			bitarr_t pos, neg;
+			size_t cap;
+		};
+		/* Only valid for real files */
+		struct
+		{
+			/* The name of the real file. Only changed with a write lock on the tagdb. */
+			char *name;
+			/* Cached fds of the real file. Guarded by fdLock. */
+			struct tagfs_fd *fds;
+		};
+	};
+
+	/* The next node in the same bucket of the node index */
+	struct tagfs_node *next;
+} tagfs_node_t;
+
+/* A pending invalidation of a directory entry or of the attributes of an inode */
+typedef struct tagfs_inval
+{
+	/* The directory containing the entry, or the inode */
+	fuse_ino_t ino;
+	struct tagfs_inval *next;
+	/* The name of the entry, or empty for an inode */
+	char name[];
+} tagfs_inval_t;
+
+/* Real filenames reserved by a change in progress, so changes to the same files don't interleave */
+typedef struct tagfs_rsv
+{
+	/* The reserved names. The second one may be NULL. */
+	const char *names[2];
+	/* Any number of further reserved names, see tagfs_reserveAll */
+	const char **more;
+	size_t moreCount;
+	struct tagfs_rsv *next;
+} tagfs_rsv_t;
+
+/* A file descriptor of a real file, shared by all opens of the file with the same flags */
+typedef struct tagfs_fd
+{
+	int fd;
+	/* The flags fd was opened with, minus the ones only used by open */
+	int flags;
+	/* The number of open files using fd. Guarded by fdLock. */
+	unsigned refs;
+	/* The node fd is cached in, or NULL if fd is closed once it's unused */
+	tagfs_node_t *node;
+	/* The next fd cached in the same node */
+	struct tagfs_fd *next;
+	/* Neighbours in the list of unused cached fds, most recently used first */
+	struct tagfs_fd *lruPrev, *lruNext;
+} tagfs_fd_t;
+
+/* An open real file, referenced by the fh of its fuse_file_info */
+typedef struct
+{
+	/* The real file, copied from shared */
+	int fd;
+	/* The backing ID under which the kernel accesses fd directly, or 0 */
+	int backingId;
+	tagfs_fd_t *shared;
+} tagfs_file_t;
+
+#define TAGFS_FILE(fi) ((tagfs_file_t*)(uintptr_t)(fi)->fh)
+
+/* The kinds of requests on the control socket.
+	A request is made of its length as uint32_t, not counting the length itself, the kind as a byte and NUL terminated names.
+	Its reply is made of its length as uint32_t, the errno of the request as int32_t, 0 on success, and NUL terminated names.
+	Numbers are in host byte order. Requests may be sent before the replies of earlier ones arrive, and are answered in order.
+	The requests that arrived together run under one lock on the tagdb, and their changes are made durable together. */
+typedef enum
+{
+	// Names a query path like "tag0/-tag1". Replies with the files in the query directory.
+	TAGFS_CTL_QUERY = 1,
+	// Names a query path followed by files. Adds the tags of the path to every file, and removes those negated in it.
+	// If the path or a file can't be found, or a file name is empty, contains '/' or starts with '-', no file is changed,
+	// and the reply names what failed.
+	TAGFS_CTL_TAG,
+	// Creates every named tag that doesn't exist yet. If a name can't be used for a tag, no tag is created, and the reply names it.
+	TAGFS_CTL_MKTAG,
+} tagfs_ctlkind_t;
+
+/* A connection to the control socket, served by its own thread */
+typedef struct tagfs_conn
+{
+	int fd;
+	struct tagfs_conn *next;
+	struct tagfs_context *context;
+} tagfs_conn_t;
+
+/* Replies on the control socket that weren't sent yet */
 typedef struct
+{
+	char *data;
+	size_t len, cap;
+} tagfs_ctlbuf_t;
+
+typedef struct tagfs_context
 {
 	/* The tag database */
 	tagdb_t *tdb;
 	/* The real directory file descriptor */
 	int dirfd;
-	/* The real directory stream */
-	DIR *dir;
+	/* The number of subdirectory levels real files are spread over, see layout.h */
+	int levels;
 	/* The log file */
 	FILE *log;
 	/* The stat of the underlying real directory */
 	struct stat realStat;
 	/* The tagdb lock. */
 	pthread_rwlock_t lock;
+	/* The inotify instance watching the real directory, or -1 */
+	int watchfd;
+	/* The thread reading watchfd */
+	pthread_t watcher;
+	/* Set if the tagdb contains a file entry for every real file, i.e. the real directory doesn't need to be read */
+	bool listed;
+	/* How long cached attributes of real files stay valid, in nanoseconds. 0 disables the attribute cache. */
+	int64_t attrTTL;
+	/* Guards the fileAttr of every file entry, since they're written with only a read lock on the tagdb. */
+	pthread_mutex_t attrLock;
+	/* Attribute cache statistics */
+	unsigned long attrHits, attrMisses;
+	/* The root directory, i.e. the empty query */
+	tagfs_node_t root;
+	/* Finds nodes by their key. Guarded by nodeLock. */
+	tagfs_node_t **nodes;
+	size_t nodeCap, nodeCount;
+	/* Guards the node index and the lookup counts */
+	pthread_mutex_t nodeLock;
+	/* How long the kernel may cache entries and attributes, in seconds */
+	double timeout;
+	/* The fuse session, used for sending invalidations */
+	struct fuse_session *se;
+	/* Invalidations not sent yet. Guarded by invalLock. */
+	tagfs_inval_t *invalHead, **invalTail;
+	pthread_mutex_t invalLock;
+	pthread_cond_t invalCond;
+	/* Set while the notifier thread sends invalidations */
+	bool notifying;
+	/* The thread sending invalidations */
+	pthread_t notifier;
+	/* Reservations of changes in progress. Guarded by rsvLock. */
+	tagfs_rsv_t *rsvs;
+	pthread_mutex_t rsvLock;
+	/* Signalled whenever a reservation ends */
+	pthread_cond_t rsvCond;
+	/* The connection options given as mount options, applied in init */
+	struct fuse_conn_info_opts *connOpts;
+	/* Set if the kernel caches writes. Only written by init. */
+	bool writeback;
+	/* Unused cached fds, most recently used first. Guarded by fdLock. */
+	tagfs_fd_t *fdHead, *fdTail;
+	size_t fdIdle;
+	/* How many unused fds stay open. 0 disables the fd cache. */
+	size_t fdCap;
+	/* Guards fd caching. Taken after nodeLock. */
+	pthread_mutex_t fdLock;
+	/* fd cache statistics */
+	unsigned long fdHits, fdMisses;
+	/* Set if the kernel reads and writes real files by itself.
+		Cleared by init if the kernel doesn't support it and by open if registering a file fails. */
+	bool passthrough;
+	/* The thread writing checkpoints */
+	pthread_t checkpointer;
+	/* Set while the checkpointer runs, cleared to stop it. Guarded by checkpointLock. */
+	bool checkpointing;
+	/* Set to make the checkpointer write a checkpoint right away. Guarded by checkpointLock. */
+	bool checkpointNow;
+	pthread_mutex_t checkpointLock;
+	pthread_cond_t checkpointCond;
+	/* A snapshot whose tagdb file couldn't be written yet, see tagfs_checkpoint. Only used by the checkpointer. */
+	tagdb_snapshot_t *pending;
+	/* The control socket listening for connections, or -1 if there is none, see tagfs_ctlkind_t */
+	int ctlfd;
+	/* The absolute path of the control socket */
+	char *ctlPath;
+	/* The thread accepting connections to the control socket */
+	pthread_t ctlAcceptor;
+	/* Set while connections are accepted. Guarded by ctlLock. */
+	bool ctlOpen;
+	/* Every open connection to the control socket. Guarded by ctlLock. */
+	tagfs_conn_t *conns;
+	pthread_mutex_t ctlLock;
+	/* Signalled whenever a connection is closed */
+	pthread_cond_t ctlCond;
 } tagfs_context_t;
 
 enum tagfs_flags
@@ -106,37 +328,9 @@ bool __attribute__ ((const)) tdbFile(const char *path)
 	return strncmp(path, ".tagdb", 6) == 0;
 }
 
-static char *split(const char *_path, const char **_fname)
-{
-	if(*_path == '/')
-		_path++;
-
-	//assert(*_path != '/');
-	const char *fname = strrchr(_path, '/');
-
-	if(_fname)
-		*_fname = fname ? fname + 1 : _path;
-
-	if(fname && fname != _path)
-	{
-		size_t pl = (size_t)fname - (size_t)_path;
-		char *path = malloc(pl + 1);
-
-		if(path)
-		{
-			memcpy(path, _path, pl);
-			path[pl] = 0;
-		}
-
-		return path;
-	}
-	else
-		return calloc(1,1);
-}
-
 /* Attempts to retrieve a tagdb entry. flags must contain TFS_FILE, TFS_TAG or both.
 	Filters out tagdb files and special dirs. */
-static inline tagdb_entry_t *tagfs_get(const char *name, enum tagfs_flags flags)
+static inline tagdb_entry_t *tagfs_get(tagfs_context_t *context, const char *name, enum tagfs_flags flags)
 {
 	#define fail(eno) { errno=eno; return NULL; }
 	//dbprintf("GET: %s; %u\n", name, flags);
@@ -148,7 +342,7 @@ static inline tagdb_entry_t *tagfs_get(const char *name, enum tagfs_flags flags)
 		return NULL;
 	}
 
-	tagdb_entry_t *e = tdb_get(CONTEXT->tdb, name);
+	tagdb_entry_t *e = tdb_get(TDB, name);
 
 	if(e)
 	{
@@ -172,14 +366,14 @@ static inline tagdb_entry_t *tagfs_get(const char *name, enum tagfs_flags flags)
 		}
 	}
 
-	if((flags & TFS_CHKDOT) && (flags & TFS_TAG) && *name == '.' && (e = tdb_get(CONTEXT->tdb, name + 1)))
+	if((flags & TFS_CHKDOT) && (flags & TFS_TAG) && *name == '.' && (e = tdb_get(TDB, name + 1)))
 	{
 	//	dbprintf("GET found dottag\n");
 
 		if(e->kind == TDB_TAG_ENTRY)
 			return e;
 	}
-	else if((flags & TFS_CHKNEG) && (flags & TFS_TAG) && *name == '-' && (e = tdb_get(CONTEXT->tdb, name + 1)))
+	else if((flags & TFS_CHKNEG) && (flags & TFS_TAG) && *name == '-' && (e = tdb_get(TDB, name + 1)))
 	{
 	//	dbprintf("GET found -tag\n");
 
@@ -187,14 +381,16 @@ static inline tagdb_entry_t *tagfs_get(const char *name, enum tagfs_flags flags)
 			return e;
 	}
 
-	if((flags & TFS_MKFILE) && (flags & TFS_FILE) && !tdbFile(name) && !specialDir(name) && !faccessat(CONTEXT->dirfd, name, F_OK, AT_SYMLINK_NOFOLLOW))
+	// while watching, every real file has an entry already
+	if((flags & TFS_MKFILE) && (flags & TFS_FILE) && !context->listed && !tdbFile(name) && !specialDir(name)
+		&& !faccessat(context->dirfd, REAL(name), F_OK, AT_SYMLINK_NOFOLLOW))
 	{
 	//	dbprintf("GET found existing file\n");
 
 		if(flags & TFS_NOCREAT)
 			fail(0);
 
-		return tdb_ins(CONTEXT->tdb, name, TDB_FILE_ENTRY);
+		return tdb_ins(TDB, name, TDB_FILE_ENTRY);
 	}
 
 	//dbprintf("GET fail\n");
@@ -202,716 +398,3493 @@ static inline tagdb_entry_t *tagfs_get(const char *name, enum tagfs_flags flags)
 	#undef fail
 }
 
-/* Evaluates the given path as a tagdb query.
-	Populates pos and neg with the positive and negative matching masks.
-	path gets partly overwritten.
-	Exits early with ENOENT on queries that contain a tag and its negation.
-	Returns false and sets errno on failure.
-	Returns true  on success. */
-static bool tagfs_query(char *path, bitarr_t pos, bitarr_t neg)
+/* Whether a real file with the given name exists that the tagdb may not have an entry for. While watching, every real file
+	has one, so this is always false. Otherwise the disk is checked, which is done without a lock on the tagdb
+	while the name is reserved, see tagfs_reserve. */
+static bool tagfs_realExists(tagfs_context_t *context, const char *name)
 {
-	char *sav = NULL;
-
-	for(char *tok = strtok_r(path, "/", &sav); tok; tok = strtok_r(NULL, "/", &sav))
-	{
-		bool mod = true;
+	return !context->listed && !tdbFile(name) && !specialDir(name) && !faccessat(context->dirfd, REAL(name), F_OK, AT_SYMLINK_NOFOLLOW);
+}
 
-		if(*tok == TAGFS_NEG_CHAR)
-		{
-			mod = false;
-			tok++;
-		}
+#pragma region File descriptor cache
 
-		// Check for dot-prefixed tags only if the - prefix isn't used
-		tagdb_entry_t *e = tagfs_get(tok, TFS_TAG | (mod ? TFS_CHKDOT : 0));
+/* Flags that only have an effect when opening a file */
+#define TAGFS_FD_OPENFLAGS (O_CREAT | O_EXCL | O_NOCTTY | O_TRUNC | O_CLOEXEC)
 
-		if(!e)
-			return false;
+/* Removes the fd from the list of unused fds. Requires fdLock. */
+static void _tagfs_fd_unlru(tagfs_context_t *context, tagfs_fd_t *f)
+{
+	*(f->lruPrev ? &f->lruPrev->lruNext : &context->fdHead) = f->lruNext;
+	*(f->lruNext ? &f->lruNext->lruPrev : &context->fdTail) = f->lruPrev;
+	f->lruPrev = f->lruNext = NULL;
+	context->fdIdle--;
+}
 
-		// Check for impossible queries
-		if(bitarr_get(mod ? neg : pos, e->tagId))
+/* Removes the fd from the cache of its node. Requires fdLock. */
+static void _tagfs_fd_detach(tagfs_fd_t *f)
+{
+	for (tagfs_fd_t **p = &f->node->fds; *p; p = &(*p)->next)
+	{
+		if(*p == f)
 		{
-			errno = ENOENT;
-			return false;
+			*p = f->next;
+			break;
 		}
-
-		bitarr_set(mod ? pos : neg, e->tagId, true);
 	}
 
-	return true;
+	f->node = NULL;
 }
 
-/* Determines if the given path, without filename, is a valid tag query.
-	if _fname isn't NULL, sets it to the filename of the path.
-	returns true on success.
-	returns false and sets errno on failure. */
-static bool tagfs_validQuery(const char *_path, const char **_fname)
+/* Opens the real file of the node, sharing a cached fd opened with the same flags if there is one.
+	Requires a read lock on the tagdb. Returns NULL and sets errno on failure. */
+static tagfs_fd_t *tagfs_fd_open(tagfs_context_t *context, tagfs_node_t *n, int flags)
 {
-	const char *fname;
-	char *path = split(_path, &fname);
-
-	if(!path)
-		return false;
+	// a truncating open has to reach the real file
+	bool cache = context->fdCap && !(flags & O_TRUNC);
+	tagfs_fd_t *f;
 
-	if(fname != _path)
+	if(cache)
 	{
-		bitarr_t pos = bitarr_new(TDB->tagCap);
-		bitarr_t neg = bitarr_new(TDB->tagCap);
+		pthread_mutex_lock(&context->fdLock);
+
+		for (f = n->fds; f; f = f->next)
+		{
+			if(f->flags == (flags & ~TAGFS_FD_OPENFLAGS))
+			{
+				if(!f->refs++)
+					_tagfs_fd_unlru(context, f);
 
-		if(pos && neg)
-			tagfs_query(path, pos, neg);
+				context->fdHits++;
+				pthread_mutex_unlock(&context->fdLock);
+				return f;
+			}
+		}
 
-		free(path);
-		free(pos);
-		free(neg);
+		context->fdMisses++;
+		pthread_mutex_unlock(&context->fdLock);
+	}
 
-		if(errno)
-			return false;
+	if(!(f = malloc(sizeof(tagfs_fd_t))))
+		return NULL;
+
+	*f = (tagfs_fd_t){ .fd = openat(context->dirfd, REAL(n->name), flags), .flags = flags & ~TAGFS_FD_OPENFLAGS, .refs = 1 };
+
+	if(f->fd < 0)
+	{
+		int eno = errno;
+		free(f);
+		errno = eno;
+		return NULL;
 	}
-	else
-		free(path);
 
-	if(_fname)
-		*_fname = fname;
+	if(cache)
+	{
+		pthread_mutex_lock(&context->fdLock);
+		f->node = n;
+		f->next = n->fds;
+		n->fds = f;
+		pthread_mutex_unlock(&context->fdLock);
+	}
 
-	return true;
+	return f;
 }
 
-/* Determines if the given path resolves to a valid tag or file.
-	Checks if all tags listed in the path are valid and if the file matches the query.
-	Doesn't create new tdb entries.
-	Finds negated tags.
-	if _entry isn't NULL, and the path resolves to a tagdb entry, stores the entry in _entry.
-	if _fname isn't NULL, stores the filename in fname.
-	Returns the kind of entry found.
-	Returns 0 and sets errno on failure. */
-static tagdb_entrykind_t tagfs_resolve(const char *_path, tagdb_entry_t **_entry, const char **_fname)
+/* Releases one use of the fd. Unused fds stay open until they're evicted or their file is unlinked. */
+static void tagfs_fd_release(tagfs_context_t *context, tagfs_fd_t *f)
 {
-	#define ERR(eno) { errno = eno; goto err; }
-	//dbprintf("RESOLVE: %s\n", _path);
+	tagfs_fd_t *evict = NULL;
 
-	tagdb_t *tdb = TDB;
-	errno = 0;
-	bitarr_t pos = NULL, neg = NULL;
-	const char *fname;
-	char *path = split(_path, &fname);
+	pthread_mutex_lock(&context->fdLock);
 
-	// Check if path contains query
-	if(*path)
+	if(--f->refs)
+		f = NULL;
+	else if(f->node)
 	{
-		pos = bitarr_new(tdb->tagCap);
-		neg = bitarr_new(tdb->tagCap);
+		f->lruNext = context->fdHead;
+		*(context->fdHead ? &context->fdHead->lruPrev : &context->fdTail) = f;
+		context->fdHead = f;
+		context->fdIdle++;
+		f = NULL;
 
-		if(path && pos && neg)
-			tagfs_query(path, pos, neg);
-
-		free(path);
-
-		if(errno)
+		if(context->fdIdle > context->fdCap)
 		{
-			free(neg);
-			free(pos);
-			return 0;
+			evict = context->fdTail;
+			_tagfs_fd_unlru(context, evict);
+			_tagfs_fd_detach(evict);
 		}
 	}
-	else
-		free(path);
 
-	if(_fname)
-		*_fname = fname;
+	pthread_mutex_unlock(&context->fdLock);
 
-	if(specialDir(fname))
-		return TDB_TAG_ENTRY;
-	if(tdbFile(fname))
+	// f is only set if it was used for the last time and isn't cached
+	if(f)
+		evict = f;
+	if(evict)
 	{
-		errno = ENOENT;
-		return TDB_EMPTY_ENTRY;
+		close(evict->fd);
+		free(evict);
 	}
+}
 
-	tagdb_entry_t *entry = tagfs_get(fname, TFS_CHKALL | TFS_CHKNEG);
-
-	if(entry)
-	{
-	//	dbprintf("Found %s entry\n", tagdb_entrykind_names[entry->kind]);
-
-		if(entry->kind == TDB_FILE_ENTRY && pos && !bitarr_match(entry->fileTags, tdb->tagCap, pos, neg))
-			ERR(ENOENT)
+/* Closes the unused cached fds of the node and makes the ones still in use close once they're released,
+	so later opens find the new file if the name is reused. */
+static void tagfs_fd_drop(tagfs_context_t *context, tagfs_node_t *n)
+{
+	pthread_mutex_lock(&context->fdLock);
 
-		if(_entry)
-			*_entry = entry;
-	}
-	else if(errno)
-		goto err;
-	else
+	for (tagfs_fd_t *f = n->fds, *next; f; f = next)
 	{
-	//	dbprintf("Found existing file\n");
+		next = f->next;
+		f->node = NULL;
 
-		if(pos && bitarr_any(pos, tdb->tagCap, true))
-			ERR(ENOENT)
+		if(!f->refs)
+		{
+			_tagfs_fd_unlru(context, f);
+			close(f->fd);
+			free(f);
+		}
 	}
 
-	err:
-	free(pos);
-	free(neg);
-
-	return errno ? TDB_EMPTY_ENTRY : entry ? entry->kind : TDB_FILE_ENTRY;
-	#undef ERR
+	n->fds = NULL;
+	pthread_mutex_unlock(&context->fdLock);
 }
 
-#pragma region rwlock functions
+/* Closes every unused cached fd */
+static void tagfs_fd_clear(tagfs_context_t *context)
+{
+	pthread_mutex_lock(&context->fdLock);
 
-// Returns v after releasing lock.
-#define RET_REL(v) { unlock(); return v; }
-// Jumps to label after releasing lock
-#define GOTO_REL(label) { unlock(); goto label; }
+	while(context->fdHead)
+	{
+		tagfs_fd_t *f = context->fdHead;
 
-/* Exactly like tagfs_resolve() but acquires and releases read lock before/after resolving the path. */
-static tagdb_entrykind_t tagfs_resolveL(const char *_path, tagdb_entry_t **_entry, const char **_fname)
-{
-	lock_r();
-	tagdb_entrykind_t k = tagfs_resolve(_path, _entry, _fname);
-	unlock();
+		_tagfs_fd_unlru(context, f);
+		_tagfs_fd_detach(f);
+		close(f->fd);
+		free(f);
+	}
 
-	return k;
+	pthread_mutex_unlock(&context->fdLock);
 }
 
 #pragma endregion
 
-#pragma endregion
-
-#pragma region Implementation
+#pragma region Nodes
 
-int tagfs_readdir(const char *_path, void *buf, fuse_fill_dir_t filler, UNUSED off_t offset, UNUSED struct fuse_file_info *fi)
+/* FNV-1a */
+static uint64_t tagfs_hash(const void *data, size_t len, uint64_t h)
 {
-	dbprintf("READDIR: %s\n", _path);
-	#define ERR(eno) { errno = eno; goto err; }
-	errno = 0;
-	tagfs_context_t *context = CONTEXT;
-	tagdb_t *tdb = context->tdb;
-	char *path = strdup(_path);
-
-	// use a write lock since we mutate context->dir
-	lock_w();
-
-	bitarr_t positive = bitarr_new(tdb->tagCap);
-	bitarr_t negative = bitarr_new(tdb->tagCap);
-	// Contains all tags that have at least one listed file
-	bitarr_t dirmask = bitarr_new(tdb->tagCap);
-
-	if(!path || !positive || !negative || !dirmask)
-		ERR(ENOMEM)
+	for (const unsigned char *p = data; len--; p++)
+		h = (h ^ *p) * 0x100000001b3ULL;
 
-	if(!tagfs_query(path, positive, negative))
-		goto err;
-
-	int anyP = bitarr_any(positive, tdb->tagCap, true);
-	struct dirent *ent;
+	return h;
+}
 
-	// iterate over existing real files
-	while((ent = readdir(context->dir)))
-	{
-		// filter out the .tagdb file
-		if(tdbFile(ent->d_name))
-			continue;
+#define TAGFS_HASH_INIT 0xcbf29ce484222325ULL
 
-		tagdb_entry_t *entry = tdb_get(tdb, ent->d_name);
+/* Hashes the given bitarray of the given length, ignoring trailing zeros so the result doesn't depend on the length. */
+static uint64_t tagfs_hashBits(const bitarr_t arr, size_t len, uint64_t h)
+{
+	size_t words = _bitarr_size(len);
 
-		if(entry)
-		{
-			assert(entry->kind == TDB_FILE_ENTRY);
+	while(words && !arr[words - 1])
+		words--;
 
-			if(!bitarr_match(entry->fileTags, tdb->tagCap, positive, negative))
-				continue;
+	return tagfs_hash(arr, words * sizeof(word), h ^ 0xff);
+}
 
-			bitarr_eqor(dirmask, tdb->tagCap, entry->fileTags);
-		}
-		else if(anyP)
-			continue;
+/* Determines if the bitarrays of the given lengths are equal, treating missing bits as 0. */
+static bool tagfs_bitsEq(const bitarr_t l, size_t llen, const bitarr_t r, size_t rlen)
+{
+	size_t lw = _bitarr_size(llen), rw = _bitarr_size(rlen);
 
-		struct stat s;
-		if(filler(buf, ent->d_name, fstatat(context->dirfd, ent->d_name, &s, AT_SYMLINK_NOFOLLOW) ? NULL : &s, 0))
-			ERR(ENOMEM)
+	for (size_t w = 0; w < lw || w < rw; w++)
+	{
+		if((w < lw ? l[w] : 0) != (w < rw ? r[w] : 0))
+			return false;
 	}
 
-	rewinddir(context->dir);
-
-	TDB_FORALL(TDB, name, entry, {
-		if(entry->kind != TDB_TAG_ENTRY)
-			continue;
-		if((anyP && bitarr_get(positive, entry->tagId)) || bitarr_get(negative, entry->tagId))
-			continue;
-		if(bitarr_get(dirmask, entry->tagId))
-		{
-			if(filler(buf, name, &context->realStat, 0))
-				ERR(ENOMEM)
-		}
-		else
-		{ // put the tag as a dotfile
-			size_t nl = strlen(name);
-			char *dname = malloc(nl + 2);
+	return true;
+}
 
-			if(!dname)
-				goto err;
+static inline bool tagfs_node_has(const tagfs_node_t *dir, const bitarr_t set, size_t tagId)
+{
+	return tagId < dir->cap && bitarr_get(set, tagId);
+}
 
-			*dname = '.';
-			memcpy(dname + 1, name, nl + 1);
-			int f = filler(buf, dname, NULL, 0);
-			free(dname);
+/* Determines if the given file tags match the query of the given directory. */
+static inline bool tagfs_node_match(const tagfs_node_t *dir, const bitarr_t fileTags)
+{
+	return bitarr_match(fileTags, dir->cap, dir->pos, dir->neg);
+}
 
-			if(f)
-				ERR(ENOMEM)
-		}
+/* Retrieves the node for the given inode number. */
+static inline tagfs_node_t *tagfs_node(tagfs_context_t *context, fuse_ino_t ino)
+{
+	return (ino == FUSE_ROOT_ID) ? &context->root : (tagfs_node_t*)(uintptr_t)ino;
+}
 
-		#ifdef LIST_NEGATED_TAGS
-		size_t nl = strlen(name);
-		char *nname = malloc(nl + 2);
+static inline fuse_ino_t tagfs_node_ino(tagfs_context_t *context, tagfs_node_t *n)
+{
+	return (n == &context->root) ? FUSE_ROOT_ID : (fuse_ino_t)(uintptr_t)n;
+}
 
-		if(!nname)
-			goto err;
+/* Adds the node to the index. Requires nodeLock. Returns false on malloc failure. */
+static bool _tagfs_node_index(tagfs_context_t *context, tagfs_node_t *n)
+{
+	if(context->nodeCount >= context->nodeCap)
+	{ // rehash into a larger index
+		size_t cap = context->nodeCap ? context->nodeCap * 2 : 1024;
+		tagfs_node_t **nodes = calloc(cap, sizeof(tagfs_node_t*));
 
-		*nname = '-';
-		memcpy(nname + 1, name, nl + 1);
-		int f = filler(buf, nname, NULL, 0);
-		free(nname);
+		if(!nodes)
+			return false;
 
-		if(f)
-			ERR(ENOMEM)
-		#endif
-	})
+		for (size_t i = 0; i < context->nodeCap; i++)
+		{
+			for (tagfs_node_t *c = context->nodes[i], *next; c; c = next)
+			{
+				next = c->next;
+				c->next = nodes[c->key % cap];
+				nodes[c->key % cap] = c;
+			}
+		}
 
-	err:
-	unlock();
+		free(context->nodes);
+		context->nodes = nodes;
+		context->nodeCap = cap;
+	}
 
-	free(path);
-	free(positive);
-	free(negative);
-	free(dirmask);
+	n->next = context->nodes[n->key % context->nodeCap];
+	context->nodes[n->key % context->nodeCap] = n;
+	n->indexed = true;
+	context->nodeCount++;
 
-	return -errno;
-	#undef ERR
+	return true;
 }
 
-int tagfs_getattr(const char *path, struct stat *_stat)
+/* Removes the node from the index. Requires nodeLock. */
+static void _tagfs_node_unindex(tagfs_context_t *context, tagfs_node_t *n)
 {
-	dbprintf("GETATTR: %s\n", path);
-
-	errno = 0;
-	tagfs_context_t *context = CONTEXT;
-	const char *fname;
+	if(!n->indexed)
+		return;
 
-	switch(tagfs_resolveL(path, NULL, &fname))
+	for (tagfs_node_t **p = &context->nodes[n->key % context->nodeCap]; *p; p = &(*p)->next)
 	{
-		case TDB_TAG_ENTRY:
-			// TODO: proper access times
-			dbprintf("GETATTR found tag\n");
-			*_stat = context->realStat;
-		break;
-
-		case TDB_FILE_ENTRY:
-			dbprintf("GETATTR found file\n");
-			fstatat(CONTEXT->dirfd, fname, _stat, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
-		break;
-
-		default: break;
+		if(*p == n)
+		{
+			*p = n->next;
+			break;
+		}
 	}
 
-	dbprintf("GETATTR exits with %d (%s)\n", errno, strerror(errno));
-
-	return -errno;
+	n->indexed = false;
+	context->nodeCount--;
 }
 
-int tagfs_mknod(const char *_path, mode_t mode, dev_t dev)
+static void _tagfs_node_free(tagfs_node_t *n)
 {
-	dbprintf("MKNOD: %s\n", _path);
-	errno = 0;
-	tagdb_t *tdb = TDB;
-	const char *fname;
-	char *path = split(_path, &fname);
+	if(n->kind == TDB_FILE_ENTRY)
+		free(n->name);
+	else
+	{
+		free(n->pos);
+		free(n->neg);
+	}
 
-	if(!path)
-		return -ENOMEM;
+	free(n);
+}
 
-	lock_w();
+/* Retrieves the node for the query directory with the given query and increments its lookup count.
+	Copies pos and neg. The root is returned for the empty query.
+	Returns NULL and sets errno on failure. */
+static tagfs_node_t *tagfs_node_dir(tagfs_context_t *context, const bitarr_t pos, const bitarr_t neg, size_t cap)
+{
+	uint64_t key = tagfs_hashBits(neg, cap, tagfs_hashBits(pos, cap, TAGFS_HASH_INIT));
+	tagfs_node_t *n;
 
-	if(tagfs_get(fname, TFS_CHKALL) || !errno || tdbFile(fname))
-		RET_REL(-EEXIST);
-	if(fname[0] == TAGFS_NEG_CHAR)
-		RET_REL(-EINVAL);
+	pthread_mutex_lock(&context->nodeLock);
 
-	tagdb_entry_t *e = NULL;
+	if(bitarr_all(pos, cap, false) && bitarr_all(neg, cap, false))
+	{
+		n = &context->root;
+		goto found;
+	}
 
-	// given path contains a query
-	if(*path)
+	for (n = context->nodeCap ? context->nodes[key % context->nodeCap] : NULL; n; n = n->next)
 	{
-		errno = 0;
-		bitarr_t positive = bitarr_new(tdb->tagCap);
-		bitarr_t negative = bitarr_new(tdb->tagCap);
+		if(n->key == key && n->kind == TDB_TAG_ENTRY && tagfs_bitsEq(n->pos, n->cap, pos, cap) && tagfs_bitsEq(n->neg, n->cap, neg, cap))
+			goto found;
+	}
 
-		if(!positive || !negative)
-			goto err;
+	if(!(n = calloc(1, sizeof(tagfs_node_t))))
+		goto fail;
 
-		if(!tagfs_query(path, positive, negative))
-			goto err;
+	*n = (tagfs_node_t){ .kind = TDB_TAG_ENTRY, .key = key, .cap = cap, .pos = bitarr_new(cap), .neg = bitarr_new(cap) };
 
-		e = tdb_ins(tdb, fname, TDB_FILE_ENTRY);
+	if(!n->pos || !n->neg || !_tagfs_node_index(context, n))
+	{
+		_tagfs_node_free(n);
+		goto fail;
+	}
 
-		if(!e)
-			goto err;
+	bitarr_copy(n->pos, cap, pos);
+	bitarr_copy(n->neg, cap, neg);
 
-		bitarr_copy(e->fileTags, tdb->tagCap, positive);
+	found:
+	n->nlookup++;
+	pthread_mutex_unlock(&context->nodeLock);
+	return n;
 
-		err:
-		free(path);
-		free(positive);
-		free(negative);
+	fail:
+	pthread_mutex_unlock(&context->nodeLock);
+	errno = ENOMEM;
+	return NULL;
+}
 
-		if(errno)
-			RET_REL(-errno);
+/* Finds the indexed node for the real file with the given name. Requires nodeLock. */
+static tagfs_node_t *_tagfs_node_findFile(tagfs_context_t *context, const char *name, uint64_t key)
+{
+	for (tagfs_node_t *n = context->nodeCap ? context->nodes[key % context->nodeCap] : NULL; n; n = n->next)
+	{
+		if(n->key == key && n->kind == TDB_FILE_ENTRY && !strcmp(n->name, name))
+			return n;
 	}
-	else
-		free(path);
 
-	errno = 0;
-	if(mknodat(CONTEXT->dirfd, fname, mode, dev) && e)
-		tdb_rmE(TDB, e);
-
-	unlock();
-	return -errno;
+	return NULL;
 }
 
-int tagfs_mkdir(const char *_path, mode_t mode)
+/* Retrieves the node for the real file with the given name and increments its lookup count.
+	Returns NULL and sets errno on failure. */
+static tagfs_node_t *tagfs_node_file(tagfs_context_t *context, const char *name)
 {
-	dbprintf("MKDIR: %s\n", _path);
-	errno = 0;
-	tagdb_t *tdb = TDB;
-	const char *fname;
+	uint64_t key = tagfs_hash(name, strlen(name), TAGFS_HASH_INIT);
 
-	#ifdef BLOCK_TRASH_CREATION
-		if(!strncmp(_path, "/.Trash", 6))
-			return -EINVAL;
-	#endif
+	pthread_mutex_lock(&context->nodeLock);
+	tagfs_node_t *n = _tagfs_node_findFile(context, name, key);
 
-	if((mode & CONTEXT->realStat.st_mode & 0777) != (mode & 0777))
+	if(!n)
 	{
-		#define octal(n) ((n & 0700) >> 6), ((n & 070) >> 3), (n & 07)
-		dbprintf("Refusing mkdir() with mode %d%d%d, which is incompatible with root mode %d%d%d\n",
-										octal(mode),							octal(CONTEXT->realStat.st_mode));
-		#undef octal
-		return -ENOTSUP;
-	}
+		if(!(n = calloc(1, sizeof(tagfs_node_t))))
+			goto fail;
 
-	lock_w();
+		*n = (tagfs_node_t){ .kind = TDB_FILE_ENTRY, .key = key, .name = strdup(name) };
 
-	if(!tagfs_validQuery(_path, &fname))
-		RET_REL(-errno);
-	if(tagfs_get(fname, TFS_CHKALL) || !errno || tdbFile(fname) || specialDir(fname))
-		RET_REL(-EEXIST);
-	if(fname[0] == TAGFS_NEG_CHAR)
-		RET_REL(-EINVAL);
+		if(!n->name || !_tagfs_node_index(context, n))
+		{
+			_tagfs_node_free(n);
+			goto fail;
+		}
+	}
 
-	tagdb_entry_t *newEntry = tdb_ins(tdb, fname, TDB_TAG_ENTRY);
-	unlock();
+	n->nlookup++;
+	pthread_mutex_unlock(&context->nodeLock);
+	return n;
 
-	return newEntry ? 0 : -errno;
+	fail:
+	pthread_mutex_unlock(&context->nodeLock);
+	errno = ENOMEM;
+	return NULL;
 }
 
-int tagfs_utimens(const char *_path, const struct timespec tv[2])
+/* Decrements the lookup count of the node by count, releasing it once the kernel has forgotten it. */
+static void tagfs_node_forget(tagfs_context_t *context, tagfs_node_t *n, uint64_t count)
 {
-	#define ERR(eno) { return -eno; }
-	dbprintf("UTIMENS: %s\n", _path);
+	pthread_mutex_lock(&context->nodeLock);
 
-	tagfs_context_t *context = CONTEXT;
-	errno = 0;
-
-	const char *fname;
-	tagdb_entrykind_t k = tagfs_resolveL(_path, NULL, &fname);
+	assert(n->nlookup >= count);
+	n->nlookup -= count;
 
-	if(k == TDB_FILE_ENTRY)
+	if(!n->nlookup && n != &context->root)
 	{
-		if(utimensat(context->dirfd, fname, tv, AT_SYMLINK_NOFOLLOW))
-			return -errno;
+		// the kernel doesn't forget open files, so the fds are all unused
+		if(n->kind == TDB_FILE_ENTRY)
+			tagfs_fd_drop(context, n);
+
+		_tagfs_node_unindex(context, n);
+		_tagfs_node_free(n);
 	}
-	else if(k == TDB_TAG_ENTRY)
-		return -ENOTSUP;
 
-	return -errno;
-	#undef ERR
+	pthread_mutex_unlock(&context->nodeLock);
 }
 
-int tagfs_open(const char *path, struct fuse_file_info *ffi)
+/* Makes sure the node of the real file with the given name isn't found by later lookups,
+	so a new file with the same name gets a new inode. */
+static void tagfs_node_unlinkFile(tagfs_context_t *context, const char *name)
 {
-	dbprintf("OPEN: %s\n", path);
-
-	errno = 0;
-	const char *fname;
-	tagdb_entrykind_t kind = tagfs_resolveL(path, NULL, &fname);
-
-	if(!kind)
-		return -errno;
-	if(kind != TDB_FILE_ENTRY)
-		return -EISDIR;
+	uint64_t key = tagfs_hash(name, strlen(name), TAGFS_HASH_INIT);
 
-	int fd = openat(CONTEXT->dirfd, fname, ffi->flags);
+	pthread_mutex_lock(&context->nodeLock);
+	tagfs_node_t *n = _tagfs_node_findFile(context, name, key);
 
-	if(fd < 0)
-		return -errno;
+	if(n)
+	{
+		_tagfs_node_unindex(context, n);
+		tagfs_fd_drop(context, n);
+	}
 
-	ffi->fh = fd;
-	return 0;
+	pthread_mutex_unlock(&context->nodeLock);
 }
 
-int tagfs_release(UNUSED const char *path, struct fuse_file_info *ffi)
+/* Whether the real file with the given name has an indexed node */
+static bool tagfs_node_hasFile(tagfs_context_t *context, const char *name)
 {
-	dbprintf("RELEASE: %s\n", path);
-	close(ffi->fh);
-	return 0;
-}
+	uint64_t key = tagfs_hash(name, strlen(name), TAGFS_HASH_INIT);
 
-int tagfs_read(UNUSED const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *ffi)
-{
-	return pread(ffi->fh, buf, len, offset);
-}
+	pthread_mutex_lock(&context->nodeLock);
+	bool has = _tagfs_node_findFile(context, name, key);
+	pthread_mutex_unlock(&context->nodeLock);
 
-int tagfs_write(UNUSED const char *_path, const char *buf, size_t len, off_t offset, struct fuse_file_info *ffi)
-{
-	return pwrite(ffi->fh, buf, len, offset);
+	return has;
 }
 
-int tagfs_fsync(UNUSED const char *path, int datasync, struct fuse_file_info *ffi)
+/* Changes the name of the node of the real file from to to, if there is one, replacing the node named to.
+	Without a node for from, the node named to is kept. Requires a write lock on the tagdb. Returns false and sets errno on failure. */
+static bool tagfs_node_renameFile(tagfs_context_t *context, const char *from, const char *to)
 {
-	dbprintf("FSYNC: %s\n", path);
+	uint64_t key = tagfs_hash(from, strlen(from), TAGFS_HASH_INIT);
+	bool ok = true;
 
-	if((datasync ? fdatasync : fsync)(ffi->fh))
-		return -errno;
+	pthread_mutex_lock(&context->nodeLock);
+	tagfs_node_t *n = _tagfs_node_findFile(context, from, key);
 
-	return 0;
-}
+	if(n)
+	{
+		char *name = strdup(to);
+		tagfs_node_t *o = _tagfs_node_findFile(context, to, tagfs_hash(to, strlen(to), TAGFS_HASH_INIT));
 
-int tagfs_getxattr(const char *path, const char *key, char *value, size_t size)
-{
-	dbprintf("GETXATTR: %s %s %zu\n", path, key, size);
-	tagdb_entry_t *e = NULL;
+		if(o)
+		{
+			_tagfs_node_unindex(context, o);
+			tagfs_fd_drop(context, o);
+		}
 
-	lock_r();
+		_tagfs_node_unindex(context, n);
 
-	switch(tagfs_resolve(path, &e, NULL))
-	{
-		case TDB_TAG_ENTRY:;
-			unlock();
-			ssize_t siz = fgetxattr(CONTEXT->dirfd, key, value, size);
-			dbprintf("getxattr on root dir: %d %s\n", errno, strerror(errno));
-		return (siz < 0) ? -errno : siz;
+		if(name)
+		{
+			free(n->name);
+			n->name = name;
+			n->key = tagfs_hash(name, strlen(name), TAGFS_HASH_INIT);
+			ok = _tagfs_node_index(context, n);
+		}
+		else
+			ok = false;
+	}
 
-		case TDB_FILE_ENTRY:
-			// TODO: wrap getxattr for real files (there is no getxattrat())
-			if(strcmp(key, "user.tags"))
-				RET_REL(-ENODATA)
-			if(!e)
-				RET_REL(0)
+	pthread_mutex_unlock(&context->nodeLock);
 
-			size_t pos = 0;
+	if(!ok)
+		errno = ENOMEM;
 
-			TDB_FILE_FORALL(CONTEXT->tdb, e, tagname, tag, {
-				size_t len = strlen(tagname);
+	return ok;
+}
 
-				if(size)
-				{
-					if(pos+len >= size)
-						return -ERANGE;
+/* Removes every query directory that uses the given tag from the index, so a tag created later with the same ID isn't confused with it.
+	Returns the number of affected nodes. */
+static size_t tagfs_node_unlinkTag(tagfs_context_t *context, size_t tagId)
+{
+	size_t c = 0;
 
-					memcpy(value + pos, tagname, len);
-					value[pos + len] = '/';
-				}
+	pthread_mutex_lock(&context->nodeLock);
 
-				pos += len + 1;
-			})
+	for (size_t i = 0; i < context->nodeCap; i++)
+	{
+		for (tagfs_node_t *n = context->nodes[i], *next; n; n = next)
+		{
+			next = n->next;
 
-			unlock();
-		return pos;
+			if(n->kind == TDB_TAG_ENTRY && (tagfs_node_has(n, n->pos, tagId) || tagfs_node_has(n, n->neg, tagId)))
+			{
+				_tagfs_node_unindex(context, n);
+				c++;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&context->nodeLock);
+	return c;
+}
+
+/* Determines if the given node is a query directory that doesn't use a deleted tag.
+	Returns false and sets errno if it isn't. */
+static bool tagfs_node_isDir(tagfs_context_t *context, const tagfs_node_t *n)
+{
+	if(n->kind != TDB_TAG_ENTRY)
+		errno = ENOTDIR;
+	else if(!n->indexed && n != &context->root)
+		errno = ENOENT;
+	else
+		return true;
+
+	return false;
+}
+
+/* Retrieves the node of the query directory named name in the query directory dir and increments its lookup count.
+	tag is the tag entry name resolved to. Requires at least a read lock on the tagdb.
+	Returns NULL and sets errno if the query would be impossible or is the same as dir's. */
+static tagfs_node_t *tagfs_node_lookupDir(tagfs_context_t *context, const tagfs_node_t *dir, const char *name, const tagdb_entry_t *tag)
+{
+	assert(tag->kind == TDB_TAG_ENTRY);
+
+	if(tagfs_node_has(dir, dir->pos, tag->tagId) || tagfs_node_has(dir, dir->neg, tag->tagId))
+	{
+		errno = ENOENT;
+		return NULL;
+	}
+
+	size_t cap = TDB->tagCap;
+	bitarr_t pos = bitarr_new(cap);
+	bitarr_t neg = bitarr_new(cap);
+	tagfs_node_t *n = NULL;
+
+	if(!pos || !neg)
+		errno = ENOMEM;
+	else
+	{
+		bitarr_copy(pos, dir->cap, dir->pos);
+		bitarr_copy(neg, dir->cap, dir->neg);
+		// tag names can't start with TAGFS_NEG_CHAR
+		bitarr_set((*name == TAGFS_NEG_CHAR) ? neg : pos, tag->tagId, true);
+		n = tagfs_node_dir(context, pos, neg, cap);
+	}
+
+	free(pos);
+	free(neg);
+
+	return n;
+}
+
+#pragma endregion
+
+#pragma region Kernel cache invalidation
+/* The kernel may hold locks while it waits for a reply, and blocks invalidations that need them.
+	Invalidations are queued and sent by the notifier thread so requests never wait for them. */
+
+static inline bool tagfs_notifying(tagfs_context_t *context)
+{
+	return __atomic_load_n(&context->notifying, __ATOMIC_RELAXED);
+}
+
+/* Queues an invalidation of the entry with the given name in the directory ino, prefixed with prefix if it isn't 0.
+	Invalidates the attributes of the inode ino instead if name is NULL. */
+static void tagfs_inval_push(tagfs_context_t *context, fuse_ino_t ino, char prefix, const char *name)
+{
+	if(!tagfs_notifying(context))
+		return;
+
+	size_t len = name ? strlen(name) + (prefix ? 1 : 0) : 0;
+	tagfs_inval_t *i = malloc(sizeof(tagfs_inval_t) + len + 1);
+
+	// the kernel keeps the stale entry until it times out
+	if(!i)
+		return;
+
+	i->ino = ino;
+	i->next = NULL;
+	i->name[0] = '\0';
+
+	if(name)
+	{
+		char *dst = i->name;
+
+		if(prefix)
+			*dst++ = prefix;
+
+		strcpy(dst, name);
+	}
+
+	pthread_mutex_lock(&context->invalLock);
+	*context->invalTail = i;
+	context->invalTail = &i->next;
+	pthread_cond_signal(&context->invalCond);
+	pthread_mutex_unlock(&context->invalLock);
+}
+
+/* Determines if a file with the given tags shows up in the given query directory.
+	A NULL tag set belongs to a file without entry. */
+static inline bool tagfs_node_showsFile(const tagfs_node_t *dir, bool exists, const bitarr_t tags)
+{
+	return exists && (tags ? tagfs_node_match(dir, tags) : !bitarr_any(dir->pos, dir->cap, true));
+}
+
+/* Invalidates the entry of the file with the given name in every query directory it appeared in or disappeared from.
+	had and old describe the file before the change, has and cur after it. A NULL tag set belongs to a file without entry. */
+static void tagfs_inval_file(tagfs_context_t *context, const char *name, bool had, const bitarr_t old, bool has, const bitarr_t cur)
+{
+	if(!tagfs_notifying(context))
+		return;
+
+	tagfs_node_t *root = &context->root;
+
+	if(tagfs_node_showsFile(root, had, old) != tagfs_node_showsFile(root, has, cur))
+		tagfs_inval_push(context, FUSE_ROOT_ID, 0, name);
+
+	pthread_mutex_lock(&context->nodeLock);
+
+	for (size_t i = 0; i < context->nodeCap; i++)
+	{
+		for (tagfs_node_t *n = context->nodes[i]; n; n = n->next)
+		{
+			if(n->kind == TDB_TAG_ENTRY && tagfs_node_showsFile(n, had, old) != tagfs_node_showsFile(n, has, cur))
+				tagfs_inval_push(context, tagfs_node_ino(context, n), 0, name);
+		}
+	}
+
+	pthread_mutex_unlock(&context->nodeLock);
+}
+
+/* Invalidates the entries with the given name in every query directory.
+	If tag is set, also invalidates the dotted and negated forms of the name. */
+static void tagfs_inval_name(tagfs_context_t *context, const char *name, bool tag)
+{
+	if(!tagfs_notifying(context))
+		return;
+
+	#define push(ino) { \
+		tagfs_inval_push(context, ino, 0, name); \
+		if(tag) \
+		{ \
+			tagfs_inval_push(context, ino, '.', name); \
+			tagfs_inval_push(context, ino, TAGFS_NEG_CHAR, name); \
+		} \
+	}
+
+	push(FUSE_ROOT_ID)
+	pthread_mutex_lock(&context->nodeLock);
+
+	for (size_t i = 0; i < context->nodeCap; i++)
+	{
+		for (tagfs_node_t *n = context->nodes[i]; n; n = n->next)
+		{
+			if(n->kind == TDB_TAG_ENTRY)
+				push(tagfs_node_ino(context, n))
+		}
+	}
+
+	pthread_mutex_unlock(&context->nodeLock);
+	#undef push
+}
+
+/* Invalidates the cached attributes of the real file with the given name. */
+static void tagfs_inval_attr(tagfs_context_t *context, const char *name)
+{
+	if(!tagfs_notifying(context))
+		return;
+
+	pthread_mutex_lock(&context->nodeLock);
+	tagfs_node_t *n = _tagfs_node_findFile(context, name, tagfs_hash(name, strlen(name), TAGFS_HASH_INIT));
+	fuse_ino_t ino = n ? tagfs_node_ino(context, n) : 0;
+	pthread_mutex_unlock(&context->nodeLock);
+
+	if(ino)
+		tagfs_inval_push(context, ino, 0, NULL);
+}
+
+/* Thread function that sends queued invalidations to the kernel. */
+static void *tagfs_notify(void *_context)
+{
+	tagfs_context_t *context = _context;
+
+	pthread_mutex_lock(&context->invalLock);
+
+	for(;;)
+	{
+		while(!context->invalHead && context->notifying)
+			pthread_cond_wait(&context->invalCond, &context->invalLock);
+
+		tagfs_inval_t *i = context->invalHead;
+
+		if(!i)
+			break;
+		if(!(context->invalHead = i->next))
+			context->invalTail = &context->invalHead;
+
+		pthread_mutex_unlock(&context->invalLock);
+
+		// fails with ENOENT if the kernel doesn't know the inode or entry anymore
+		if(*i->name)
+			fuse_lowlevel_notify_inval_entry(context->se, i->ino, i->name, strlen(i->name));
+		else
+			// only the attributes, the kernel notices changed contents by the mtime
+			fuse_lowlevel_notify_inval_inode(context->se, i->ino, -1, 0);
+
+		free(i);
+		pthread_mutex_lock(&context->invalLock);
+	}
+
+	pthread_mutex_unlock(&context->invalLock);
+	return NULL;
+}
+
+#pragma endregion
+
+/* Determines if name is a valid tag or file in the query directory dir.
+	Checks if the file matches the query.
+	Doesn't create new tdb entries.
+	Finds negated tags.
+	if _entry isn't NULL, and the name resolves to a tagdb entry, stores the entry in _entry.
+	Returns the kind of entry found.
+	Returns 0 and sets errno on failure. */
+static tagdb_entrykind_t tagfs_resolve(tagfs_context_t *context, tagfs_node_t *dir, const char *name, tagdb_entry_t **_entry)
+{
+	errno = 0;
+
+	if(!tagfs_node_isDir(context, dir))
+		return TDB_EMPTY_ENTRY;
+	if(specialDir(name) || tdbFile(name))
+	{
+		errno = ENOENT;
+		return TDB_EMPTY_ENTRY;
+	}
+
+	tagdb_entry_t *entry = tagfs_get(context, name, TFS_CHKALL | TFS_CHKNEG);
+
+	if(entry)
+	{
+		bitarr_t tags = (entry->kind == TDB_FILE_ENTRY) ? tdb_tags(TDB, entry) : NULL;
+
+		if(entry->kind == TDB_FILE_ENTRY && (!tags || !tagfs_node_match(dir, tags)))
+		{
+			errno = tags ? ENOENT : ENOMEM;
+			return TDB_EMPTY_ENTRY;
+		}
+
+		if(_entry)
+			*_entry = entry;
+
+		return entry->kind;
+	}
+	if(errno)
+		return TDB_EMPTY_ENTRY;
+
+	// real file without entry
+	if(bitarr_any(dir->pos, dir->cap, true))
+	{
+		errno = ENOENT;
+		return TDB_EMPTY_ENTRY;
+	}
+
+	return TDB_FILE_ENTRY;
+}
+
+#pragma region rwlock functions
+
+// Returns v after releasing lock.
+#define RET_REL(v) { unlock(); return v; }
+// Jumps to label after releasing lock
+#define GOTO_REL(label) { unlock(); goto label; }
+// Replies with the given error after releasing lock.
+#define ERR_REL(eno) { unlock(); fuse_reply_err(req, eno); return; }
+
+#pragma endregion
+
+#pragma region Reservations
+
+/* Changes to real files happen in two phases: They're checked with a read lock on the tagdb and done on the real
+	directory without any lock, so listings and lookups aren't blocked by the disk. The tagdb is only changed afterwards,
+	with a write lock, so there's nothing to roll back if the change fails. The names of the files are reserved for
+	the whole time, so no other change or watch event for the same files can come in between. */
+
+/* Returns true if the name is reserved by r */
+static bool tagfs_rsv_has(const tagfs_rsv_t *r, const char *name)
+{
+	if(!name)
+		return false;
+	if((r->names[0] && !strcmp(r->names[0], name)) || (r->names[1] && !strcmp(r->names[1], name)))
+		return true;
+
+	for (size_t i = 0; i < r->moreCount; i++)
+	{
+		if(!strcmp(r->more[i], name))
+			return true;
+	}
+
+	return false;
+}
+
+/* Returns true if any name of r is reserved by o */
+static bool tagfs_rsv_overlaps(const tagfs_rsv_t *o, const tagfs_rsv_t *r)
+{
+	if(tagfs_rsv_has(o, r->names[0]) || tagfs_rsv_has(o, r->names[1]))
+		return true;
+
+	for (size_t i = 0; i < r->moreCount; i++)
+	{
+		if(tagfs_rsv_has(o, r->more[i]))
+			return true;
+	}
+
+	return false;
+}
+
+/* Adds the reservation r once none of its names is reserved anymore. All of them are taken at once,
+	so changes reserving several names never wait for each other while holding some. */
+static void _tagfs_reserve(tagfs_context_t *context, tagfs_rsv_t *r)
+{
+	pthread_mutex_lock(&context->rsvLock);
+
+	for (tagfs_rsv_t *o = context->rsvs; o;)
+	{
+		if(tagfs_rsv_overlaps(o, r))
+		{
+			pthread_cond_wait(&context->rsvCond, &context->rsvLock);
+			o = context->rsvs;
+		}
+		else
+			o = o->next;
+	}
+
+	r->next = context->rsvs;
+	context->rsvs = r;
+	pthread_mutex_unlock(&context->rsvLock);
+}
+
+/* Reserves the names a and b, which may be NULL, waiting for earlier reservations of them to end.
+	Must not be called with a lock on the tagdb, since finishing a change needs the write lock. */
+static void tagfs_reserve(tagfs_context_t *context, tagfs_rsv_t *r, const char *a, const char *b)
+{
+	*r = (tagfs_rsv_t){ .names = { a, b } };
+	_tagfs_reserve(context, r);
+}
+
+/* Reserves count names like tagfs_reserve. The names have to stay valid until the reservation ends. */
+static void tagfs_reserveAll(tagfs_context_t *context, tagfs_rsv_t *r, const char **names, size_t count)
+{
+	*r = (tagfs_rsv_t){ .more = names, .moreCount = count };
+	_tagfs_reserve(context, r);
+}
+
+/* Ends the reservation r */
+static void tagfs_unreserve(tagfs_context_t *context, tagfs_rsv_t *r)
+{
+	pthread_mutex_lock(&context->rsvLock);
+
+	for (tagfs_rsv_t **p = &context->rsvs; *p; p = &(*p)->next)
+	{
+		if(*p == r)
+		{
+			*p = r->next;
+			break;
+		}
+	}
+
+	pthread_cond_broadcast(&context->rsvCond);
+	pthread_mutex_unlock(&context->rsvLock);
+}
+
+#pragma endregion
+
+#pragma region Attribute cache
+
+/* Converts statx() output to a struct stat */
+static void tagfs_stx2stat(const struct statx *x, struct stat *st)
+{
+	*st = (struct stat){
+		.st_dev = makedev(x->stx_dev_major, x->stx_dev_minor),
+		.st_ino = x->stx_ino,
+		.st_mode = x->stx_mode,
+		.st_nlink = x->stx_nlink,
+		.st_uid = x->stx_uid,
+		.st_gid = x->stx_gid,
+		.st_rdev = makedev(x->stx_rdev_major, x->stx_rdev_minor),
+		.st_size = x->stx_size,
+		.st_blksize = x->stx_blksize,
+		.st_blocks = x->stx_blocks,
+		.st_atim = { x->stx_atime.tv_sec, x->stx_atime.tv_nsec },
+		.st_mtim = { x->stx_mtime.tv_sec, x->stx_mtime.tv_nsec },
+		.st_ctim = { x->stx_ctime.tv_sec, x->stx_ctime.tv_nsec },
+	};
+}
+
+/* Retrieves the attributes of the real file with the given name.
+	Returns false and sets errno on failure. */
+static bool tagfs_statx(int dirfd, const char *name, struct stat *st)
+{
+	struct statx x;
+
+	if(statx(dirfd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &x))
+		return errno == ENOSYS && !fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+
+	tagfs_stx2stat(&x, st);
+	return true;
+}
+
+static inline int64_t tagfs_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* Retrieves the cached attributes of the given file entry, if they're recent enough.
+	Requires at least a read lock on the tagdb.
+	Returns false if there are no usable cached attributes. */
+static bool tagfs_attr_cached(tagfs_context_t *context, tagdb_entry_t *e, struct stat *st)
+{
+	if(!context->attrTTL)
+		return false;
+
+	assert(e->kind == TDB_FILE_ENTRY);
+	pthread_mutex_lock(&context->attrLock);
+	tagdb_attr_t *a = e->fileAttr;
+	bool hit = a && (a->time.tv_sec || a->time.tv_nsec)
+		&& tagfs_now() - (a->time.tv_sec * 1000000000LL + a->time.tv_nsec) < context->attrTTL;
+
+	if(hit)
+	{
+		*st = a->st;
+		context->attrHits++;
+	}
+	else
+		context->attrMisses++;
+
+	pthread_mutex_unlock(&context->attrLock);
+
+	return hit;
+}
+
+/* Caches the given attributes in the given file entry.
+	Requires at least a read lock on the tagdb. */
+static void tagfs_attr_store(tagfs_context_t *context, tagdb_entry_t *e, const struct stat *st)
+{
+	if(!context->attrTTL)
+		return;
+
+	int64_t now = tagfs_now();
+	pthread_mutex_lock(&context->attrLock);
+
+	if(!e->fileAttr)
+		e->fileAttr = malloc(sizeof(tagdb_attr_t));
+	if(e->fileAttr)
+		*e->fileAttr = (tagdb_attr_t){ .st = *st, .time = { now / 1000000000LL, now % 1000000000LL } };
+
+	pthread_mutex_unlock(&context->attrLock);
+}
+
+/* Retrieves the attributes of the real file with the given name, preferring the cached attributes of its file entry.
+	e is the file entry of the real file, or NULL if it has none.
+	Requires at least a read lock on the tagdb.
+	Returns false and sets errno on failure. */
+static bool tagfs_attr(tagfs_context_t *context, tagdb_entry_t *e, const char *name, struct stat *st)
+{
+	if(!e)
+		return tagfs_statx(context->dirfd, REAL(name), st);
+	if(tagfs_attr_cached(context, e, st))
+		return true;
+	if(!tagfs_statx(context->dirfd, REAL(name), st))
+		return false;
+
+	tagfs_attr_store(context, e, st);
+	return true;
+}
+
+/* Marks the cached attributes of the given file entry as stale. Does nothing if e is NULL or not a file entry.
+	Requires at least a read lock on the tagdb. */
+static void tagfs_attr_drop(tagfs_context_t *context, tagdb_entry_t *e)
+{
+	if(!e || e->kind != TDB_FILE_ENTRY)
+		return;
+
+	pthread_mutex_lock(&context->attrLock);
+
+	if(e->fileAttr)
+		e->fileAttr->time = (struct timespec){};
+
+	pthread_mutex_unlock(&context->attrLock);
+}
+
+/* Marks the cached attributes of the real file with the given name or path as stale. Acquires a read lock. */
+static void tagfs_attr_dropName(tagfs_context_t *context, const char *path)
+{
+	if(!context->attrTTL)
+		return;
+
+	const char *fname = strrchr(path, '/');
+
+	pthread_rwlock_rdlock(&context->lock);
+	tagfs_attr_drop(context, tdb_get(context->tdb, fname ? fname + 1 : path));
+	pthread_rwlock_unlock(&context->lock);
+}
+
+#pragma endregion
+
+#pragma region Directory listings
+
+/* A snapshot of a directory listing, taken by opendir and handed out piecewise by readdir. */
+typedef struct
+{
+	/* Every listed name, each terminated by a \0 */
+	char *names;
+	size_t namesLen, namesCap;
+	/* The offset of every listed name in names.
+		Real files come first, followed by visible tags and then dotted and negated tags. */
+	size_t *offs;
+	size_t len, cap;
+	/* Number of real files at the start of the listing */
+	size_t files;
+	/* Number of visible tags after the real files */
+	size_t tags;
+} tagfs_listing_t;
+
+/* Appends a name to the listing, prepending prefix if it isn't 0.
+	Returns false and sets errno on failure. */
+static bool tagfs_listing_push(tagfs_listing_t *l, char prefix, const char *name)
+{
+	size_t nl = strlen(name) + (prefix ? 2 : 1);
+
+	if(l->len == l->cap)
+	{
+		size_t cap = l->cap ? l->cap * 2 : 64;
+		size_t *o = realloc(l->offs, cap * sizeof(size_t));
+
+		if(!o)
+			return false;
+
+		l->offs = o;
+		l->cap = cap;
+	}
+
+	if(l->namesLen + nl > l->namesCap)
+	{
+		size_t cap = l->namesCap ? l->namesCap * 2 : 1024;
+
+		while(cap < l->namesLen + nl)
+			cap *= 2;
+
+		char *n = realloc(l->names, cap);
+
+		if(!n)
+			return false;
+
+		l->names = n;
+		l->namesCap = cap;
+	}
+
+	char *dst = l->names + l->namesLen;
+
+	if(prefix)
+		*dst++ = prefix;
+
+	strcpy(dst, name);
+	l->offs[l->len++] = l->namesLen;
+	l->namesLen += nl;
+
+	return true;
+}
+
+static void tagfs_listing_free(tagfs_listing_t *l)
+{
+	if(l)
+	{
+		free(l->names);
+		free(l->offs);
+		free(l);
+	}
+}
+
+static inline const char *tagfs_listing_name(tagfs_listing_t *l, size_t i)
+{
+	return l->names + l->offs[i];
+}
+
+/* Appends the real files in the query directory dir to the listing.
+	If dirmask isn't NULL, adds the tags of every listed file to it.
+	Requires at least a read lock on the tagdb. Returns false and sets errno on failure. */
+static bool tagfs_node_files(tagfs_context_t *context, const tagfs_node_t *dir, bitarr_t dirmask, tagfs_listing_t *l)
+{
+	tagdb_t *tdb = context->tdb;
+	int anyP = bitarr_any(dir->pos, dir->cap, true);
+
+	if(context->listed)
+	{ // every real file has an entry
+		TDB_FORALL(tdb, name, entry, {
+			if(entry->kind != TDB_FILE_ENTRY)
+				continue;
+
+			bitarr_t tags = tdb_tags(tdb, entry);
+
+			if(!tags)
+				return false;
+			if(!tagfs_node_match(dir, tags))
+				continue;
+			if(dirmask)
+				bitarr_eqor(dirmask, tdb->tagCap, tags);
+			if(!tagfs_listing_push(l, 0, name))
+				return false;
+		})
+	}
+	else
+	{
+		layout_dir_t *rdir = layout_opendir(context->dirfd, context->levels);
+		struct dirent *ent;
+
+		if(!rdir)
+			return false;
+
+		// iterate over existing real files
+		while((ent = layout_readdir(rdir)))
+		{
+			// filter out the .tagdb file
+			if(tdbFile(ent->d_name) || specialDir(ent->d_name))
+				continue;
+
+			tagdb_entry_t *entry = tdb_get(tdb, ent->d_name);
+
+			if(entry)
+			{
+				assert(entry->kind == TDB_FILE_ENTRY);
+
+				bitarr_t tags = tdb_tags(tdb, entry);
+
+				if(!tags)
+				{
+					layout_closedir(rdir);
+					return false;
+				}
+				if(!tagfs_node_match(dir, tags))
+					continue;
+				if(dirmask)
+					bitarr_eqor(dirmask, tdb->tagCap, tags);
+			}
+			else if(anyP)
+				continue;
+
+			if(!tagfs_listing_push(l, 0, ent->d_name))
+			{
+				layout_closedir(rdir);
+				return false;
+			}
+		}
+
+		layout_closedir(rdir);
+	}
+
+	return true;
+}
+
+/* The attributes of a window of real files in a listing */
+struct tagfs_window
+{
+	tagfs_context_t *context;
+	// The attributes of every file in the window
+	struct stat st[TAGFS_READDIR_WINDOW];
+	// Whether st is valid for a file
+	bool has[TAGFS_READDIR_WINDOW];
+	// The uncached files, by index in the window
+	bstat_t reqs[TAGFS_READDIR_WINDOW];
+	// The paths of the uncached files
+	char paths[TAGFS_READDIR_WINDOW][LAYOUT_PATH_MAX];
+	size_t idx[TAGFS_READDIR_WINDOW];
+	tagdb_entry_t *entries[TAGFS_READDIR_WINDOW];
+};
+
+/* bstat_run() callback that caches the retrieved attributes and stores them in the window. */
+static int tagfs_window_cb(void *_w, bstat_t *req)
+{
+	struct tagfs_window *w = _w;
+	size_t r = req - w->reqs;
+	size_t i = w->idx[r];
+
+	if((w->has[i] = !req->err))
+	{
+		tagfs_stx2stat(&req->stx, &w->st[i]);
+
+		if(w->entries[r])
+			tagfs_attr_store(w->context, w->entries[r], &w->st[i]);
+	}
+
+	return 0;
+}
+
+/* Retrieves the attributes of the real files in the listing from index start up to end.
+	Uses a single batch for every file without cached attributes.
+	Acquires a read lock. */
+static void tagfs_window_stat(struct tagfs_window *w, tagfs_listing_t *l, size_t start, size_t end)
+{
+	tagfs_context_t *context = w->context;
+	size_t n = 0;
+
+	assert(end - start <= TAGFS_READDIR_WINDOW);
+	pthread_rwlock_rdlock(&context->lock);
+
+	for (size_t i = start; i < end; i++)
+	{
+		const char *name = tagfs_listing_name(l, i);
+		tagdb_entry_t *e = tdb_get(context->tdb, name);
+
+		if(e && e->kind != TDB_FILE_ENTRY)
+			e = NULL;
+		if((w->has[i - start] = e && tagfs_attr_cached(context, e, &w->st[i - start])))
+			continue;
+
+		w->reqs[n] = (bstat_t){ .name = layout_path(context->levels, name, w->paths[n]) };
+		w->idx[n] = i - start;
+		w->entries[n++] = e;
+	}
+
+	bstat_run(context->dirfd, w->reqs, n, tagfs_window_cb, w, (n < TAGFS_BATCH_MIN) ? BSTAT_NOURING | BSTAT_NOTHREADS : 0);
+	pthread_rwlock_unlock(&context->lock);
+}
+
+#pragma endregion
+
+#pragma region Real directory watch
+
+/* Makes the tagdb agree with the real directory about the file with the given name.
+	Creates a file entry for an existing file and removes the file entry of a missing file. */
+static void tagfs_sync(tagfs_context_t *context, const char *name)
+{
+	if(tdbFile(name) || specialDir(name))
+		return;
+
+	tagfs_rsv_t rsv;
+	struct stat s;
+
+	// waits for changes made through tagfs to be finished
+	tagfs_reserve(context, &rsv, name, NULL);
+	bool exists = !fstatat(context->dirfd, REAL(name), &s, AT_SYMLINK_NOFOLLOW);
+
+	if(exists && S_ISDIR(s.st_mode))
+	{
+		tagfs_unreserve(context, &rsv);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&context->lock);
+	tagdb_entry_t *e = tdb_get(context->tdb, name);
+
+	if(exists && !e)
+	{
+		if(*name == TAGFS_NEG_CHAR)
+			fprintf(context->log, "Ignoring real file '%s': Leading '%c' is reserved for negating tags\n", name, TAGFS_NEG_CHAR);
+		else if(*name == '.' && tdb_get(context->tdb, name + 1))
+			fprintf(context->log, "Ignoring real file '%s': Conflicts with tag '%s'\n", name, name + 1);
+		else if(!tdb_ins(context->tdb, name, TDB_FILE_ENTRY))
+			fprintf(context->log, "Cannot create entry for real file '%s': %s\n", name, strerror(errno));
+		else
+			tagfs_inval_file(context, name, false, NULL, true, NULL);
+	}
+	else if(exists && e->kind == TDB_TAG_ENTRY)
+		fprintf(context->log, "Real file '%s' conflicts with existing tag\n", name);
+	else if(!exists && e && e->kind == TDB_FILE_ENTRY)
+	{
+		tagfs_inval_file(context, name, true, tdb_tags(context->tdb, e), false, NULL);
+		tdb_rmE(context->tdb, e);
+	}
+
+	if(!exists)
+		tagfs_node_unlinkFile(context, name);
+
+	pthread_rwlock_unlock(&context->lock);
+	tagfs_unreserve(context, &rsv);
+}
+
+/* Applies a rename of a real file that happened outside of tagfs, keeping the tags of the file. */
+static void tagfs_syncRename(tagfs_context_t *context, const char *from, const char *to)
+{
+	tagfs_rsv_t rsv;
+
+	tagfs_reserve(context, &rsv, from, to);
+	bool gone = faccessat(context->dirfd, REAL(from), F_OK, AT_SYMLINK_NOFOLLOW);
+	pthread_rwlock_wrlock(&context->lock);
+
+	tagdb_entry_t *e = gone ? tdb_get(context->tdb, from) : NULL;
+
+	if(e && e->kind != TDB_FILE_ENTRY)
+		e = NULL;
+
+	bool node = gone && tagfs_node_hasFile(context, from);
+
+	// a rename through tagfs has moved the entry and node before its events arrive, and they mustn't be touched again
+	if(e || node)
+	{
+		tagfs_inval_file(context, from, true, e ? tdb_tags(context->tdb, e) : NULL, false, NULL);
+		tagfs_inval_name(context, to, false);
+
+		if(e)
+		{
+			tagdb_entry_t *o = tdb_get(context->tdb, to);
+
+			if(o && o->kind == TDB_FILE_ENTRY)
+				tdb_rmE(context->tdb, o);
+
+			if(tdb_rename(context->tdb, e, to) == -1)
+				fprintf(context->log, "Cannot rename entry '%s' to '%s': %s\n", from, to, strerror(errno));
+		}
+
+		// keeps the inode of the file, while a replaced file loses its own either way
+		if(!node)
+			tagfs_node_unlinkFile(context, to);
+		else if(!tagfs_node_renameFile(context, from, to))
+			fprintf(context->log, "Cannot rename node '%s' to '%s': %s\n", from, to, strerror(errno));
+	}
+
+	pthread_rwlock_unlock(&context->lock);
+	tagfs_unreserve(context, &rsv);
+
+	tagfs_sync(context, from);
+	tagfs_sync(context, to);
+}
+
+/* Syncs every real file and every file entry with the tagdb.
+	Returns false and sets errno if the real directory can't be read. */
+static bool tagfs_rescan(tagfs_context_t *context)
+{
+	layout_dir_t *dir = layout_opendir(context->dirfd, context->levels);
+
+	if(!dir)
+		return false;
+
+	struct dirent *ent;
+
+	while((ent = layout_readdir(dir)))
+	{
+		if(ent->d_type != DT_DIR)
+			tagfs_sync(context, ent->d_name);
+	}
+
+	layout_closedir(dir);
+
+	// collect the names first since tagfs_sync() invalidates TDB_FORALL
+	size_t len = 0, cap = 64;
+	char **names = malloc(cap * sizeof(char*));
+
+	if(!names)
+		return false;
+
+	pthread_rwlock_rdlock(&context->lock);
+
+	TDB_FORALL(context->tdb, name, entry, {
+		if(entry->kind != TDB_FILE_ENTRY)
+			continue;
+
+		if(len == cap)
+		{
+			char **n = realloc(names, (cap *= 2) * sizeof(char*));
+
+			if(!n)
+				break;
+
+			names = n;
+		}
+
+		if(!(names[len] = strdup(name)))
+			break;
+
+		len++;
+	})
+
+	pthread_rwlock_unlock(&context->lock);
+
+	for (size_t i = 0; i < len; i++)
+	{
+		tagfs_sync(context, names[i]);
+		free(names[i]);
+	}
+
+	free(names);
+	return true;
+}
+
+/* Watches the directories containing real files, i.e. the real directory at the given path or every leaf subdirectory.
+	Returns false and sets errno on failure. */
+static bool tagfs_watch_add(tagfs_context_t *context, const char *path)
+{
+	const uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_ONLYDIR;
+
+	if(!context->levels)
+		return inotify_add_watch(context->watchfd, path, mask) >= 0;
+
+	size_t len = strlen(path);
+	char *buf = malloc(len + 1 + LAYOUT_PATH_MAX);
+
+	if(!buf)
+		return false;
+
+	memcpy(buf, path, len);
+	buf[len] = '/';
+
+	// events only carry the file name, which is all tagfs needs, so the watch descriptors aren't kept
+	for (size_t i = 0; i < layout_leaves(context->levels); i++)
+	{
+		layout_leaf(context->levels, i, buf + len + 1);
+
+		if(inotify_add_watch(context->watchfd, buf, mask) < 0)
+		{
+			free(buf);
+			return false;
+		}
+	}
+
+	free(buf);
+	return true;
+}
+
+/* Starts watching the real directory at the given path. It has to be listed afterwards, so no change goes unnoticed,
+	and listed set once the tagdb has an entry for every real file, see realdir_chk.
+	Returns false and sets errno on failure, in which case the real directory is read by every listing. */
+static bool tagfs_watch_init(tagfs_context_t *context, const char *path)
+{
+	context->listed = false;
+	context->watchfd = inotify_init1(IN_CLOEXEC);
+
+	if(context->watchfd < 0)
+		return false;
+
+	if(!tagfs_watch_add(context, path))
+	{
+		int eno = errno;
+		close(context->watchfd);
+		context->watchfd = -1;
+		errno = eno;
+
+		return false;
+	}
+
+	return true;
+}
+
+/* Thread function that applies changes to the real directory to the tagdb. */
+static void *tagfs_watch(void *_context)
+{
+	tagfs_context_t *context = _context;
+	char buf[sizeof(struct inotify_event) * 64 + NAME_MAX + 1] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	// pending MOVED_FROM event that wasn't followed by the matching MOVED_TO yet, and its name once the buffer is reused
+	const char *from = NULL;
+	char fromName[NAME_MAX + 1];
+	uint32_t fromCookie = 0;
+
+	for(;;)
+	{
+		// a rename within the real directory queues both events at once, but a read may end between them
+		if(from)
+		{
+			struct pollfd pfd = { .fd = context->watchfd, .events = POLLIN };
+
+			if(!poll(&pfd, 1, TAGFS_MOVE_WAIT))
+			{ // moved out of the real directory
+				pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+				tagfs_sync(context, from);
+				from = NULL;
+				pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			}
+		}
+
+		ssize_t len = read(context->watchfd, buf, sizeof(buf));
+
+		if(len <= 0)
+		{
+			if(len < 0 && errno == EINTR)
+				continue;
+
+			fprintf(context->log, "Lost watch on real directory: %s\n", len ? strerror(errno) : "EOF");
+			context->listed = false;
+			return NULL;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+		{
+			const struct inotify_event *ev = (struct inotify_event*)p;
+
+			if(ev->mask & IN_Q_OVERFLOW)
+			{
+				fprintf(context->log, "Watch queue overflowed; rescanning real directory\n");
+				tagfs_rescan(context);
+				from = NULL;
+				continue;
+			}
+			if(!ev->len)
+				continue;
+
+			if(ev->mask & IN_ISDIR)
+				continue;
+
+			if(from && (ev->mask & IN_MOVED_TO) && ev->cookie == fromCookie)
+			{
+				tagfs_syncRename(context, from, ev->name);
+				from = NULL;
+				continue;
+			}
+			if(from)
+			{ // moved out of the real directory
+				tagfs_sync(context, from);
+				from = NULL;
+			}
+
+			if(ev->mask & IN_MOVED_FROM)
+			{
+				from = ev->name;
+				fromCookie = ev->cookie;
+			}
+			else if(ev->mask & (IN_MODIFY | IN_ATTRIB))
+			{
+				tagfs_attr_dropName(context, ev->name);
+				tagfs_inval_attr(context, ev->name);
+			}
+			else
+				tagfs_sync(context, ev->name);
+		}
+
+		// the next read may start with the matching MOVED_TO
+		if(from && from != fromName)
+			from = strcpy(fromName, from);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+}
+
+#pragma endregion
+
+#pragma region Journal
+
+/* Writes the snapshot to a new tagdb file, which replaces the old one.
+	Returns false and sets errno on failure, in which case the old file is left as it was. */
+static bool tagfs_writeTdb(tagfs_context_t *context, tagdb_snapshot_t *s)
+{
+	int fd = openat(context->dirfd, ".tagdb.tmp", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	FILE *f = (fd < 0) ? NULL : fdopen(fd, "w+");
+
+	if(!f)
+	{
+		if(fd >= 0)
+			close(fd);
+
+		return false;
+	}
+
+	// the new file has to be complete before it replaces the old one
+	if(!tdb_writeSnapshot(s, f) || fsync(fd) || renameat(context->dirfd, ".tagdb.tmp", context->dirfd, ".tagdb") || fsync(context->dirfd))
+	{
+		int eno = errno;
+		fclose(f);
+		unlinkat(context->dirfd, ".tagdb.tmp", 0);
+		errno = eno;
+		return false;
+	}
+
+	// only the checkpointer and tagfs_compact replace it, which never run at the same time
+	fclose(TDB->file);
+	TDB->file = f;
+
+	return true;
+}
+
+/* Writes the tagdb to a new tagdb file with a new ID, which makes every journal stale, and empties the journal.
+	Only used before mounting, while nothing else accesses the tagdb. Returns false and sets errno on failure. */
+static bool tagfs_compact(tagfs_context_t *context)
+{
+	TDB->id++;
+
+	tagdb_snapshot_t *s = tdb_snapshot(TDB);
+	bool ok = s && tagfs_writeTdb(context, s) && journal_reset(TDB->journal, TDB->id);
+	int eno = errno;
+
+	tdb_freeSnapshot(s);
+
+	if(ok && unlinkat(context->dirfd, ".tagdb.journal.old", 0) && errno != ENOENT)
+		ok = false;
+	else
+		errno = eno;
+
+	return ok;
+}
+
+/* Continues the journal in a new file and takes a snapshot of the tagdb as it is at the switch.
+	The old journal is kept as .tagdb.journal.old, until the snapshot is written. Requires a read lock on the tagdb,
+	so nothing is logged meanwhile. Returns NULL and sets errno on failure. */
+static tagdb_snapshot_t *tagfs_rotate(tagfs_context_t *context)
+{
+	int fd = openat(context->dirfd, ".tagdb.journal.tmp", O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	int eno;
+
+	if(fd < 0)
+		return NULL;
+
+	// the old journal ends with the new ID, so the new file is replayed after it
+	if(!tdb_nextId(TDB) || renameat(context->dirfd, ".tagdb.journal", context->dirfd, ".tagdb.journal.old"))
+		goto err;
+	// a missing or empty journal is created with the ID reached by replaying the old one
+	if(renameat(context->dirfd, ".tagdb.journal.tmp", context->dirfd, ".tagdb.journal") || fsync(context->dirfd))
+		goto undo;
+
+	int old = journal_switch(TDB->journal, fd, TDB->id);
+
+	if(old < 0)
+		goto undo;
+
+	close(old);
+
+	tagdb_snapshot_t *s = tdb_snapshot(TDB);
+
+	// the old journal is still needed, but the new one is in use already
+	if(!s)
+		lprintf("Cannot take a snapshot of the tagdb: %s\n", strerror(errno));
+
+	return s;
+
+	undo:
+	eno = errno;
+
+	// the journal still writes to the old file, which has to be found by its name
+	if(renameat(context->dirfd, ".tagdb.journal.old", context->dirfd, ".tagdb.journal"))
+		lprintf("Cannot restore the journal: %s\n", strerror(errno));
+
+	errno = eno;
+	err:
+	eno = errno;
+	close(fd);
+	unlinkat(context->dirfd, ".tagdb.journal.tmp", 0);
+	errno = eno;
+
+	return NULL;
+}
+
+/* Writes a snapshot of the tagdb to a new tagdb file, which replaces the old one, so the journal can start over.
+	The tagdb is only locked while the snapshot is taken, not while it's written.
+	Returns false and sets errno on failure. */
+static bool tagfs_checkpoint(tagfs_context_t *context)
+{
+	// a snapshot that couldn't be written is the only one the old journal may be dropped for
+	if(!context->pending)
+	{
+		lock_r();
+		context->pending = tagfs_rotate(context);
+		unlock();
+
+		if(!context->pending)
+			return false;
+	}
+
+	if(!tagfs_writeTdb(context, context->pending))
+		return false;
+
+	tdb_freeSnapshot(context->pending);
+	context->pending = NULL;
+
+	return !unlinkat(context->dirfd, ".tagdb.journal.old", 0) || errno == ENOENT;
+}
+
+/* Writes checkpoints whenever the tagdb changed for a while, or once the journal is too large */
+static void *tagfs_checkpointer(void *_context)
+{
+	tagfs_context_t *context = _context;
+
+	pthread_mutex_lock(&context->checkpointLock);
+
+	while(context->checkpointing)
+	{
+		struct timespec t;
+
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_sec += TAGFS_CHECKPOINT_INTERVAL;
+
+		while(context->checkpointing && !context->checkpointNow && pthread_cond_timedwait(&context->checkpointCond, &context->checkpointLock, &t) != ETIMEDOUT);
+
+		if(!context->checkpointing)
+			break;
+
+		context->checkpointNow = false;
+		pthread_mutex_unlock(&context->checkpointLock);
+
+		if((context->pending || journal_size(TDB->journal) > JOURNAL_HDR_SIZE) && !tagfs_checkpoint(context))
+			lprintf("Cannot write a checkpoint of the tagdb: %s\n", strerror(errno));
+
+		pthread_mutex_lock(&context->checkpointLock);
+	}
+
+	pthread_mutex_unlock(&context->checkpointLock);
+
+	return NULL;
+}
+
+/* Makes every change logged to the journal so far durable, which has to happen before the change is acknowledged.
+	Has a checkpoint written once the journal has grown too large.
+	Call without a lock on the tagdb, so the changes of other requests are synced along. Returns false and sets errno on failure. */
+static bool tagfs_commit(tagfs_context_t *context)
+{
+	if(!journal_sync(TDB->journal))
+		return false;
+
+	if(journal_size(TDB->journal) >= TAGFS_JOURNAL_MAX)
+	{
+		pthread_mutex_lock(&context->checkpointLock);
+		context->checkpointNow = true;
+		pthread_cond_signal(&context->checkpointCond);
+		pthread_mutex_unlock(&context->checkpointLock);
+	}
+
+	return true;
+}
+
+#pragma endregion
+
+#pragma region Control socket
+
+/* Makes room for len more bytes in the buffer. Returns false on malloc failure. */
+static bool tagfs_ctlbuf_reserve(tagfs_ctlbuf_t *b, size_t len)
+{
+	if(b->len + len <= b->cap)
+		return true;
+
+	size_t cap = b->cap ? b->cap * 2 : 65536;
+
+	while(cap < b->len + len)
+		cap *= 2;
+
+	char *d = realloc(b->data, cap);
+
+	if(!d)
+		return false;
+
+	b->data = d;
+	b->cap = cap;
+
+	return true;
+}
+
+/* Appends the reply to a request, with the given errno and len bytes of NUL terminated names. Returns false on malloc failure. */
+static bool tagfs_ctl_reply(tagfs_ctlbuf_t *out, int err, const char *names, size_t len)
+{
+	uint32_t rlen = sizeof(int32_t) + len;
+	int32_t e = err;
+
+	if(!tagfs_ctlbuf_reserve(out, sizeof(rlen) + rlen))
+		return false;
+
+	memcpy(out->data + out->len, &rlen, sizeof(rlen));
+	memcpy(out->data + out->len + sizeof(rlen), &e, sizeof(e));
+
+	if(len)
+		memcpy(out->data + out->len + sizeof(rlen) + sizeof(e), names, len);
+
+	out->len += sizeof(rlen) + rlen;
+
+	return true;
+}
+
+/* Replies with the errno of a failed request, naming what failed if failed isn't NULL. Returns false on malloc failure. */
+static bool tagfs_ctl_fail(tagfs_ctlbuf_t *out, int err, const char *failed)
+{
+	return tagfs_ctl_reply(out, err, failed, failed ? strlen(failed) + 1 : 0);
+}
+
+/* Sets dir up as the query directory of the path, resolving its names like looking them up one after another would.
+	The node isn't indexed, and its pos and neg have to be freed even on failure. Changes path. Requires at least a read lock on the tagdb.
+	Returns false and sets errno on failure, pointing failed at the name that can't be found, if any. */
+static bool tagfs_ctl_path(tagfs_context_t *context, char *path, tagfs_node_t *dir, const char **failed)
+{
+	char *save;
+
+	*dir = (tagfs_node_t){ .kind = TDB_TAG_ENTRY, .pos = bitarr_new(TDB->tagCap), .neg = bitarr_new(TDB->tagCap), .cap = TDB->tagCap };
+	*failed = NULL;
+
+	if(!dir->pos || !dir->neg)
+	{
+		errno = ENOMEM;
+		return false;
+	}
+
+	for (char *name = strtok_r(path, "/", &save); name; name = strtok_r(NULL, "/", &save))
+	{
+		tagdb_entry_t *tag = tagfs_get(context, name, TFS_TAG | TFS_CHKDOT | TFS_CHKNEG);
+
+		*failed = name;
+
+		if(!tag)
+			return false;
+		// a query directory doesn't contain the tags of its query
+		if(tagfs_node_has(dir, dir->pos, tag->tagId) || tagfs_node_has(dir, dir->neg, tag->tagId))
+		{
+			errno = ENOENT;
+			return false;
+		}
+
+		// tag names can't start with TAGFS_NEG_CHAR
+		bitarr_set((*name == TAGFS_NEG_CHAR) ? dir->neg : dir->pos, tag->tagId, true);
+	}
+
+	*failed = NULL;
+	return true;
+}
+
+/* Replies with the real files in the query directory of the path, see TAGFS_CTL_QUERY.
+	Requires at least a read lock on the tagdb. Returns false on malloc failure of the reply. */
+static bool tagfs_ctl_query(tagfs_context_t *context, char *path, tagfs_ctlbuf_t *out)
+{
+	tagfs_node_t dir;
+	tagfs_listing_t l = { 0 };
+	const char *failed;
+	bool ok;
+
+	if(!tagfs_ctl_path(context, path, &dir, &failed) || !tagfs_node_files(context, &dir, NULL, &l))
+		ok = tagfs_ctl_fail(out, errno, failed);
+	else
+		ok = tagfs_ctl_reply(out, 0, l.names, l.namesLen);
+
+	free(dir.pos);
+	free(dir.neg);
+	free(l.names);
+	free(l.offs);
+
+	return ok;
+}
+
+/* Whether the name may be that of a real file named in a request */
+static inline bool tagfs_ctl_fileName(const char *name)
+{
+	return *name && *name != TAGFS_NEG_CHAR && !strchr(name, '/');
+}
+
+/* Returns the number of files named by a tag request on len bytes of names, or 0 if it's malformed, see tagfs_ctl_run */
+static size_t tagfs_ctl_files(const char *names, size_t len)
+{
+	size_t n = 0;
+
+	if(!len || names[len - 1])
+		return 0;
+
+	for (const char *f = names + strlen(names) + 1; f < names + len; f += strlen(f) + 1)
+		n++;
+
+	return n;
+}
+
+/* Returns the number of names a request of the given kind on len bytes of names may create or tag as real files,
+	which are the files of a tag request and the tags of a mktag request, or 0 if it's malformed */
+static size_t tagfs_ctl_checked(tagfs_ctlkind_t kind, const char *names, size_t len)
+{
+	size_t n = 0;
+
+	if(kind == TAGFS_CTL_TAG)
+		return tagfs_ctl_files(names, len);
+	if(kind != TAGFS_CTL_MKTAG || !len || names[len - 1])
+		return 0;
+
+	for (const char *t = names; t < names + len; t += strlen(t) + 1)
+		n++;
+
+	return n;
+}
+
+/* Collects the names checked by the requests of a batch, see tagfs_ctl_checked, in the order of the requests,
+	so they can be reserved and looked up in the real directory without a lock on the tagdb.
+	Grows names, and exists along with it, as needed. Returns the number of names, or -1 on malloc failure. */
+static ssize_t tagfs_ctl_names(const char *data, size_t count, const char ***names, bool **exists, size_t *cap)
+{
+	size_t k = 0;
+
+	for (size_t i = 0, at = 0; i < count; i++)
+	{
+		uint32_t len;
+
+		memcpy(&len, data + at, sizeof(len));
+
+		tagfs_ctlkind_t kind = (unsigned char)data[at + sizeof(len)];
+		const char *n = data + at + sizeof(len) + 1;
+		size_t checked = tagfs_ctl_checked(kind, n, len - 1);
+
+		at += sizeof(len) + len;
+
+		if(!checked)
+			continue;
+
+		if(k + checked > *cap)
+		{
+			size_t c = *cap ? *cap : 4096;
+
+			while(c < k + checked)
+				c *= 2;
+
+			const char **nn = realloc(*names, c * sizeof(char*));
+
+			if(nn)
+				*names = nn;
+
+			bool *e = nn ? realloc(*exists, c * sizeof(bool)) : NULL;
+
+			if(!e)
+				return -1;
+
+			*exists = e;
+			*cap = c;
+		}
+
+		// the path of a tag request comes first
+		if(kind == TAGFS_CTL_TAG)
+			n += strlen(n) + 1;
+
+		for (; checked--; n += strlen(n) + 1)
+			(*names)[k++] = n;
+	}
+
+	return k;
+}
+
+/* Tags the files following the path in names with the tags of its query directory, see TAGFS_CTL_TAG.
+	exists flags which of the files are in the real directory, see tagfs_ctl_access, or is NULL while every one has an entry.
+	Requires a write lock on the tagdb. Returns false on malloc failure of the reply. */
+static bool tagfs_ctl_tag(tagfs_context_t *context, char *names, size_t len, const bool *exists, tagfs_ctlbuf_t *out)
+{
+	tagdb_t *tdb = TDB;
+	char *files = names + strlen(names) + 1, *end = names + len;
+	tagfs_node_t dir;
+	const char *failed;
+	bitarr_t old = NULL;
+	size_t i = 0;
+
+	if(!tagfs_ctl_path(context, names, &dir, &failed))
+		goto done;
+
+	bool anyP = bitarr_any(dir.pos, dir.cap, true);
+
+	// nothing changes unless every file can be found
+	for (char *f = files; f < end; f += strlen(f) + 1, i++)
+	{
+		failed = f;
+
+		if(!tagfs_ctl_fileName(f))
+		{
+			errno = EINVAL;
+			goto done;
+		}
+		if(!tagfs_get(context, f, TFS_FILE) && (errno != ENOENT || !exists || !exists[i]))
+			goto done;
+	}
+
+	failed = NULL;
+
+	if(!(old = bitarr_new(tdb->tagCap)))
+		goto done;
+
+	// nor unless the tags of every file can be set up. An entry without tags for a real file doesn't change what's seen.
+	for (char *f = files; f < end; f += strlen(f) + 1)
+	{
+		tagdb_entry_t *e = tdb_get(tdb, f);
+
+		// a real file without entry has no tags to remove
+		if((!e && anyP && !(e = tdb_ins(tdb, f, TDB_FILE_ENTRY))) || (e && !tdb_tags(tdb, e)))
+		{
+			failed = f;
+			goto done;
+		}
+	}
+
+	// inserting entries may have moved the others
+	for (char *f = files; f < end; f += strlen(f) + 1)
+	{
+		tagdb_entry_t *e = tdb_get(tdb, f);
+		bitarr_t tags = e ? tdb_tags(tdb, e) : NULL;
+
+		if(!e || tagfs_node_match(&dir, tags))
+			continue;
+
+		bitarr_copy(old, tdb->tagCap, tags);
+		bitarr_merge(tags, dir.cap, dir.pos, dir.neg);
+		tdb_changed(tdb, e);
+		tagfs_inval_file(context, f, true, old, true, tags);
+	}
+
+	errno = 0;
+
+	done:;
+	int eno = errno;
+
+	free(dir.pos);
+	free(dir.neg);
+	free(old);
+
+	return eno ? tagfs_ctl_fail(out, eno, failed) : tagfs_ctl_reply(out, 0, NULL, 0);
+}
+
+/* Creates the tags named in names that don't exist yet, see TAGFS_CTL_MKTAG.
+	exists flags which of the names are taken by real files without entry, or is NULL while every one has an entry.
+	Requires a write lock on the tagdb. Returns false on malloc failure of the reply. */
+static bool tagfs_ctl_mktag(tagfs_context_t *context, char *names, size_t len, const bool *exists, tagfs_ctlbuf_t *out)
+{
+	char *end = names + len;
+	size_t i = 0;
+
+	// nothing is created unless every name can be used, by the rules of mkdir
+	for (char *n = names; n < end; n += strlen(n) + 1, i++)
+	{
+		tagdb_entry_t *e = tdb_get(TDB, n);
+
+		if(e && e->kind == TDB_TAG_ENTRY)
+			continue;
+		if(!tagfs_ctl_fileName(n))
+			return tagfs_ctl_fail(out, EINVAL, n);
+		if((exists && exists[i]) || tagfs_get(context, n, TFS_ANY | TFS_CHKDOT) || tdbFile(n) || specialDir(n))
+			return tagfs_ctl_fail(out, EEXIST, n);
+	}
+
+	for (char *n = names; n < end; n += strlen(n) + 1)
+	{
+		if(tdb_get(TDB, n))
+			continue;
+		if(!tdb_ins(TDB, n, TDB_TAG_ENTRY))
+			return tagfs_ctl_fail(out, errno, n);
+
+		tagfs_inval_name(context, n, true);
+	}
+
+	return tagfs_ctl_reply(out, 0, NULL, 0);
+}
+
+/* Runs a request of the given kind on len bytes of names and appends its reply. exists is passed to tagfs_ctl_tag or tagfs_ctl_mktag.
+	Requires a read lock on the tagdb for queries and a write lock otherwise. Returns false on malloc failure of the reply. */
+static bool tagfs_ctl_run(tagfs_context_t *context, tagfs_ctlkind_t kind, char *names, size_t len, const bool *exists, tagfs_ctlbuf_t *out)
+{
+	// every name is terminated, and the path of a query or of tagging comes first
+	if((len && names[len - 1]) || (!len && kind != TAGFS_CTL_MKTAG))
+		return tagfs_ctl_fail(out, EINVAL, NULL);
+
+	switch(kind)
+	{
+		case TAGFS_CTL_QUERY:
+			if(strlen(names) + 1 != len)
+				return tagfs_ctl_fail(out, EINVAL, NULL);
+
+			return tagfs_ctl_query(context, names, out);
+
+		case TAGFS_CTL_TAG:
+			return tagfs_ctl_tag(context, names, len, exists, out);
+
+		case TAGFS_CTL_MKTAG:
+			return tagfs_ctl_mktag(context, names, len, exists, out);
+
+		default:
+			return tagfs_ctl_fail(out, EINVAL, NULL);
+	}
+}
+
+/* Writes len bytes to the socket. Returns false on failure, e.g. once the connection is closed. */
+static bool tagfs_ctl_send(int fd, const char *p, size_t len)
+{
+	while(len)
+	{
+		ssize_t w = send(fd, p, len, MSG_NOSIGNAL);
+
+		if(w < 0 && errno == EINTR)
+			continue;
+		if(w <= 0)
+			return false;
+
+		p += w;
+		len -= w;
+	}
+
+	return true;
+}
+
+/* Thread function that serves a connection to the control socket until it's closed, or a request is malformed.
+	Runs every complete request received so far at once, under one lock, and makes their changes durable together. */
+static void *tagfs_ctl_serve(void *_conn)
+{
+	tagfs_conn_t *conn = _conn;
+	tagfs_context_t *context = conn->context;
+	tagfs_ctlbuf_t in = { 0 }, out = { 0 };
+	// the offsets of the replies to changes in out, which fail if the changes can't be made durable
+	size_t changed[TAGFS_CTL_BATCH];
+	// the names a batch may create or tag as real files, see tagfs_ctl_names, and whether they exist
+	const char **checked = NULL;
+	bool *exists = NULL;
+	size_t checkedCap = 0;
+
+	for(;;)
+	{
+		size_t off = 0, count = 0, changes = 0;
+		uint32_t len = 0;
+
+		while(count < TAGFS_CTL_BATCH && in.len - off >= sizeof(len))
+		{
+			memcpy(&len, in.data + off, sizeof(len));
+
+			if(!len || len > TAGFS_CTL_MAX)
+				goto done;
+			if(in.len - off - sizeof(len) < len)
+				break;
+
+			changes += in.data[off + sizeof(len)] != TAGFS_CTL_QUERY;
+			off += sizeof(len) + len;
+			count++;
+		}
+
+		if(!count)
+		{
+			// room for the rest of the first request, and for the ones pipelined after it
+			if(!tagfs_ctlbuf_reserve(&in, (in.len >= sizeof(len) ? sizeof(len) + len - in.len : 0) + 65536))
+				goto done;
+
+			ssize_t r = read(conn->fd, in.data + in.len, in.cap - in.len);
+
+			if(r < 0 && errno == EINTR)
+				continue;
+			if(r <= 0)
+				goto done;
+
+			in.len += r;
+			continue;
+		}
+
+		// while watching, every real file has an entry. Otherwise they're looked up before the lock, so no other request waits for it.
+		bool listed = context->listed;
+		ssize_t checks = changes ? tagfs_ctl_names(in.data, count, &checked, &exists, &checkedCap) : 0;
+		tagfs_rsv_t rsv;
+
+		if(checks < 0)
+			goto done;
+
+		// no real file can be created with the names through tagfs until the changes are durable
+		if(changes)
+			tagfs_reserveAll(context, &rsv, checked, checks);
+
+		for (ssize_t k = 0; !listed && k < checks; k++)
+			exists[k] = tagfs_ctl_fileName(checked[k]) && tagfs_realExists(context, checked[k]);
+
+		if(changes)
+			lock_w();
+		else
+			lock_r();
+
+		for (size_t i = 0, at = 0, c = 0, k = 0; i < count; i++)
+		{
+			memcpy(&len, in.data + at, sizeof(len));
+
+			tagfs_ctlkind_t kind = (unsigned char)in.data[at + sizeof(len)];
+			char *names = in.data + at + sizeof(len) + 1;
+			// counted before the path is split up
+			size_t n = tagfs_ctl_checked(kind, names, len - 1);
+
+			if(kind != TAGFS_CTL_QUERY)
+				changed[c++] = out.len;
+
+			if(!tagfs_ctl_run(context, kind, names, len - 1, (listed || !n) ? NULL : exists + k, &out))
+			{
+				unlock();
+
+				if(changes)
+					tagfs_unreserve(context, &rsv);
+
+				goto done;
+			}
+
+			k += n;
+			at += sizeof(len) + len;
+		}
+
+		unlock();
+
+		// changes are only acknowledged once they're durable
+		if(changes && !tagfs_commit(context))
+		{
+			int32_t err = errno, e;
+
+			for (size_t c = 0; c < changes; c++)
+			{
+				memcpy(&e, out.data + changed[c] + sizeof(uint32_t), sizeof(e));
+
+				if(!e)
+					memcpy(out.data + changed[c] + sizeof(uint32_t), &err, sizeof(err));
+			}
+		}
+
+		if(changes)
+			tagfs_unreserve(context, &rsv);
+
+		if(!tagfs_ctl_send(conn->fd, out.data, out.len))
+			goto done;
+
+		out.len = 0;
+		memmove(in.data, in.data + off, in.len - off);
+		in.len -= off;
+	}
+
+	done:
+	pthread_mutex_lock(&context->ctlLock);
+
+	for (tagfs_conn_t **p = &context->conns; *p; p = &(*p)->next)
+	{
+		if(*p == conn)
+		{
+			*p = conn->next;
+			break;
+		}
+	}
+
+	close(conn->fd);
+	pthread_cond_broadcast(&context->ctlCond);
+	pthread_mutex_unlock(&context->ctlLock);
+
+	free(in.data);
+	free(out.data);
+	free(checked);
+	free(exists);
+	free(conn);
+
+	return NULL;
+}
+
+/* Thread function that accepts connections to the control socket, and starts a thread serving each one. */
+static void *tagfs_ctl_accept(void *_context)
+{
+	tagfs_context_t *context = _context;
+
+	for(;;)
+	{
+		int fd = accept4(context->ctlfd, NULL, NULL, SOCK_CLOEXEC);
+
+		if(fd < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// out of descriptors or memory for now
+			if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+			{
+				sleep(1);
+				continue;
+			}
+
+			int eno = errno;
+
+			pthread_mutex_lock(&context->ctlLock);
+			bool open = context->ctlOpen;
+			pthread_mutex_unlock(&context->ctlLock);
+
+			// tagfs_ctl_close shuts the socket down
+			if(open)
+				lprintf("Cannot accept connections to the control socket: %s\n", strerror(eno));
+
+			return NULL;
+		}
+
+		tagfs_conn_t *conn = malloc(sizeof(tagfs_conn_t));
+		pthread_t thread;
+
+		pthread_mutex_lock(&context->ctlLock);
+
+		if(!context->ctlOpen || !conn)
+		{
+			bool open = context->ctlOpen;
+
+			pthread_mutex_unlock(&context->ctlLock);
+			close(fd);
+			free(conn);
+
+			if(!open)
+				return NULL;
+
+			continue;
+		}
+
+		*conn = (tagfs_conn_t){ .fd = fd, .next = context->conns, .context = context };
+
+		// the thread removes the connection from the list once it's done, which needs the lock held here
+		if((errno = pthread_create(&thread, NULL, tagfs_ctl_serve, conn)))
+		{
+			lprintf("Cannot serve a connection to the control socket: %s\n", strerror(errno));
+			close(fd);
+			free(conn);
+		}
+		else
+		{
+			context->conns = conn;
+			pthread_detach(thread);
+		}
+
+		pthread_mutex_unlock(&context->ctlLock);
+	}
+}
+
+/* Creates the control socket at path, which replaces a socket at path that's left over from a crash.
+	Connections are accepted once tagfs_init starts tagfs_ctl_accept. Returns false and sets errno on failure. */
+static bool tagfs_ctl_open(tagfs_context_t *context, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char *abs = NULL;
+	int fd = -1;
+
+	// fuse changes the working directory when it forks into the background
+	if(*path == '/')
+		abs = strdup(path);
+	else
+	{
+		char *cwd = getcwd(NULL, 0);
+
+		if(cwd && asprintf(&abs, "%s/%s", cwd, path) < 0)
+			abs = NULL;
+
+		free(cwd);
+	}
+
+	if(!abs)
+		return false;
+	if(strlen(abs) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		goto err;
+	}
+
+	strcpy(addr.sun_path, abs);
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		goto err;
+
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)))
+	{
+		if(errno != EADDRINUSE)
+			goto err;
+
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		// nothing listens on a socket left over from a crash
+		bool stale = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) && errno == ECONNREFUSED;
+
+		if(probe >= 0)
+			close(probe);
+
+		errno = EADDRINUSE;
+
+		if(!stale || unlink(abs) || bind(fd, (struct sockaddr*)&addr, sizeof(addr)))
+			goto err;
+	}
+
+	// only the user running tagfs may connect, which is settled before anyone can
+	if(chmod(abs, S_IRUSR | S_IWUSR) || listen(fd, SOMAXCONN))
+	{
+		int eno = errno;
+		unlink(abs);
+		errno = eno;
+		goto err;
+	}
+
+	context->ctlfd = fd;
+	context->ctlPath = abs;
+
+	return true;
+
+	err:;
+	int eno = errno;
+
+	if(fd >= 0)
+		close(fd);
+
+	free(abs);
+	errno = eno;
+
+	return false;
+}
+
+/* Stops accepting connections to the control socket, closes every connection once its requests are answered, and removes the socket. */
+static void tagfs_ctl_close(tagfs_context_t *context)
+{
+	pthread_mutex_lock(&context->ctlLock);
+
+	bool accepting = context->ctlOpen;
+
+	context->ctlOpen = false;
+	// wakes up the threads waiting for connections and requests
+	shutdown(context->ctlfd, SHUT_RDWR);
+
+	for (tagfs_conn_t *c = context->conns; c; c = c->next)
+		shutdown(c->fd, SHUT_RDWR);
+
+	pthread_mutex_unlock(&context->ctlLock);
+
+	if(accepting)
+		pthread_join(context->ctlAcceptor, NULL);
+
+	pthread_mutex_lock(&context->ctlLock);
+
+	while(context->conns)
+		pthread_cond_wait(&context->ctlCond, &context->ctlLock);
+
+	pthread_mutex_unlock(&context->ctlLock);
+
+	close(context->ctlfd);
+	unlink(context->ctlPath);
+	free(context->ctlPath);
+	context->ctlfd = -1;
+	context->ctlPath = NULL;
+}
+
+#pragma endregion
+
+#pragma region Replies
+
+/* Retrieves the attributes of the given node. Requires at least a read lock on the tagdb.
+	Returns false and sets errno on failure. */
+static bool tagfs_node_stat(tagfs_context_t *context, tagfs_node_t *n, struct stat *st)
+{
+	if(n->kind == TDB_TAG_ENTRY)
+	{
+		// TODO: proper access times
+		*st = context->realStat;
+		// every query directory is a different directory
+		st->st_ino = tagfs_node_ino(context, n);
+		return true;
+	}
+
+	tagdb_entry_t *e = tdb_get(TDB, n->name);
+
+	return tagfs_attr(context, (e && e->kind == TDB_FILE_ENTRY) ? e : NULL, n->name, st);
+}
+
+/* Marks the cached attributes of the given file node as stale. Acquires a read lock. */
+static void tagfs_node_dropAttr(tagfs_context_t *context, tagfs_node_t *n)
+{
+	if(!context->attrTTL)
+		return;
+
+	lock_r();
+	tagfs_attr_drop(context, tdb_get(TDB, n->name));
+	unlock();
+}
+
+/* Writes the names of the tags of the given file node to buf, each followed by a '/'.
+	Only determines the length of the tag list if size is 0. Acquires a read lock.
+	Returns the length of the tag list, or -1 and sets errno if it doesn't fit into size. */
+static ssize_t tagfs_node_tags(tagfs_context_t *context, tagfs_node_t *n, char *buf, size_t size)
+{
+	size_t pos = 0;
+
+	lock_r();
+	tagdb_entry_t *e = tdb_get(TDB, n->name);
+
+	if(e && e->kind == TDB_FILE_ENTRY)
+	{
+		TDB_FILE_FORALL(TDB, e, tagname, tag, {
+			size_t len = strlen(tagname);
+
+			if(size)
+			{
+				if(pos + len >= size)
+				{
+					unlock();
+					errno = ERANGE;
+					return -1;
+				}
+
+				memcpy(buf + pos, tagname, len);
+				buf[pos + len] = '/';
+			}
+
+			pos += len + 1;
+		})
+	}
+
+	unlock();
+	return pos;
+}
+
+/* Replies to a request that creates a directory entry with the given node.
+	Takes over the lookup reference of the node. Requires at least a read lock on the tagdb. */
+static void tagfs_reply_entry(fuse_req_t req, tagfs_context_t *context, tagfs_node_t *n)
+{
+	struct fuse_entry_param e = {
+		.ino = tagfs_node_ino(context, n),
+		.attr_timeout = context->timeout,
+		.entry_timeout = context->timeout,
+	};
+
+	if(!tagfs_node_stat(context, n, &e.attr))
+	{
+		int eno = errno;
+		tagfs_node_forget(context, n, 1);
+		fuse_reply_err(req, eno);
+	}
+	// the kernel won't forget a node it never received
+	else if(fuse_reply_entry(req, &e))
+		tagfs_node_forget(context, n, 1);
+}
+
+/* Commits the change that created the node, then replies with it like tagfs_reply_entry. Requires no lock on the tagdb. */
+static void tagfs_reply_created(fuse_req_t req, tagfs_context_t *context, tagfs_node_t *n)
+{
+	if(!tagfs_commit(context))
+	{
+		int eno = errno;
+		tagfs_node_forget(context, n, 1);
+		fuse_reply_err(req, eno);
+		return;
+	}
+
+	lock_r();
+	tagfs_reply_entry(req, context, n);
+	unlock();
+}
+
+#pragma endregion
+
+#pragma endregion
+
+#pragma region Implementation
+
+void tagfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("LOOKUP: %s\n", name);
+	tagfs_node_t *dir = tagfs_node(context, parent), *n = NULL;
+	tagdb_entry_t *entry = NULL;
+
+	lock_r();
+
+	switch(tagfs_resolve(context, dir, name, &entry))
+	{
+		case TDB_TAG_ENTRY:
+			n = tagfs_node_lookupDir(context, dir, name, entry);
+		break;
+
+		case TDB_FILE_ENTRY:
+			n = tagfs_node_file(context, name);
+		break;
+
+		default: break;
+	}
+
+	if(n)
+		tagfs_reply_entry(req, context, n);
+	else if(errno == ENOENT && tagfs_notifying(context))
+	{ // the kernel remembers that there is no such entry
+		struct fuse_entry_param e = { .ino = 0, .entry_timeout = context->timeout };
+		fuse_reply_entry(req, &e);
+	}
+	else
+		fuse_reply_err(req, errno);
+
+	unlock();
+}
+
+void tagfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	tagfs_node_forget(context, tagfs_node(context, ino), nlookup);
+	fuse_reply_none(req);
+}
+
+void tagfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("OPENDIR: %ju\n", (uintmax_t)ino);
+	#define ERR(eno) { errno = eno; goto err; }
+	errno = 0;
+	tagdb_t *tdb = context->tdb;
+	tagfs_node_t *dir = tagfs_node(context, ino);
+	tagfs_listing_t *l = calloc(1, sizeof(tagfs_listing_t));
+
+	lock_r();
+
+	// Contains all tags that have at least one listed file
+	bitarr_t dirmask = bitarr_new(tdb->tagCap);
+
+	if(!l || !dirmask)
+		ERR(ENOMEM)
+
+	if(!tagfs_node_isDir(context, dir))
+		goto err;
+
+	if(!tagfs_node_files(context, dir, dirmask, l))
+		goto err;
+
+	l->files = l->len;
+
+	if(!tagfs_listing_push(l, 0, ".") || !tagfs_listing_push(l, 0, ".."))
+		goto err;
+
+	TDB_FORALL(tdb, name, entry, {
+		if(entry->kind == TDB_TAG_ENTRY && !tagfs_node_has(dir, dir->pos, entry->tagId) && !tagfs_node_has(dir, dir->neg, entry->tagId)
+			&& bitarr_get(dirmask, entry->tagId) && !tagfs_listing_push(l, 0, name))
+			goto err;
+	})
+
+	l->tags = l->len - l->files;
+
+	TDB_FORALL(tdb, name, entry, {
+		if(entry->kind != TDB_TAG_ENTRY)
+			continue;
+		if(tagfs_node_has(dir, dir->pos, entry->tagId) || tagfs_node_has(dir, dir->neg, entry->tagId))
+			continue;
+		// put the tag as a dotfile
+		if(!bitarr_get(dirmask, entry->tagId) && !tagfs_listing_push(l, '.', name))
+			goto err;
+
+		#ifdef LIST_NEGATED_TAGS
+		if(!tagfs_listing_push(l, TAGFS_NEG_CHAR, name))
+			goto err;
+		#endif
+	})
+
+	err:
+	unlock();
+
+	free(dirmask);
+
+	if(errno)
+	{
+		tagfs_listing_free(l);
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	fi->fh = (uintptr_t)l;
+
+	// the request was interrupted
+	if(fuse_reply_open(req, fi))
+		tagfs_listing_free(l);
+
+	#undef ERR
+}
+
+void tagfs_readdir(fuse_req_t req, UNUSED fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("READDIR: %ju @%jd\n", (uintmax_t)ino, (intmax_t)offset);
+	tagfs_listing_t *l = (tagfs_listing_t*)(uintptr_t)fi->fh;
+	struct tagfs_window *w = NULL;
+	char *buf = malloc(size);
+	size_t pos = 0;
+
+	if(!buf)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	// the offset of every name is its index + 1
+	for (size_t i = offset; i < l->len;)
+	{
+		size_t start = i;
+		size_t end = (l->len - i < TAGFS_READDIR_WINDOW) ? l->len : i + TAGFS_READDIR_WINDOW;
+
+		// every entry takes at least 32 bytes, don't stat files that can't fit
+		if(end - i > (size - pos) / 32 + 1)
+			end = i + (size - pos) / 32 + 1;
+
+		if(start < l->files)
+		{
+			if(!w && !(w = malloc(sizeof(struct tagfs_window))))
+			{
+				free(buf);
+				fuse_reply_err(req, ENOMEM);
+				return;
+			}
+
+			w->context = context;
+			tagfs_window_stat(w, l, start, (end < l->files) ? end : l->files);
+		}
+
+		for (; i < end; i++)
+		{
+			struct stat st = (i < l->files) ? (w->has[i - start] ? w->st[i - start] : (struct stat){})
+				: (i < l->files + l->tags) ? context->realStat
+				: (struct stat){};
+			size_t len = fuse_add_direntry(req, buf + pos, size - pos, tagfs_listing_name(l, i), &st, i + 1);
+
+			// the buffer is full
+			if(len > size - pos)
+				goto full;
+
+			pos += len;
+		}
+	}
+
+	full:
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+	free(w);
+}
+
+void tagfs_releasedir(fuse_req_t req, UNUSED fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	UNUSED tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("RELEASEDIR: %ju\n", (uintmax_t)ino);
+	tagfs_listing_free((tagfs_listing_t*)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+void tagfs_getattr(fuse_req_t req, fuse_ino_t ino, UNUSED struct fuse_file_info *fi)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("GETATTR: %ju\n", (uintmax_t)ino);
+	struct stat st;
+
+	lock_r();
+	bool ok = tagfs_node_stat(context, tagfs_node(context, ino), &st);
+	int eno = errno;
+	unlock();
+
+	dbprintf("GETATTR exits with %d (%s)\n", ok ? 0 : eno, strerror(ok ? 0 : eno));
+
+	if(ok)
+		fuse_reply_attr(req, &st, context->timeout);
+	else
+		fuse_reply_err(req, eno);
+}
+
+void tagfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("SETATTR: %ju %x\n", (uintmax_t)ino, to_set);
+	tagfs_node_t *n = tagfs_node(context, ino);
+	const int times = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+	struct stat st;
+	bool ok = false;
+
+	if(n->kind != TDB_FILE_ENTRY)
+	{
+		fuse_reply_err(req, (to_set & FUSE_SET_ATTR_SIZE) ? EISDIR : ENOTSUP);
+		return;
+	}
+	// the kernel sets ctime itself
+	if(to_set & ~(FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_CTIME | times))
+	{
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	// keeps the name from changing
+	lock_r();
+
+	if(to_set & FUSE_SET_ATTR_SIZE)
+	{
+		int fd = fi ? TAGFS_FILE(fi)->fd : openat(context->dirfd, REAL(n->name), O_WRONLY | O_CLOEXEC);
+
+		if(fd < 0)
+			goto done;
+
+		int r = ftruncate(fd, attr->st_size);
+		int eno = errno;
+
+		if(!fi)
+			close(fd);
+		if(r)
+		{
+			errno = eno;
+			goto done;
+		}
+	}
+
+	if(to_set & times)
+	{
+		struct timespec tv[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_nsec = UTIME_OMIT } };
+
+		if(to_set & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if(to_set & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+
+		if(to_set & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if(to_set & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+
+		if(utimensat(context->dirfd, REAL(n->name), tv, AT_SYMLINK_NOFOLLOW))
+			goto done;
+	}
+
+	tagfs_attr_drop(context, tdb_get(TDB, n->name));
+	ok = tagfs_node_stat(context, n, &st);
+
+	done:;
+	int eno = errno;
+	unlock();
+
+	if(ok)
+		fuse_reply_attr(req, &st, context->timeout);
+	else
+		fuse_reply_err(req, eno);
+}
+
+void tagfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t dev)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("MKNOD: %s\n", name);
+	tagfs_node_t *dir = tagfs_node(context, parent);
+	tagdb_entry_t *e = NULL;
+	tagfs_rsv_t rsv;
+	int eno = 0;
+
+	tagfs_reserve(context, &rsv, name, NULL);
+	lock_r();
+	errno = 0;
+
+	if(!tagfs_node_isDir(context, dir))
+		eno = errno;
+	else if(tagfs_get(context, name, TFS_CHKALL) || !errno || tdbFile(name) || specialDir(name))
+		eno = EEXIST;
+	else if(name[0] == TAGFS_NEG_CHAR)
+		eno = EINVAL;
+
+	unlock();
+
+	if(!eno && mknodat(context->dirfd, REAL(name), mode, dev))
+		eno = errno;
+	if(eno)
+		goto done;
+
+	lock_w();
+
+	// directory contains a query, unless it was removed in the meantime
+	bool tagged = tagfs_node_isDir(context, dir) && bitarr_any(dir->pos, dir->cap, true);
+
+	// while watching, lookups only find files without an entry once the watcher saw them
+	if(tagged || context->listed)
+	{
+		if(!(e = tdb_ins(TDB, name, TDB_FILE_ENTRY)) || (tagged && !tdb_tags(TDB, e)))
+		{
+			eno = errno;
+			unlock();
+			unlinkat(context->dirfd, REAL(name), 0);
+			goto done;
+		}
+
+		if(tagged)
+		{
+			bitarr_copy(tdb_tags(TDB, e), dir->cap, dir->pos);
+			tdb_changed(TDB, e);
+		}
+	}
+
+	tagfs_inval_file(context, name, false, NULL, true, e ? tdb_tags(TDB, e) : NULL);
+	tagfs_node_t *n = tagfs_node_file(context, name);
+
+	eno = n ? 0 : errno;
+	unlock();
+
+	if(n)
+		tagfs_reply_created(req, context, n);
+	else
+		fuse_reply_err(req, eno);
+
+	tagfs_unreserve(context, &rsv);
+	return;
+
+	done:
+	tagfs_unreserve(context, &rsv);
+	fuse_reply_err(req, eno);
+}
+
+void tagfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("MKDIR: %s\n", name);
+	tagfs_node_t *dir = tagfs_node(context, parent);
 
-		default:
-			unlock();
-		return -errno;
+	#ifdef BLOCK_TRASH_CREATION
+		if(parent == FUSE_ROOT_ID && !strncmp(name, ".Trash", 6))
+		{
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+	#endif
+
+	if((mode & context->realStat.st_mode & 0777) != (mode & 0777))
+	{
+		#define octal(n) ((n & 0700) >> 6), ((n & 070) >> 3), (n & 07)
+		dbprintf("Refusing mkdir() with mode %d%d%d, which is incompatible with root mode %d%d%d\n",
+										octal(mode),							octal(context->realStat.st_mode));
+		#undef octal
+		fuse_reply_err(req, ENOTSUP);
+		return;
 	}
+
+	tagfs_rsv_t rsv;
+	int eno = 0;
+
+	// no real file can be created with the name until the tag exists
+	tagfs_reserve(context, &rsv, name, NULL);
+	bool real = tagfs_realExists(context, name);
+	lock_w();
+
+	if(!tagfs_node_isDir(context, dir))
+		eno = errno;
+	else if(real || tagfs_get(context, name, TFS_ANY | TFS_CHKDOT) || tdbFile(name) || specialDir(name))
+		eno = EEXIST;
+	else if(name[0] == TAGFS_NEG_CHAR)
+		eno = EINVAL;
+
+	tagdb_entry_t *newEntry = eno ? NULL : tdb_ins(TDB, name, TDB_TAG_ENTRY);
+
+	if(newEntry)
+		tagfs_inval_name(context, name, true);
+
+	tagfs_node_t *n = newEntry ? tagfs_node_lookupDir(context, dir, name, newEntry) : NULL;
+
+	if(!eno)
+		eno = errno;
+
+	unlock();
+	tagfs_unreserve(context, &rsv);
+
+	if(n)
+		tagfs_reply_created(req, context, n);
+	else
+		fuse_reply_err(req, eno);
 }
 
-int tagfs_setxattr(const char *path, const char *key, const char *value, size_t size, int flags)
+void tagfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	dbprintf("SETXATTR	%s	%s\n", path, key);
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("OPEN: %ju\n", (uintmax_t)ino);
+	tagfs_node_t *n = tagfs_node(context, ino);
 
-	switch(tagfs_resolveL(path, NULL, NULL))
+	if(n->kind != TDB_FILE_ENTRY)
 	{
-		case TDB_TAG_ENTRY:
-			return fsetxattr(CONTEXT->dirfd, key, value, size, flags) ? -errno : 0;
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
 
-		case TDB_FILE_ENTRY:
-			return -EOPNOTSUPP;
+	int flags = fi->flags;
 
-		default:
-			return -errno;
+	if(context->writeback)
+	{ // the kernel reads from files opened for writing to fill its cache and appends by itself
+		if((flags & O_ACCMODE) == O_WRONLY)
+			flags = (flags & ~O_ACCMODE) | O_RDWR;
+
+		flags &= ~O_APPEND;
+	}
+
+	lock_r();
+	tagfs_fd_t *shared = tagfs_fd_open(context, n, flags);
+	int eno = errno;
+
+	if(shared && (fi->flags & O_TRUNC))
+		tagfs_attr_drop(context, tdb_get(TDB, n->name));
+
+	unlock();
+
+	if(!shared)
+	{
+		fuse_reply_err(req, eno);
+		return;
+	}
+
+	tagfs_file_t *file = malloc(sizeof(tagfs_file_t));
+
+	if(!file)
+	{
+		tagfs_fd_release(context, shared);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	int fd = shared->fd;
+
+	*file = (tagfs_file_t){ .fd = fd, .shared = shared };
+	fi->fh = (uintptr_t)file;
+
+#if FUSE_CAP_PASSTHROUGH
+	if(__atomic_load_n(&context->passthrough, __ATOMIC_RELAXED))
+	{
+		file->backingId = fuse_passthrough_open(req, fd);
+
+		if(file->backingId > 0)
+			fi->backing_id = file->backingId;
+		else
+		{
+			file->backingId = 0;
+
+			// registering needs CAP_SYS_ADMIN, so if it fails once it fails for every file
+			if(__atomic_exchange_n(&context->passthrough, false, __ATOMIC_RELAXED))
+			{
+				lprintf("Passthrough failed, reading and writing through tagfs instead: %s\n", strerror(errno));
+				lflush();
+			}
+		}
+	}
+#endif
+
+	// the request was interrupted
+	if(fuse_reply_open(req, fi))
+	{
+		if(file->backingId > 0)
+			fuse_passthrough_close(req, file->backingId);
+
+		tagfs_fd_release(context, shared);
+		free(file);
 	}
 }
 
-int tagfs_listxattr(const char *path, char *buf, size_t len)
+void tagfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("RELEASE: %ju\n", (uintmax_t)ino);
+	tagfs_file_t *file = TAGFS_FILE(fi);
 
-	switch(tagfs_resolveL(path, NULL, NULL))
+	if(file->backingId > 0)
 	{
-		case TDB_TAG_ENTRY:;
-			int l = flistxattr(CONTEXT->dirfd, buf, len);
-		return (l == -1) ? -errno : l;
+		fuse_passthrough_close(req, file->backingId);
 
-		case TDB_FILE_ENTRY:;
-			const char aname[] = "user.tags";
+		// writes went straight to the real file
+		if(fi->flags & O_ACCMODE)
+			tagfs_node_dropAttr(context, tagfs_node(context, ino));
+	}
 
-			if(len)
-			{
-				if(len < sizeof(aname))
-					return -ERANGE;
+	tagfs_fd_release(context, file->shared);
+	free(file);
+	fuse_reply_err(req, 0);
+}
 
-				memcpy(buf, aname, sizeof(aname));
-			}
+void tagfs_read(fuse_req_t req, UNUSED fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+
+	// libfuse splices straight from the real file into /dev/fuse
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = TAGFS_FILE(fi)->fd;
+	buf.buf[0].pos = offset;
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
 
-		return sizeof(aname);
+void tagfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in, off_t offset, struct fuse_file_info *fi)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	struct fuse_bufvec out = FUSE_BUFVEC_INIT(fuse_buf_size(in));
+
+	out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	out.buf[0].fd = TAGFS_FILE(fi)->fd;
+	out.buf[0].pos = offset;
 
-		default: return -errno;
+	// in is spliced from /dev/fuse if the kernel supports it, otherwise it's in memory
+	ssize_t w = fuse_buf_copy(&out, in, FUSE_BUF_SPLICE_MOVE);
+
+	if(w < 0)
+	{
+		fuse_reply_err(req, -w);
+		return;
 	}
+	if(w > 0)
+		tagfs_node_dropAttr(context, tagfs_node(context, ino));
+
+	fuse_reply_write(req, w);
 }
 
-int tagfs_truncate(const char *_path, off_t len)
+void tagfs_fsync(fuse_req_t req, UNUSED fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
 {
-	dbprintf("TRUNCATE: %s\n", _path);
-	const char *fname;
-	tagdb_entrykind_t kind = tagfs_resolveL(_path, NULL, &fname);
+	UNUSED tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("FSYNC: %ju\n", (uintmax_t)ino);
+	fuse_reply_err(req, (datasync ? fdatasync : fsync)(TAGFS_FILE(fi)->fd) ? errno : 0);
+}
 
-	if(!kind)
-		return -errno;
-	if(kind != TDB_FILE_ENTRY)
-		return -EISDIR;
+void tagfs_copy_file_range(fuse_req_t req, UNUSED fuse_ino_t inoIn, off_t offIn, struct fuse_file_info *fiIn,
+	fuse_ino_t inoOut, off_t offOut, struct fuse_file_info *fiOut, size_t len, int flags)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("COPY_FILE_RANGE: %ju -> %ju, %zu bytes\n", (uintmax_t)inoIn, (uintmax_t)inoOut, len);
 
-	int fd = openat(CONTEXT->dirfd, fname, O_WRONLY);
+	// the backing filesystem may share extents instead of copying data
+	ssize_t w = copy_file_range(TAGFS_FILE(fiIn)->fd, &offIn, TAGFS_FILE(fiOut)->fd, &offOut, len, flags);
 
-	if(fd == -1)
-		return -errno;
+	if(w < 0)
+	{
+		fuse_reply_err(req, errno);
+		return;
+	}
+	if(w > 0)
+		tagfs_node_dropAttr(context, tagfs_node(context, inoOut));
 
-	errno = 0;
-	ftruncate(fd, len);
-	close(fd);
+	fuse_reply_write(req, w);
+}
+
+void tagfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("FALLOCATE: %ju, mode %d\n", (uintmax_t)ino, mode);
+
+	if(fallocate(TAGFS_FILE(fi)->fd, mode, offset, length))
+	{
+		fuse_reply_err(req, errno);
+		return;
+	}
 
-	return -errno;
+	tagfs_node_dropAttr(context, tagfs_node(context, ino));
+	fuse_reply_err(req, 0);
 }
 
-int tagfs_unlink(const char *_path)
+void tagfs_lseek(fuse_req_t req, UNUSED fuse_ino_t ino, off_t offset, int whence, struct fuse_file_info *fi)
 {
-	dbprintf("UNLINK: %s\n", _path);
-	tagdb_entry_t *entry = NULL;
-	const char *fname;
-	lock_w();
-	tagdb_entrykind_t kind = tagfs_resolve(_path, &entry, &fname);
+	UNUSED tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("LSEEK: %ju, %jd whence %d\n", (uintmax_t)ino, (intmax_t)offset, whence);
+
+	// reads and writes don't use the file position, so only the result matters
+	off_t r = lseek(TAGFS_FILE(fi)->fd, offset, whence);
+
+	if(r < 0)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_lseek(req, r);
+}
+
+void tagfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *key, size_t size)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("GETXATTR: %ju %s %zu\n", (uintmax_t)ino, key, size);
+	tagfs_node_t *n = tagfs_node(context, ino);
+	char *value = size ? malloc(size) : NULL;
+	ssize_t len;
+
+	if(size && !value)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if(n->kind == TDB_TAG_ENTRY)
+	{
+		len = fgetxattr(context->dirfd, key, value, size);
+		dbprintf("getxattr on root dir: %d %s\n", errno, strerror(errno));
+	}
+	// TODO: wrap getxattr for real files (there is no getxattrat())
+	else if(strcmp(key, "user.tags"))
+	{
+		len = -1;
+		errno = ENODATA;
+	}
+	else
+		len = tagfs_node_tags(context, n, value, size);
+
+	if(len < 0)
+		fuse_reply_err(req, errno);
+	else if(size)
+		fuse_reply_buf(req, value, len);
+	else
+		fuse_reply_xattr(req, len);
+
+	free(value);
+}
+
+void tagfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *key, const char *value, size_t size, int flags)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("SETXATTR	%ju	%s\n", (uintmax_t)ino, key);
+
+	if(tagfs_node(context, ino)->kind == TDB_TAG_ENTRY)
+		fuse_reply_err(req, fsetxattr(context->dirfd, key, value, size, flags) ? errno : 0);
+	else
+		fuse_reply_err(req, EOPNOTSUPP);
+}
+
+void tagfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+
+	if(tagfs_node(context, ino)->kind == TDB_TAG_ENTRY)
+	{
+		char *buf = size ? malloc(size) : NULL;
+		ssize_t l = (size && !buf) ? (errno = ENOMEM, -1) : flistxattr(context->dirfd, buf, size);
+
+		if(l < 0)
+			fuse_reply_err(req, errno);
+		else if(size)
+			fuse_reply_buf(req, buf, l);
+		else
+			fuse_reply_xattr(req, l);
+
+		free(buf);
+		return;
+	}
+
+	const char aname[] = "user.tags";
+
+	if(!size)
+		fuse_reply_xattr(req, sizeof(aname));
+	else if(size < sizeof(aname))
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, aname, sizeof(aname));
+}
+
+void tagfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("UNLINK: %s\n", name);
+	tagfs_rsv_t rsv;
+	int eno = 0;
+
+	tagfs_reserve(context, &rsv, name, NULL);
+	lock_r();
+	tagdb_entrykind_t kind = tagfs_resolve(context, tagfs_node(context, parent), name, NULL);
 
 	if(!kind)
-		RET_REL(-errno);
-	if(entry)
-		tdb_rmE(TDB, entry);
+		eno = errno;
+	else if(kind != TDB_FILE_ENTRY)
+		eno = EISDIR;
 
 	unlock();
 
-	if((kind == TDB_FILE_ENTRY) && unlinkat(CONTEXT->dirfd, fname, 0))
-		return -errno;
+	if(!eno && unlinkat(context->dirfd, REAL(name), 0))
+		eno = errno;
 
-	return 0;
+	if(!eno)
+	{
+		lock_w();
+		tagdb_entry_t *entry = tdb_get(TDB, name);
+
+		// a tag may have taken the name after the file was gone
+		if(entry && entry->kind != TDB_FILE_ENTRY)
+			entry = NULL;
+
+		tagfs_inval_file(context, name, true, entry ? tdb_tags(TDB, entry) : NULL, false, NULL);
+
+		if(entry)
+			tdb_rmE(TDB, entry);
+
+		tagfs_node_unlinkFile(context, name);
+		unlock();
+
+		if(!tagfs_commit(context))
+			eno = errno;
+	}
+
+	tagfs_unreserve(context, &rsv);
+	fuse_reply_err(req, eno);
 }
 
-int tagfs_rmdir(const char *_path)
+void tagfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	dbprintf("RMDIR: %s\n", _path);
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("RMDIR: %s\n", name);
 	tagdb_entry_t *entry = NULL;
-	const char *fname;
+
 	lock_w();
-	tagdb_entrykind_t kind = tagfs_resolve(_path, &entry, &fname);
+	tagdb_entrykind_t kind = tagfs_resolve(context, tagfs_node(context, parent), name, &entry);
 
 	if(!kind)
-		RET_REL(-errno);
+		ERR_REL(errno)
 	if(kind != TDB_TAG_ENTRY)
-		RET_REL(-ENOTDIR);
-	if(entry)
-		tdb_rmE(TDB, entry);
+		ERR_REL(ENOTDIR)
+
+	size_t tagId = entry->tagId;
+	tagfs_inval_name(context, tdb_entryName(entry), true);
+	tdb_rmE(TDB, entry);
+	// the tag ID may be reused by the next mkdir
+	tagfs_node_unlinkTag(context, tagId);
 
 	unlock();
-	return 0;
+	fuse_reply_err(req, tagfs_commit(context) ? 0 : errno);
 }
 
-int tagfs_rename(const char *path, const char *npath)
+/* Checks whether name in dir can be renamed to newname in ndir. Requires at least a read lock on the tagdb.
+	Returns the kind of entry to rename and sets entry if there is one. Returns TDB_EMPTY_ENTRY and sets errno on failure. */
+static tagdb_entrykind_t tagfs_rename_check(tagfs_context_t *context, tagfs_node_t *dir, const char *name, tagfs_node_t *ndir,
+	const char *newname, unsigned int flags, tagdb_entry_t **entry)
 {
-	dbprintf("RENAME: %s -> %s\n", path, npath);
-	#define ERR(eno) { errno = eno; goto err; }
-	errno = 0;
+	tagdb_entrykind_t kind = tagfs_resolve(context, dir, name, entry);
+
+	if(!kind || !tagfs_node_isDir(context, ndir))
+		return TDB_EMPTY_ENTRY;
+	if(!strcmp(newname, name))
+		return kind;
+
+	// the kernel only checks the target directory, which may not show an existing file
+	if(flags & RENAME_NOREPLACE)
+	{
+		errno = 0;
+
+		if(tagfs_get(context, newname, TFS_CHKALL) || !errno)
+		{
+			errno = EEXIST;
+			return TDB_EMPTY_ENTRY;
+		}
+	}
+
+	// a file may replace another one, but a tag is never replaced and never replaces a file
+	tagdb_entry_t *e = tagfs_get(context, newname, TFS_ANY | TFS_CHKDOT);
+
+	if(e && (e->kind == TDB_TAG_ENTRY || kind == TDB_TAG_ENTRY))
+		errno = (kind == TDB_FILE_ENTRY) ? EISDIR : EEXIST;
+	else if(tdbFile(newname) || specialDir(newname))
+		errno = EEXIST;
+	else if(newname[0] == TAGFS_NEG_CHAR)
+		errno = EINVAL;
+	else
+		return kind;
+
+	return TDB_EMPTY_ENTRY;
+}
+
+void tagfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	tagfs_context_t *context = fuse_req_userdata(req);
+	dbprintf("RENAME: %s -> %s\n", name, newname);
+	// the real file is renamed back if the tagdb can't follow it
+	#define UNDO(eno) { errno = eno; if(real) goto undo; goto err; }
+	tagfs_node_t *dir = tagfs_node(context, parent), *ndir = tagfs_node(context, newparent);
 	tagdb_entry_t *entry = NULL;
-	const char *ofname;
+	tagdb_t *tdb = TDB;
+	// The tags of the file before renaming it, allocated beforehand along with those of its entry
+	bitarr_t old = NULL;
+	size_t oldCap = 0;
+	bool moved = strcmp(newname, name);
+	tagfs_rsv_t rsv;
+
+	// exchanging two files would have to exchange their tags as well
+	if(flags & ~RENAME_NOREPLACE)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	tagfs_reserve(context, &rsv, name, newname);
+	lock_r();
+	tagdb_entrykind_t kind = tagfs_rename_check(context, dir, name, ndir, newname, flags, &entry);
+	// only renaming a real file touches the disk
+	bool real = moved && kind == TDB_FILE_ENTRY;
+
+	// setting up tags is safe for readers
+	if(kind == TDB_FILE_ENTRY && (!(old = bitarr_new(oldCap = tdb->tagCap)) || (entry && !tdb_tags(tdb, entry))))
+	{
+		kind = TDB_EMPTY_ENTRY;
+		errno = ENOMEM;
+	}
+
+	unlock();
+
+	if(!kind || (real && renameat2(context->dirfd, REAL(name), context->dirfd, REAL(newname), flags)))
+		goto done;
 
 	lock_w();
 
-	tagdb_entrykind_t kind = tagfs_resolve(path, &entry, &ofname);
-	tagdb_t *tdb = TDB;
+	if(real)
+	{
+		// the replaced file is gone along with its tags, whether or not the renamed one has an entry
+		tagdb_entry_t *o = tdb_get(tdb, newname);
 
-	if(!kind)
-		RET_REL(-errno);
+		// a tag created since the check can't be replaced
+		if(o && o->kind != TDB_FILE_ENTRY)
+			UNDO(EISDIR)
+		if(o)
+			tdb_rmE(tdb, o);
 
-	const char *nfname;
-	char *query = split(npath, &nfname);
-	bitarr_t pos = bitarr_new(tdb->tagCap);
-	bitarr_t neg = bitarr_new(tdb->tagCap);
+		// so is its inode, even if the renamed file has no node to take its place
+		tagfs_node_unlinkFile(context, newname);
 
-	if(!query || !pos || !neg)
-		goto err;
-	if(!tagfs_query(query, pos, neg))
+		// entries move when others are inserted
+		entry = tdb_get(tdb, name);
+
+		// a tag may have taken the name after the file was gone
+		if(entry && entry->kind != TDB_FILE_ENTRY)
+			entry = NULL;
+	}
+	// tags aren't reserved, so they may have changed in the meantime
+	else if(!(kind = tagfs_rename_check(context, dir, name, ndir, newname, flags, &entry)))
 		goto err;
 
+	bool had = entry;
+
 	if(kind == TDB_FILE_ENTRY)
 	{
-		tagdb_entry_t *e = entry;
-
-		if(!e && bitarr_any(pos, tdb->tagCap, true))
+		// tags created meanwhile may have grown every tag set
+		if(tdb->tagCap > oldCap)
 		{
-			e = tdb_ins(tdb, nfname, TDB_FILE_ENTRY);
+			bitarr_t b = bitarr_resize(old, oldCap, tdb->tagCap);
 
-			if(!e)
-				goto err;
+			if(!b)
+				UNDO(ENOMEM)
+
+			old = b;
+		}
+
+		bitarr_t tags = entry ? tdb_tags(tdb, entry) : NULL;
+
+		if(entry && !tags)
+			UNDO(ENOMEM)
+		if(tags)
+			bitarr_copy(old, tdb->tagCap, tags);
+	}
+
+	if(moved && entry)
+	{
+		if(kind == TDB_TAG_ENTRY)
+		{
+			tagfs_inval_name(context, tdb_entryName(entry), true);
+			tagfs_inval_name(context, newname, true);
 		}
 
+		tagfs_attr_drop(context, entry);
+
+		// the check rules out every name taken by another entry, but memory may run out
+		int r = tdb_rename(tdb, entry, newname);
+
+		if(r)
+			UNDO((r > 0) ? EEXIST : ENOMEM)
+
+		entry = tdb_get(tdb, newname);
+	}
+
+	// the target directory may have been removed while renaming the real file
+	if(kind == TDB_FILE_ENTRY && tagfs_node_isDir(context, ndir))
+	{
+		tagdb_entry_t *e = entry;
+
+		if(!e && bitarr_any(ndir->pos, ndir->cap, true) && !(e = tdb_ins(tdb, newname, TDB_FILE_ENTRY)))
+			UNDO(errno)
+
 		if(e)
 		{
+			// set up above for the renamed entry, and from the start for a new one
+			bitarr_t tags = tdb_tags(tdb, e);
+
 		#ifdef RELATIVE_RENAME
-			if(bitarr_all(pos, tdb->tagCap, false) && bitarr_all(neg, tdb->tagCap, false))
-				bitarr_fill(e->fileTags, 0, tdb->tagCap, false);
+			if(ndir == &context->root)
+				bitarr_fill(tags, 0, tdb->tagCap, false);
 			else
-				bitarr_merge(e->fileTags, tdb->tagCap, pos, neg);
+				bitarr_merge(tags, ndir->cap, ndir->pos, ndir->neg);
 		#else
-			bitarr_copy(e->fileTags, tdb->tagCap, pos);
+			bitarr_fill(tags, 0, tdb->tagCap, false);
+			bitarr_copy(tags, ndir->cap, ndir->pos);
 		#endif
+			tdb_changed(tdb, e);
 		}
 	}
 
-	if(strcmp(nfname, ofname))
+	// keeps the inode of the file
+	if(moved && kind == TDB_FILE_ENTRY)
+		tagfs_node_renameFile(context, name, newname);
+
+	if(kind == TDB_FILE_ENTRY)
 	{
-		if(kind == TDB_FILE_ENTRY && renameat(CONTEXT->dirfd, ofname, CONTEXT->dirfd, nfname))
-			goto err;
-		if(entry && tdb_rename(tdb, entry, nfname))
-			goto err;
+		tagdb_entry_t *ne = tdb_get(tdb, newname);
+
+		tagfs_inval_file(context, name, true, had ? old : NULL, !moved, (ne && ne->kind == TDB_FILE_ENTRY) ? tdb_tags(tdb, ne) : NULL);
+
+		if(moved)
+			tagfs_inval_name(context, newname, false);
 	}
 
+	errno = 0;
+	goto err;
+
+	undo:;
+	int ueno = errno;
+
+	if(renameat2(context->dirfd, REAL(newname), context->dirfd, REAL(name), RENAME_NOREPLACE))
+		lprintf("Cannot rename real file '%s' back to '%s': %s\n", newname, name, strerror(errno));
+
+	// a file replaced by the rename is gone nonetheless
+	tagfs_inval_name(context, newname, false);
+	errno = ueno;
+
 	err:
 	unlock();
-	free(query);
-	free(pos);
-	free(neg);
+	done:;
+	int eno = errno;
 
-	return -errno;
-	#undef ERR
+	// an aborted rename may still have changed tags
+	if(!tagfs_commit(context) && !eno)
+		eno = errno;
+
+	tagfs_unreserve(context, &rsv);
+	free(old);
+	fuse_reply_err(req, eno);
+	#undef UNDO
 }
 
-void *tagfs_init(struct fuse_conn_info *conn)
+void tagfs_init(void *_context, struct fuse_conn_info *conn)
 {
+	tagfs_context_t *context = _context;
 	char tbuf[201];
 	time_t t = time(NULL);
 	struct tm lt;
@@ -920,21 +3893,80 @@ void *tagfs_init(struct fuse_conn_info *conn)
 	if(!strftime(tbuf, 200, "%c", &lt)) // the locale is weird or empty, use a fallback
 		strftime(tbuf, 200, "%F %T", &lt); // this will fail by the year 10^185, be sure to fix it by then
 
-	long pos = ftell(CONTEXT->log);
+	long pos = ftell(context->log);
 
 	if(pos && pos != -1)
 	{ // print a separator for easier browsing of the log file
 		for (int i = 0; i < 80; i++)
-			fputc('=', CONTEXT->log);
+			fputc('=', context->log);
 
-		fputc('\n', CONTEXT->log);
+		fputc('\n', context->log);
 	}
 
 	lprintf("tagfs started at %s\nFuse protovol V%u.%u\n", tbuf, conn->proto_major, conn->proto_minor);
+
+	// defaults, overridden by mount options
+	conn->max_write = TAGFS_MAX_WRITE;
+
+	// moves file data between /dev/fuse and real files without copying it
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	// the kernel doesn't cache writes to files it passes through
+	if(context->passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH))
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+	else if(conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+
+	fuse_apply_conn_info_opts(context->connOpts, conn);
+
+	// -o writeback_cache wins
+	if(conn->want & FUSE_CAP_WRITEBACK_CACHE)
+		conn->want &= ~FUSE_CAP_PASSTHROUGH;
+
+	context->writeback = conn->want & FUSE_CAP_WRITEBACK_CACHE;
+	context->passthrough = FUSE_CAP_PASSTHROUGH && (conn->want & FUSE_CAP_PASSTHROUGH);
+	lprintf("max_write: %u, max_readahead: %u, writeback cache: %s, passthrough: %s, splice read/write: %s/%s\n", conn->max_write,
+		conn->max_readahead, context->writeback ? "on" : "off", context->passthrough ? "on" : "off",
+		(conn->want & FUSE_CAP_SPLICE_READ) ? "on" : "off", (conn->want & FUSE_CAP_SPLICE_WRITE) ? "on" : "off");
+
+	// the watcher has to be started after fuse forks into the background
+	if(context->watchfd >= 0 && (errno = pthread_create(&context->watcher, NULL, tagfs_watch, context)))
+	{
+		lprintf("Cannot start watching the real directory: %s\n", strerror(errno));
+		close(context->watchfd);
+		context->watchfd = -1;
+		context->listed = false;
+	}
+
+	context->notifying = true;
+
+	if((errno = pthread_create(&context->notifier, NULL, tagfs_notify, context)))
+	{
+		lprintf("Cannot start sending invalidations, the kernel may show stale entries: %s\n", strerror(errno));
+		context->notifying = false;
+	}
+
+	if(context->ctlfd >= 0)
+	{
+		context->ctlOpen = true;
+
+		if((errno = pthread_create(&context->ctlAcceptor, NULL, tagfs_ctl_accept, context)))
+		{
+			lprintf("Cannot accept connections to the control socket: %s\n", strerror(errno));
+			context->ctlOpen = false;
+		}
+	}
+
+	context->checkpointing = true;
+
+	if((errno = pthread_create(&context->checkpointer, NULL, tagfs_checkpointer, context)))
+	{
+		lprintf("Cannot start writing checkpoints, changes stay in the journal until the next mount: %s\n", strerror(errno));
+		context->checkpointing = false;
+	}
+
 	dbprintf("Debugging printouts enabled.\n");
 	lflush();
-
-	return CONTEXT;
 }
 
 void tagfs_destroy(void *_context)
@@ -943,14 +3975,65 @@ void tagfs_destroy(void *_context)
 
 	fprintf(c->log, "tagfs exiting.\n");
 
-	tdb_flush(c->tdb, c->log);
+	// requests on the control socket may change the tagdb until they're answered
+	if(c->ctlfd >= 0)
+		tagfs_ctl_close(c);
+
+	if(c->watchfd >= 0)
+	{
+		pthread_cancel(c->watcher);
+		pthread_join(c->watcher, NULL);
+	}
+
+	if(c->notifying)
+	{
+		pthread_mutex_lock(&c->invalLock);
+		c->notifying = false;
+		pthread_cond_signal(&c->invalCond);
+		pthread_mutex_unlock(&c->invalLock);
+		pthread_join(c->notifier, NULL);
+	}
+
+	if(c->attrTTL)
+	{
+		unsigned long total = c->attrHits + c->attrMisses;
+		fprintf(c->log, "Attribute cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+			c->attrHits, c->attrMisses, total ? 100.0 * c->attrHits / total : 0.0);
+	}
+
+	if(c->fdCap)
+	{
+		unsigned long total = c->fdHits + c->fdMisses;
+		fprintf(c->log, "fd cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+			c->fdHits, c->fdMisses, total ? 100.0 * c->fdHits / total : 0.0);
+	}
+
+	pthread_mutex_lock(&c->checkpointLock);
+	bool checkpointing = c->checkpointing;
+	c->checkpointing = false;
+	pthread_cond_signal(&c->checkpointCond);
+	pthread_mutex_unlock(&c->checkpointLock);
+
+	// a checkpoint being written is finished, but no other one is started
+	if(checkpointing)
+		pthread_join(c->checkpointer, NULL);
+
+	// the journal it was taken from is kept, so it's written on the next mount
+	tdb_freeSnapshot(c->pending);
+
+	tagfs_fd_clear(c);
+
+	// every change is in the journal already
+	if(!journal_sync(c->tdb->journal))
+		fprintf(c->log, "Cannot sync the journal: %s\n", strerror(errno));
+
 	fflush(c->log);
 
 
 //	fclose(c->log);
-//	closedir(c->dir);
+//	close(c->dirfd);
 //	tdb_destroy(c->tdb);
 //	free(c);
 }
 
-#pragma endregion
\ No newline at end of file
+#pragma endregion
@@ -0,0 +1,203 @@
+// unit testing, in C
+#include "tagfs.h"
+#include "realdir.h"
+#include "test.h"
+#include <stdio.h>
+#include <string.h>
+
+static char dirpath[32];
+static tagfs_context_t ctx;
+// the error of the last reply
+static int replied;
+
+/* Requests are answered here instead of through libfuse */
+void *fuse_req_userdata(UNUSED fuse_req_t req)
+{
+	return &ctx;
+}
+
+int fuse_reply_err(UNUSED fuse_req_t req, int err)
+{
+	replied = err;
+	return 0;
+}
+
+/* Prepares the context the way a mount does, for a real directory holding the given files, all tagged with tag */
+static void setup(const char **files, size_t count, const char *tag)
+{
+	strcpy(dirpath, "/tmp/tagfs_testXXXXXX");
+
+	if(!mkdtemp(dirpath))
+		faile();
+
+	ctx = (tagfs_context_t){ .log = stderr, .watchfd = -1, .root = { .kind = TDB_TAG_ENTRY, .nlookup = 1 },
+		.invalTail = &ctx.invalHead, .fdCap = TAGFS_FD_CACHE, .ctlfd = -1 };
+	pthread_rwlock_init(&ctx.lock, NULL);
+	pthread_mutex_init(&ctx.attrLock, NULL);
+	pthread_mutex_init(&ctx.nodeLock, NULL);
+	pthread_mutex_init(&ctx.fdLock, NULL);
+	pthread_mutex_init(&ctx.rsvLock, NULL);
+	pthread_cond_init(&ctx.rsvCond, NULL);
+
+	if((ctx.dirfd = open(dirpath, O_RDONLY | O_DIRECTORY)) < 0 || fstat(ctx.dirfd, &ctx.realStat))
+		faile();
+
+	FILE *f = fdopen(openat(ctx.dirfd, ".tagdb", O_RDWR | O_CREAT, 0600), "w+");
+
+	if(!f)
+		faile();
+
+	fprintf(f, "%s\n", tag);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		int fd = openat(ctx.dirfd, files[i], O_WRONLY | O_CREAT, 0600);
+
+		if(fd < 0)
+			faile();
+
+		close(fd);
+		fprintf(f, "%s\n", files[i]);
+	}
+
+	fputc('\n', f);
+	rewind(f);
+
+	assertMsg((ctx.tdb = tdb_open(f, stderr)), "Cannot open tagdb: %s\n", strerror(errno))
+	assertMsg(tdb_journal(ctx.tdb, openat(ctx.dirfd, ".tagdb.journal", O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)),
+		"Cannot open journal: %s\n", strerror(errno))
+	assertMsg(tagfs_watch_init(&ctx, dirpath), "Cannot watch '%s': %s\n", dirpath, strerror(errno))
+
+	realdir_fix_t fix;
+
+	assertMsg(realdir_chk(ctx.tdb, ctx.dirfd, 0, stderr, true, &fix) == 0, "Real directory doesn't match the tagdb\n")
+	ctx.listed = realdir_fix(ctx.tdb, &fix, stderr) == 0;
+
+	if((errno = pthread_create(&ctx.watcher, NULL, tagfs_watch, &ctx)))
+		faile();
+}
+
+static void cleanup(const char **files, size_t count)
+{
+	pthread_cancel(ctx.watcher);
+	pthread_join(ctx.watcher, NULL);
+	close(ctx.watchfd);
+	tagfs_fd_clear(&ctx);
+
+	for (size_t i = 0; i < count; i++)
+		unlinkat(ctx.dirfd, files[i], 0);
+
+	unlinkat(ctx.dirfd, ".tagdb", 0);
+	unlinkat(ctx.dirfd, ".tagdb.journal", 0);
+	tdb_destroy(ctx.tdb);
+	close(ctx.dirfd);
+	rmdir(dirpath);
+}
+
+/* Waits until the watcher has applied the rename of a real file from one name to the other */
+static void settle(const char *from, const char *to)
+{
+	tagfs_rsv_t rsv;
+
+	// the watcher holds back a MOVED_FROM event for TAGFS_MOVE_WAIT ms, and applies it with both names reserved
+	usleep(TAGFS_MOVE_WAIT * 20000);
+	tagfs_reserve(&ctx, &rsv, from, to);
+	tagfs_unreserve(&ctx, &rsv);
+}
+
+void testWatchRename()
+{
+	const char *files[] = { "a", "b", "c" };
+	setup(files, 3, "tag");
+
+	tagfs_node_t *a = tagfs_node_file(&ctx, "a"), *b = tagfs_node_file(&ctx, "b");
+	tagfs_fd_t *fd = NULL;
+
+	assertMsg(a && b, "Cannot create nodes: %s\n", strerror(errno))
+
+	// an fd of a is cached once released
+	pthread_rwlock_rdlock(&ctx.lock);
+	assertMsg((fd = tagfs_fd_open(&ctx, a, O_RDONLY)), "Cannot open 'a': %s\n", strerror(errno))
+	pthread_rwlock_unlock(&ctx.lock);
+	tagfs_fd_release(&ctx, fd);
+
+	replied = -1;
+	tagfs_rename(NULL, FUSE_ROOT_ID, "a", FUSE_ROOT_ID, "b", 0);
+	assertMsg(!replied, "Cannot rename 'a' to 'b': %s\n", strerror(replied))
+	settle("a", "b");
+
+	// the events of the rename through tagfs are its own, so neither the node of a nor its fds are dropped again
+	assertMsg(tagfs_node_hasFile(&ctx, "b") && !strcmp(a->name, "b") && a->indexed, "Node of 'a' lost its inode\n")
+	assertMsg(!b->indexed, "Node of the replaced file is still found\n")
+	assertMsg(a->fds, "Cached fd of 'a' was dropped\n")
+	assertMsg(!tdb_get(ctx.tdb, "a") && tdb_get(ctx.tdb, "b"), "Entry of 'a' wasn't renamed\n")
+
+	// a rename outside of tagfs moves the node and entry with the file
+	if(renameat(ctx.dirfd, "b", ctx.dirfd, "c"))
+		faile();
+
+	settle("b", "c");
+	assertMsg(tagfs_node_hasFile(&ctx, "c") && !strcmp(a->name, "c"), "Node didn't follow the real file\n")
+	assertMsg(!tdb_get(ctx.tdb, "b") && tdb_get(ctx.tdb, "c"), "Entry didn't follow the real file\n")
+
+	tagfs_node_forget(&ctx, a, 1);
+	tagfs_node_forget(&ctx, b, 1);
+	cleanup(files, 3);
+}
+
+void testRenameInvalid()
+{
+	const char *files[] = { "a" };
+	const char *names[] = { "tag", ".tag", ".tagdb", "-a" };
+	const int errs[] = { EISDIR, EISDIR, EEXIST, EINVAL };
+	setup(files, 1, "tag");
+
+	// names that can't belong to a file are refused before the real file is renamed
+	for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++)
+	{
+		replied = -1;
+		tagfs_rename(NULL, FUSE_ROOT_ID, "a", FUSE_ROOT_ID, names[i], 0);
+		assertMsg(replied == errs[i], "Renaming 'a' to '%s' replied '%s'\n", names[i], strerror(replied))
+		assertMsg(!faccessat(ctx.dirfd, "a", F_OK, 0), "Real file 'a' was renamed to '%s'\n", names[i])
+	}
+
+	tagdb_entry_t *tag = tdb_get(ctx.tdb, "tag"), *a = tdb_get(ctx.tdb, "a");
+
+	assertMsg(tag && tag->kind == TDB_TAG_ENTRY && a && a->kind == TDB_FILE_ENTRY, "Entries changed\n")
+	assertMsg(tdb_entry_get(ctx.tdb, a, tag->tagId), "'a' lost its tag\n")
+
+	cleanup(files, 1);
+}
+
+void testMkdirTaken()
+{
+	const char *files[] = { "a", "f" };
+	setup(files, 1, "tag");
+
+	// a real file the tagdb may not know of yet, as if the directory weren't watched
+	int fd = openat(ctx.dirfd, "f", O_WRONLY | O_CREAT, 0600);
+
+	if(fd < 0)
+		faile();
+
+	close(fd);
+	ctx.listed = false;
+
+	const char *names[] = { "f", "a", ".tag", ".tagdb", "-x" };
+	const int errs[] = { EEXIST, EEXIST, EEXIST, EEXIST, EINVAL };
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++)
+	{
+		replied = -1;
+		tagfs_mkdir(NULL, FUSE_ROOT_ID, names[i], 0);
+		assertMsg(replied == errs[i], "mkdir '%s' replied '%s'\n", names[i], strerror(replied))
+
+		tagdb_entry_t *e = tdb_get(ctx.tdb, names[i]);
+
+		assertMsg(!e || e->kind == TDB_FILE_ENTRY, "mkdir '%s' created a tag\n", names[i])
+	}
+
+	cleanup(files, 2);
+}
+
+const test_t tests[] = { testWatchRename, testRenameInvalid, testMkdirTaken };